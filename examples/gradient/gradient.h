@@ -23,5 +23,5 @@ typedef struct
  
 } USERDATA;
 
-extern USERDATA *mydata;
+EXTERN_USERDATA(USERDATA)
 
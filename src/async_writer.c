@@ -0,0 +1,202 @@
+/* Background writer thread, see async_writer.h.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<time.h>
+#include<pthread.h>
+
+#include"async_writer.h"
+
+typedef struct {
+  char *buf;
+  size_t size;       // allocated bytes
+  size_t len;        // bytes used
+  writer_task task;
+} writer_slot;
+
+// the slots form a ring, queued ones start at head, the next free one is
+// head + queued. Without the thread there is only slots[0].
+static writer_slot *slots = NULL;
+static int n_slots = 0;
+static int head = 0, queued = 0;
+static int async = 0;
+static int quit = 0;
+
+static pthread_t writer_thread;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_queued = PTHREAD_COND_INITIALIZER; // a slot was queued, or quit
+static pthread_cond_t writer_freed = PTHREAD_COND_INITIALIZER;  // a slot was written
+
+static writer_stats stats;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void *writer(void *p)
+{
+  pthread_mutex_lock(&writer_lock);
+  while (1)
+    {
+      while (queued == 0 && !quit)
+	pthread_cond_wait(&writer_queued, &writer_lock);
+      if (queued == 0)
+	break;
+      writer_slot *s = &slots[head];
+      pthread_mutex_unlock(&writer_lock);
+
+      double t = now();
+      s->task(s->buf, s->len);
+      t = now() - t;
+
+      pthread_mutex_lock(&writer_lock);
+      stats.busy_time += t;
+      head = (head + 1) % n_slots;
+      queued--;
+      pthread_cond_signal(&writer_freed);
+    }
+  pthread_mutex_unlock(&writer_lock);
+  return NULL;
+}
+
+static void free_slots(void)
+{
+  for (int i = 0; i < n_slots; i++)
+    free(slots[i].buf);
+  free(slots);
+  slots = NULL;
+  n_slots = 0;
+  head = queued = 0;
+}
+
+/* Start the writer with n_buffers staging buffers, or run the tasks
+ * synchronously if n_buffers is 0. Writes out anything still queued from
+ * an earlier writer_init().
+ */
+void writer_init(int n_buffers)
+{
+  writer_finish();
+  if (n_buffers < 0)
+    n_buffers = 0;
+
+  n_slots = n_buffers ? n_buffers : 1;
+  slots = calloc(n_slots, sizeof(writer_slot));
+  if (slots == NULL)
+    {
+      fprintf(stderr, "Could not allocate the writer buffers.\n");
+      exit(1);
+    }
+
+  if (n_buffers > 0)
+    {
+      quit = 0;
+      if (pthread_create(&writer_thread, NULL, writer, NULL))
+	{
+	  fprintf(stderr, "Could not start the writer thread.\n Writing on the simulation thread.\n");
+	  return;
+	}
+      async = 1;
+    }
+}
+
+char *writer_acquire(size_t len)
+{
+  if (slots == NULL)
+    writer_init(0);
+
+  writer_slot *s;
+  if (async)
+    {
+      pthread_mutex_lock(&writer_lock);
+      if (queued == n_slots)
+	{
+	  double t = now();
+	  while (queued == n_slots)
+	    pthread_cond_wait(&writer_freed, &writer_lock);
+	  stats.stalls++;
+	  stats.stall_time += now() - t;
+	}
+      s = &slots[(head + queued) % n_slots];
+      pthread_mutex_unlock(&writer_lock);
+    }
+  else
+    s = &slots[0];
+
+  if (len > s->size)
+    {
+      free(s->buf);
+      s->buf = malloc(len);
+      if (s->buf == NULL)
+	{
+	  fprintf(stderr, "Could not allocate a writer buffer of %zu bytes.\n", len);
+	  exit(1);
+	}
+      s->size = len;
+    }
+  return s->buf;
+}
+
+void writer_submit(writer_task task, size_t len)
+{
+  if (!async)
+    {
+      double t = now();
+      task(slots[0].buf, len);
+      stats.busy_time += now() - t;
+      stats.submitted++;
+      stats.bytes += len;
+      if (stats.max_queued < 1)
+	stats.max_queued = 1;
+      return;
+    }
+
+  pthread_mutex_lock(&writer_lock);
+  writer_slot *s = &slots[(head + queued) % n_slots];
+  s->task = task;
+  s->len = len;
+  queued++;
+  stats.submitted++;
+  stats.bytes += len;
+  if (queued > stats.max_queued)
+    stats.max_queued = queued;
+  pthread_cond_signal(&writer_queued);
+  pthread_mutex_unlock(&writer_lock);
+}
+
+void writer_drain(void)
+{
+  if (!async)
+    return;
+  pthread_mutex_lock(&writer_lock);
+  while (queued > 0)
+    pthread_cond_wait(&writer_freed, &writer_lock);
+  pthread_mutex_unlock(&writer_lock);
+}
+
+void writer_finish(void)
+{
+  if (async)
+    {
+      pthread_mutex_lock(&writer_lock);
+      quit = 1;
+      pthread_cond_signal(&writer_queued);
+      pthread_mutex_unlock(&writer_lock);
+      pthread_join(writer_thread, NULL);
+      async = 0;
+    }
+  free_slots();
+}
+
+void writer_get_stats(writer_stats *st)
+{
+  pthread_mutex_lock(&writer_lock);
+  *st = stats;
+  pthread_mutex_unlock(&writer_lock);
+}
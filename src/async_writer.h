@@ -0,0 +1,51 @@
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include<stddef.h>
+
+/* A background thread for the output written during the run: the saved
+ * states and the video frames.
+ *
+ * The simulation thread copies what is to be written into a staging
+ * buffer from writer_acquire(), and hands it over with writer_submit().
+ * The writer thread then calls the task on the buffer, which formats the
+ * data and writes it to disk, while the simulation goes on. Buffers are
+ * written in the order they were submitted.
+ *
+ * There are n_buffers staging buffers. When all of them are waiting to be
+ * written, writer_acquire() blocks until one is free, so the writer can't
+ * fall more than n_buffers behind. The time spent waiting is counted in
+ * the statistics, and is a sign that the run is limited by the output.
+ *
+ * Only one buffer may be acquired at a time, from one thread. Without
+ * writer_init(), or with n_buffers 0, the tasks run in writer_submit().
+ */
+typedef void (*writer_task)(char *data, size_t len);
+
+typedef struct {
+  long submitted;       // buffers handed to the writer
+  double bytes;         // their total size
+  int max_queued;       // most buffers waiting to be written at once
+  long stalls;          // times writer_acquire() had to wait for a buffer
+  double stall_time;    // time spent waiting in writer_acquire(), in s
+  double busy_time;     // time spent in the tasks, in s
+} writer_stats;
+
+// Start the writer thread with n_buffers staging buffers.
+void writer_init(int n_buffers);
+
+// A staging buffer of at least len bytes.
+char *writer_acquire(size_t len);
+
+// Queue the buffer from writer_acquire(), with len bytes used, for task.
+void writer_submit(writer_task task, size_t len);
+
+// Wait until all submitted buffers have been written.
+void writer_drain(void);
+
+// Write the remaining buffers and stop the writer thread.
+void writer_finish(void);
+
+void writer_get_stats(writer_stats *stats);
+
+#endif
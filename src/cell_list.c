@@ -0,0 +1,138 @@
+/* Flat cell list for finding neighbors, rebuilt every step with a counting sort.
+ *
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#define NDEBUG // define to turn assertions off
+#include<assert.h>
+#include"skilobot.h"
+#include"neighbors.h"
+#include"cell_list.h"
+
+static void cell_list_reserve(cell_list *cl, size_t n_cells, int n_bots)
+{
+  if (cl->allocated_cells < n_cells+1)
+    {
+      cl->allocated_cells = 2*n_cells + 1;
+      cl->cell_start = realloc(cl->cell_start, cl->allocated_cells * sizeof(int));
+      assert(cl->cell_start != NULL);
+    }
+
+  if (cl->allocated_bots < n_bots)
+    {
+      cl->allocated_bots = n_bots;
+      cl->bots     = realloc(cl->bots,     n_bots * sizeof(int));
+      cl->bot_cell = realloc(cl->bot_cell, n_bots * sizeof(int));
+      cl->x        = realloc(cl->x,        n_bots * sizeof(double));
+      cl->y        = realloc(cl->y,        n_bots * sizeof(double));
+      assert(cl->bots != NULL && cl->bot_cell != NULL && cl->x != NULL && cl->y != NULL);
+    }
+}
+
+/* Bin all bots into cells of side range+eps covering the bounding box min - max.
+ */
+void cell_list_build(cell_list *cl, int n_bots, coord2D min, coord2D max, double range)
+{
+  double eps = .1; // small margin, so that a pair at exactly range is never two cells apart
+
+  cl->cell_sz = range + eps;
+  cl->offset = min;
+  cl->x_size = (size_t) ((max.x - min.x) / cl->cell_sz) + 1;
+  cl->y_size = (size_t) ((max.y - min.y) / cl->cell_sz) + 1;
+
+  size_t n_cells = cl->x_size * cl->y_size;
+  cell_list_reserve(cl, n_cells, n_bots);
+
+  // count the bots in each cell, cell c is counted in cell_start[c+1]
+  int *start = cl->cell_start;
+  memset(start, 0, (n_cells+1) * sizeof(int));
+  for (int i = 0; i < n_bots; i++)
+    {
+      size_t cx = (kinematics.x[i] - min.x) / cl->cell_sz;
+      size_t cy = (kinematics.y[i] - min.y) / cl->cell_sz;
+      // rounding can put the outermost bot one past the edge
+      if (cx >= cl->x_size) cx = cl->x_size - 1;
+      if (cy >= cl->y_size) cy = cl->y_size - 1;
+
+      int c = cy * cl->x_size + cx;
+      cl->bot_cell[i] = c;
+      start[c+1]++;
+    }
+
+  for (size_t c = 0; c < n_cells; c++)
+    start[c+1] += start[c];
+
+  // scatter, using start[c] as the fill cursor of cell c.
+  // Afterwards start[c] is the start of cell c+1, shift it back.
+  for (int i = 0; i < n_bots; i++)
+    {
+      int k = start[cl->bot_cell[i]]++;
+      cl->bots[k] = i;
+      cl->x[k] = kinematics.x[i];
+      cl->y[k] = kinematics.y[i];
+    }
+  memmove(start+1, start, n_cells * sizeof(int));
+  start[0] = 0;
+}
+
+/* Add the pairs in range between two different cells. */
+static void cell_pairs(cell_list *cl, int c1, int c2, double sq_range, pair_buffer *out)
+{
+  for (int k = cl->cell_start[c1]; k < cl->cell_start[c1+1]; k++)
+    for (int l = cl->cell_start[c2]; l < cl->cell_start[c2+1]; l++)
+      {
+	double dx = cl->x[l] - cl->x[k];
+	double dy = cl->y[l] - cl->y[k];
+	double sq_d = dx*dx + dy*dy;
+	if (sq_d < sq_range)
+	  pair_buffer_add(out, cl->bots[k], cl->bots[l], sq_d);
+      }
+}
+
+/* Find all pairs closer than range with a bot in the stripe of cell rows
+ * cy_lo ... cy_hi-1, and add them to out.
+ *
+ * Uses a half-shell stencil: each cell is paired with itself and with the
+ * four neighbor cells to the right and above, so every pair of adjacent
+ * cells is visited once. Stripes only read the cell list, so different
+ * stripes can be searched in parallel.
+ */
+void cell_list_find_pairs(cell_list *cl, double range, size_t cy_lo, size_t cy_hi, pair_buffer *out)
+{
+  double sq_range = range * range;
+  size_t xs = cl->x_size;
+
+  for (size_t cy = cy_lo; cy < cy_hi; cy++)
+    for (size_t cx = 0; cx < xs; cx++)
+      {
+	int c = cy * xs + cx;
+	if (cl->cell_start[c] == cl->cell_start[c+1])
+	  continue;
+
+	// pairs within the cell
+	for (int k = cl->cell_start[c]; k < cl->cell_start[c+1]; k++)
+	  for (int l = k+1; l < cl->cell_start[c+1]; l++)
+	    {
+	      double dx = cl->x[l] - cl->x[k];
+	      double dy = cl->y[l] - cl->y[k];
+	      double sq_d = dx*dx + dy*dy;
+	      if (sq_d < sq_range)
+		pair_buffer_add(out, cl->bots[k], cl->bots[l], sq_d);
+	    }
+
+	if (cx+1 < xs)
+	  cell_pairs(cl, c, c+1, sq_range, out);
+
+	if (cy+1 < cl->y_size)
+	  {
+	    if (cx > 0)
+	      cell_pairs(cl, c, c+xs-1, sq_range, out);
+	    cell_pairs(cl, c, c+xs, sq_range, out);
+	    if (cx+1 < xs)
+	      cell_pairs(cl, c, c+xs+1, sq_range, out);
+	  }
+      }
+}
@@ -0,0 +1,28 @@
+#ifndef CELL_LIST_H
+#define CELL_LIST_H
+
+/* A flat cell list for finding bots within a given range of each other.
+ *
+ * Every step the bots are binned into square cells with a counting sort:
+ * the bots of cell c are bots[cell_start[c]] ... bots[cell_start[c+1]-1],
+ * in order of increasing index, and x[], y[] hold their positions in the
+ * same order. There are no per-cell allocations, and the pair search
+ * streams through contiguous arrays.
+ */
+typedef struct {
+  size_t x_size, y_size;
+  coord2D offset;    // lower left corner of cell (0,0)
+  double cell_sz;    // side of a cell, at least the search range
+
+  int *cell_start;   // x_size*y_size+1 entries
+  int *bots;         // bot indices, sorted by cell
+  double *x, *y;     // positions, in the same order as bots
+  int *bot_cell;     // the cell of each bot
+
+  size_t allocated_cells, allocated_bots;
+} cell_list;
+
+void cell_list_build(cell_list *cl, int n_bots, coord2D min, coord2D max, double range);
+void cell_list_find_pairs(cell_list *cl, double range, size_t cy_lo, size_t cy_hi, pair_buffer *out);
+
+#endif
@@ -0,0 +1,204 @@
+/* Binary checkpoints, see checkpoint.h.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno and fsync
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+
+#include"skilobot.h"
+#include"params.h"
+#include"rng.h"
+#include"tx_wheel.h"
+#include"checkpoint.h"
+
+extern int UserdataSize;
+
+#define CHECKPOINT_BUFFER (1 << 20)
+
+static void write_column(FILE *f, const double *column, int n_bots)
+{
+  fwrite(column, sizeof(double), n_bots, f);
+}
+
+static int read_column(FILE *f, double *column, int n_bots)
+{
+  return fread(column, sizeof(double), n_bots, f) == (size_t) n_bots;
+}
+
+int checkpoint_save(const char *filename, int n_bots, const checkpoint_run *run)
+{
+  size_t l = strlen(filename);
+  char *tmp = malloc(l + 5);
+  if (tmp == NULL)
+    return 0;
+  memcpy(tmp, filename, l);
+  strcpy(tmp + l, ".tmp");
+
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL)
+    {
+      free(tmp);
+      return 0;
+    }
+  setvbuf(f, NULL, _IOFBF, CHECKPOINT_BUFFER);
+
+  checkpoint_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CHECKPOINT_MAGIC, 8);
+  h.version = 1;
+  h.n_bots = n_bots;
+  h.bot_size = sizeof(kilobot);
+  h.userdata_size = UserdataSize;
+  h.n_hist = n_bots > 0 ? allbots[0]->n_hist : 0;
+  h.seed = rng_get_seed();
+  h.kilo_ticks = kilo_ticks;
+  h.tx_period_ticks = tx_period_ticks;
+  h.turn_left = kilo_turn_left;
+  h.turn_right = kilo_turn_right;
+  h.straight_left = kilo_straight_left;
+  h.straight_right = kilo_straight_right;
+  h.n_step = run->n_step;
+  h.video_frame = run->video_frame;
+  h.time = run->time;
+  h.timestep = simparams->timeStep;
+  h.state_offset = run->state_offset;
+  h.state_frames = run->state_frames;
+  h.state_format = run->state_format;
+  fwrite(&h, sizeof(h), 1, f);
+
+  write_column(f, kinematics.x, n_bots);
+  write_column(f, kinematics.y, n_bots);
+  write_column(f, kinematics.direction, n_bots);
+  write_column(f, kinematics.speed, n_bots);
+  write_column(f, kinematics.turn_rate_l, n_bots);
+  write_column(f, kinematics.turn_rate_r, n_bots);
+
+  for (int i = 0; i < n_bots; i++)
+    fwrite(allbots[i], sizeof(kilobot), 1, f);
+
+  size_t stride;
+  char *data = bots_userdata(&stride);
+  for (int i = 0; i < n_bots; i++)
+    fwrite(data + i * stride, 1, UserdataSize, f);
+
+  for (int i = 0; i < n_bots && h.n_hist > 0; i++)
+    fwrite(allbots[i]->history, sizeof(hist_point), h.n_hist, f);
+
+  // on disk before it replaces the previous checkpoint
+  int ok = fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0;
+  ok = (fclose(f) == 0) && ok;
+  if (ok)
+    ok = rename(tmp, filename) == 0;
+  else
+    remove(tmp);
+  free(tmp);
+  return ok;
+}
+
+static int read_header(FILE *f, checkpoint_header *h)
+{
+  return fread(h, sizeof(*h), 1, f) == 1 && memcmp(h->magic, CHECKPOINT_MAGIC, 8) == 0;
+}
+
+int checkpoint_bots(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return 0;
+  checkpoint_header h;
+  int n = read_header(f, &h) ? h.n_bots : 0;
+  fclose(f);
+  return n;
+}
+
+int checkpoint_load(const char *filename, int n_bots, checkpoint_run *run)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return 0;
+  setvbuf(f, NULL, _IOFBF, CHECKPOINT_BUFFER);
+
+  checkpoint_header h;
+  if (!read_header(f, &h) || h.version != 1 || h.n_bots != (uint32_t) n_bots)
+    {
+      fprintf(stderr, "%s is not a checkpoint of %d bots.\n", filename, n_bots);
+      fclose(f);
+      return 0;
+    }
+  if (h.bot_size != sizeof(kilobot) || h.userdata_size != (uint32_t) UserdataSize)
+    {
+      fprintf(stderr, "The checkpoint %s was written by a different program.\n", filename);
+      fclose(f);
+      return 0;
+    }
+  if (h.timestep != simparams->timeStep)
+    fprintf(stderr, "The checkpoint was written with timeStep %g, continuing with %g.\n",
+	    h.timestep, simparams->timeStep);
+
+  int ok = read_column(f, kinematics.x, n_bots) &&
+    read_column(f, kinematics.y, n_bots) &&
+    read_column(f, kinematics.direction, n_bots) &&
+    read_column(f, kinematics.speed, n_bots) &&
+    read_column(f, kinematics.turn_rate_l, n_bots) &&
+    read_column(f, kinematics.turn_rate_r, n_bots);
+
+  // the bots keep their own pointers
+  for (int i = 0; i < n_bots && ok; i++)
+    {
+      kilobot *bot = allbots[i], saved;
+      ok = fread(&saved, sizeof(kilobot), 1, f) == 1;
+      saved.history = bot->history;
+      saved.n_hist = bot->n_hist;
+      saved.user_setup = bot->user_setup;
+      saved.user_loop = bot->user_loop;
+      saved.kilo_message_tx = bot->kilo_message_tx;
+      saved.kilo_message_tx_success = bot->kilo_message_tx_success;
+      saved.kilo_message_rx = bot->kilo_message_rx;
+      saved.data = bot->data;
+      *bot = saved;
+    }
+
+  size_t stride;
+  char *data = bots_userdata(&stride);
+  for (int i = 0; i < n_bots && ok; i++)
+    ok = fread(data + i * stride, 1, UserdataSize, f) == (size_t) UserdataSize;
+
+  // the histories, if they have the same length in this run
+  int n_hist = n_bots > 0 ? allbots[0]->n_hist : 0;
+  if (ok && h.n_hist != (uint32_t) n_hist)
+    {
+      fprintf(stderr, "The histories in the checkpoint have a different length.\n Starting them anew.\n");
+      for (int i = 0; i < n_bots; i++)
+	allbots[i]->p_hist = allbots[i]->l_hist = 0;
+    }
+  else
+    for (int i = 0; i < n_bots && ok; i++)
+      ok = fread(allbots[i]->history, sizeof(hist_point), n_hist, f) == (size_t) n_hist;
+  fclose(f);
+  if (!ok)
+    {
+      fprintf(stderr, "The checkpoint %s is cut short.\n", filename);
+      return 0;
+    }
+
+  rng_seed(h.seed);
+  kilo_ticks = h.kilo_ticks;
+  tx_period_ticks = h.tx_period_ticks;
+  kilo_turn_left = h.turn_left;
+  kilo_turn_right = h.turn_right;
+  kilo_straight_left = h.straight_left;
+  kilo_straight_right = h.straight_right;
+  tx_wheel_reset();
+
+  run->time = h.time;
+  run->n_step = h.n_step;
+  run->video_frame = h.video_frame;
+  run->state_format = h.state_format;
+  run->state_offset = h.state_offset;
+  run->state_frames = h.state_frames;
+  return 1;
+}
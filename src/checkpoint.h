@@ -0,0 +1,71 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include<stdint.h>
+
+/* Binary checkpoints, with everything needed to continue a run exactly:
+ * the bots' structs, physics state, USERDATA and histories, the clock,
+ * the motor calibration and the seed of the simulator's random numbers.
+ *
+ * Layout, in the byte order of the machine that wrote the file:
+ *   header      a checkpoint_header
+ *   kinematics  double x[n], y[n], direction[n], speed[n],
+ *               turn_rate_l[n], turn_rate_r[n]
+ *   bots        the kilobot struct of each bot, bot_size bytes
+ *   userdata    userdata_size bytes for each bot
+ *   history     n_hist hist_points for each bot
+ *
+ * The structs are stored as they are in memory, so a checkpoint can only
+ * be loaded by the program that wrote it. The pointers in them are not
+ * restored: the bots keep their user data and history buffers, and the
+ * setup, loop and message functions set by the program's main().
+ */
+#define CHECKPOINT_MAGIC "KBCHKPT1"
+
+typedef struct {
+  char magic[8];            // CHECKPOINT_MAGIC
+  uint32_t version;         // 1
+  uint32_t n_bots;
+  uint32_t bot_size;        // sizeof(kilobot) of the program that wrote it
+  uint32_t userdata_size;   // bytes of user data per bot
+  uint32_t n_hist;          // history points per bot, 0 without storeHistory
+  uint32_t seed;            // seed of the simulator's random numbers
+  uint32_t kilo_ticks;
+  int32_t tx_period_ticks;
+  uint8_t turn_left, turn_right, straight_left, straight_right; // motor calibration
+  uint32_t n_step;          // the next step of the run
+  uint32_t video_frame;     // the next video frame
+  uint32_t reserved;
+  double time;              // simulation time in s
+  double timestep;          // simulation time step in s
+  uint64_t state_offset;    // size of the state file when the checkpoint was taken
+  uint32_t state_frames;    // states in the state file then
+  uint32_t state_format;    // stateFormat + 1 of the state file, 0 without one
+} checkpoint_header;
+
+// Where the run is, besides the state of the bots.
+typedef struct {
+  double time;
+  int n_step;
+  int video_frame;
+  // the state file, continued from here when the run is resumed
+  int state_format;         // stateFormat + 1, 0 without a state file
+  uint64_t state_offset;
+  int state_frames;
+} checkpoint_run;
+
+/* Write a checkpoint of the n_bots bots. The file is written under a
+ * temporary name and renamed when complete, so an earlier checkpoint is
+ * only replaced by a whole one. Returns 0 if the file can't be written.
+ */
+int checkpoint_save(const char *filename, int n_bots, const checkpoint_run *run);
+
+// The number of bots in a checkpoint file, 0 if it is not a checkpoint.
+int checkpoint_bots(const char *filename);
+
+/* Restore the bots from a checkpoint, after they were created and their
+ * main() was run, and fill in run. Returns 0 if the file doesn't match.
+ */
+int checkpoint_load(const char *filename, int n_bots, checkpoint_run *run);
+
+#endif
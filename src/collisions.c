@@ -0,0 +1,142 @@
+/* Jacobi collision solver, see collisions.h.
+ *
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<math.h>
+
+#include"skilobot.h"
+#include"params.h"
+#include"neighbors.h"
+#include"thread_pool.h"
+#include"collisions.h"
+
+static struct {
+  neighbor_store *s;
+  double clash, sq_clash;  // distance at which two bots touch
+  double *dx, *dy;         // displacement of each bot in this iteration
+  int allocated;
+  int *t_overlaps;         // number of overlaps found by each thread
+  int allocated_threads;
+} solver;
+
+/* The share of the separation of a and b that a moves. As in
+ * separate_clashing_bots(), a stationary bot pushed by a moving one
+ * moves pushDisplacement times as far.
+ */
+static double push_share(kilobot *a, kilobot *b)
+{
+  double pa = 1, pb = 1;
+  int ma = a->left_motor_power || a->right_motor_power;
+  int mb = b->left_motor_power || b->right_motor_power;
+
+  if (ma && !mb)
+    pb = simparams->pushDisplacement;
+  else if (!ma && mb)
+    pa = simparams->pushDisplacement;
+
+  return pa + pb > 0 ? pa / (pa + pb) : 0.5;
+}
+
+static void displacement_task(void *arg, int t, int n_threads)
+{
+  neighbor_store *s = solver.s;
+  int lo, hi;
+  pool_range(s->n_bots, t, n_threads, &lo, &hi);
+
+  int overlaps = 0;
+  for (int i = lo; i < hi; i++)
+    {
+      double dx = 0, dy = 0;
+      int n = 0;
+      for (int k = s->offset[i]; k < s->offset[i+1]; k++)
+	{
+	  int j = s->index[k];
+	  double sq_d = bot_sq_dist(i, j);
+	  if (sq_d >= solver.sq_clash)
+	    continue;
+
+	  // unit vector from the lower to the higher ID, so that both bots
+	  // of a pair use the same one, also when they are on top of each other
+	  int a = i < j ? i : j;
+	  int b = i < j ? j : i;
+	  double d = sqrt(sq_d);
+	  double ux = 1, uy = 0;
+	  if (d > 1e-6)
+	    {
+	      ux = (kinematics.x[b] - kinematics.x[a]) / d;
+	      uy = (kinematics.y[b] - kinematics.y[a]) / d;
+	    }
+
+	  double move = (solver.clash - d) * push_share(allbots[i], allbots[j]);
+	  if (i == a)
+	    move = -move;
+	  dx += move * ux;
+	  dy += move * uy;
+	  n++;
+	}
+
+      solver.dx[i] = dx;
+      solver.dy[i] = dy;
+      overlaps += n;
+    }
+  solver.t_overlaps[t] = overlaps;
+}
+
+static void apply_task(void *arg, int t, int n_threads)
+{
+  int lo, hi;
+  pool_range(solver.s->n_bots, t, n_threads, &lo, &hi);
+
+  for (int i = lo; i < hi; i++)
+    if (solver.dx[i] != 0 || solver.dy[i] != 0)
+      {
+	kinematics.x[i] += solver.dx[i];
+	kinematics.y[i] += solver.dy[i];
+	neighbors_mark_moved(i);
+      }
+}
+
+void solve_collisions_jacobi(neighbor_store *s, int n_bots, int iterations)
+{
+  int n_threads = pool_threads();
+  if (solver.allocated < n_bots)
+    {
+      solver.allocated = n_bots;
+      solver.dx = realloc(solver.dx, n_bots * sizeof(double));
+      solver.dy = realloc(solver.dy, n_bots * sizeof(double));
+      if (solver.dx == NULL || solver.dy == NULL)
+	{
+	  fprintf(stderr, "Could not allocate the collision displacements of %d bots.\n", n_bots);
+	  exit(1);
+	}
+    }
+  if (solver.allocated_threads < n_threads)
+    {
+      solver.allocated_threads = n_threads;
+      solver.t_overlaps = realloc(solver.t_overlaps, n_threads * sizeof(int));
+      if (solver.t_overlaps == NULL)
+	{
+	  fprintf(stderr, "Could not allocate the collision counts of %d threads.\n", n_threads);
+	  exit(1);
+	}
+    }
+
+  solver.s = s;
+  solver.clash = 2 * allbots[0]->radius;
+  solver.sq_clash = solver.clash * solver.clash;
+
+  for (int it = 0; it < iterations; it++)
+    {
+      pool_run(displacement_task, NULL);
+
+      int overlaps = 0;
+      for (int t = 0; t < n_threads; t++)
+	overlaps += solver.t_overlaps[t];
+      if (overlaps == 0)
+	break;
+
+      pool_run(apply_task, NULL);
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef COLLISIONS_H
+#define COLLISIONS_H
+
+/* Position based collision solver, used with collisionSolver = jacobi.
+ *
+ * Every iteration, each bot sums up the displacements that would resolve
+ * its overlaps with the bots in its row of the store s, and then all bots
+ * are moved at once (Jacobi style). Since no bot moves while the
+ * displacements are computed, the bots can be split between the threads,
+ * and the result does not depend on the order of the pairs or on the
+ * number of threads.
+ */
+void solve_collisions_jacobi(neighbor_store *s, int n_bots, int iterations);
+
+#endif
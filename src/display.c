@@ -13,6 +13,8 @@
 #include "SDL/SDL_thread.h"
 #include "SDL/SDL_timer.h"
 #include "skilobot.h"
+#include "obstacles.h"
+#include "async_writer.h"
 
 
 //for mkdir
@@ -40,6 +42,7 @@ ColorScheme darkColors = {
   .bot_line_front = 0x0000ffff,
   .bot_arrow      = 0xffffffff,
   .comm           = 0xffffff66, 
+  .obstacle       = 0x808080ff,
   .LEDa           = 0,
   .LEDb           = 85,
   .anti_alias      = 0,
@@ -54,6 +57,7 @@ ColorScheme brightColors = {
   .bot_line_front = 0x000000ff, // not visible, same color as outline
   .bot_arrow      = 0x000000ff,
   .comm           = 0x000000ff,
+  .obstacle       = 0x606060ff,
   .LEDa           = 63,
   .LEDb           = 64,
   .anti_alias     = 1
@@ -123,8 +127,8 @@ void move_bot_to_mouse(kilobot *bot)
 {
   int x, y;
   SDL_GetMouseState (&x, &y);
-  bot->x = (x - simparams->display_w/2) / simparams->display_scale + c_x;
-  bot->y = (y - simparams->display_h/2) / simparams->display_scale + c_y;
+  BOT_X(bot) = (x - simparams->display_w/2) / simparams->display_scale + c_x;
+  BOT_Y(bot) = (y - simparams->display_h/2) / simparams->display_scale + c_y;
 }
 
 /* try to grab a bot with the mouse*/
@@ -141,7 +145,7 @@ void rotateBot (kilobot *bot)
   int x, y;
   SDL_GetMouseState (&x, &y);
   
-  bot->direction = angle + (x-rotX0)*.05;
+  BOT_DIR(bot) = angle + (x-rotX0)*.05;
 }
 
 void grab_bot_rot(int x, int y)
@@ -150,7 +154,7 @@ void grab_bot_rot(int x, int y)
   if (grabbedRot)
     {
       rotX0 = x;
-      angle = grabbedRot->direction;
+      angle = BOT_DIR(grabbedRot);
     }
 }
 
@@ -198,6 +202,50 @@ void screenshot (SDL_Surface *s)
 
 
 
+// a video frame staged for the writer thread, followed by the pixels
+typedef struct {
+  char fileName[1000];
+  int w, h, pitch, bpp;
+  Uint32 rmask, gmask, bmask, amask;
+} frame_header;
+
+static void save_frame_task(char *data, size_t len)
+{
+  frame_header *fh = (frame_header *) data;
+  SDL_Surface *s = SDL_CreateRGBSurfaceFrom(data + sizeof(frame_header), fh->w, fh->h, fh->bpp, fh->pitch,
+					    fh->rmask, fh->gmask, fh->bmask, fh->amask);
+  if (s == NULL || SDL_SaveBMP(s, fh->fileName))
+    {
+      fprintf(stderr, "Error saving video frame to file %s\n", fh->fileName);
+      exit(1);
+    }
+  SDL_FreeSurface(s);
+}
+
+/* Save the surface as a BMP file, on the writer thread.
+ * The pixels are copied, so the surface can be drawn on right away.
+ */
+void save_frame(SDL_Surface *s, const char *fileName)
+{
+  size_t size = sizeof(frame_header) + (size_t) s->pitch * s->h;
+  char *data = writer_acquire(size);
+  frame_header *fh = (frame_header *) data;
+  snprintf(fh->fileName, sizeof(fh->fileName), "%s", fileName);
+  fh->w = s->w;
+  fh->h = s->h;
+  fh->pitch = s->pitch;
+  fh->bpp = s->format->BitsPerPixel;
+  fh->rmask = s->format->Rmask;
+  fh->gmask = s->format->Gmask;
+  fh->bmask = s->format->Bmask;
+  fh->amask = s->format->Amask;
+
+  SDL_LockSurface(s);
+  memcpy(data + sizeof(frame_header), s->pixels, (size_t) s->pitch * s->h);
+  SDL_UnlockSurface(s);
+  writer_submit(save_frame_task, size);
+}
+
 void input(void)
 {
   static int save_tx_period_ticks = 1;
@@ -502,10 +550,10 @@ void draw_commLines(SDL_Surface *surface)
       kilobot *from = commLines[i].from;
       kilobot *to   = commLines[i].to;
 
-      int x1 = simparams->display_w/2 + simparams->display_scale * (from->x - c_x); 
-      int y1 = simparams->display_h/2 + simparams->display_scale * (from->y - c_y);
-      int x2 = simparams->display_w/2 + simparams->display_scale * (to->x - c_x); 
-      int y2 = simparams->display_h/2 + simparams->display_scale * (to->y - c_y);  
+      int x1 = simparams->display_w/2 + simparams->display_scale * (BOT_X(from) - c_x); 
+      int y1 = simparams->display_h/2 + simparams->display_scale * (BOT_Y(from) - c_y);
+      int x2 = simparams->display_w/2 + simparams->display_scale * (BOT_X(to) - c_x); 
+      int y2 = simparams->display_h/2 + simparams->display_scale * (BOT_Y(to) - c_y);  
 
       if (colorscheme->anti_alias)
 	aalineColor (surface, x1, y1, x2, y2, colorscheme->comm);
@@ -514,6 +562,32 @@ void draw_commLines(SDL_Surface *surface)
     }
 }
 
+void draw_obstacles(SDL_Surface *surface)
+{
+  double scale = simparams->display_scale;
+  int w2 = simparams->display_w/2;
+  int h2 = simparams->display_h/2;
+
+  for (int i = 0; i < n_obstacles; i++)
+    {
+      obstacle *o = &obstacles[i];
+      int x1 = w2 + scale * (o->x1 - c_x);
+      int y1 = h2 + scale * (o->y1 - c_y);
+
+      if (o->type == OBSTACLE_CIRCLE)
+	filledCircleColor(surface, x1, y1, scale * o->r, colorscheme->obstacle);
+      else
+	{
+	  int x2 = w2 + scale * (o->x2 - c_x);
+	  int y2 = h2 + scale * (o->y2 - c_y);
+	  if (colorscheme->anti_alias)
+	    aalineColor(surface, x1, y1, x2, y2, colorscheme->obstacle);
+	  else
+	    lineColor(surface, x1, y1, x2, y2, colorscheme->obstacle);
+	}
+    }
+}
+
 Uint32 LEDcolor (kilobot *bot, float i_alpha)
 {
   //Uint32 ui_color = conv_RGBA(85 * bot->r_led, 85 * bot->g_led, 85 * bot->b_led, (int) i_alpha);
@@ -526,40 +600,30 @@ Uint32 LEDcolor (kilobot *bot, float i_alpha)
 /* Draw history */
 void draw_bot_history(SDL_Surface *surface, int w, int h, kilobot *bot)
 {
-  if (simparams->showHist) {
-    float i_alpha = 255.;
-    for (int i=bot->p_hist-1; i>=bot->p_hist-simparams->histLength && i >= 0; i--) {
-      //Uint32 ui_color = conv_RGBA(85 * bot->r_led, 85 * bot->g_led, 85 * bot->b_led, (int) i_alpha);
-      Uint32 ui_color = LEDcolor(bot, i_alpha);
-      i_alpha = i_alpha * (1-3.0/simparams->histLength);
-      filledCircleColor(surface,
-			simparams->display_w/2 + simparams->display_scale * (bot->x_history[i] - c_x),
-			simparams->display_h/2 + simparams->display_scale * (bot->y_history[i] - c_y),
-			simparams->display_scale * 2, ui_color);
-    }
-  }
+  // the history is always kept in a ring buffer
+  draw_bot_history_ring(surface, w, h, bot);
 }
 
-/* Draw history using a ring buffer of length simparams->histLength */
+/* Draw history using a ring buffer of n_hist points, see update_bot_history() */
 void draw_bot_history_ring(SDL_Surface *surface, int w, int h, kilobot *bot)
 {
   if (simparams->showHist) {
     float i_alpha = 255.;
-    //    for (int i=bot->p_hist-1; i!=bot->p_hist; i = (i-1+simparams->histLength)%simparams->histLength)
+    double x, y;
 
-    // p_hist is ONE PAST the most recently stored point in the ring buffer
+    // age 0 is the most recently stored point
     // l_hist is the number of history points so far
     // n_hist is the ring buffer size
-    for (int ii=1; ii < bot->l_hist && ii < bot->n_hist; ii++)
+    for (int age=0; age < bot->l_hist - 1; age++)
       {
-	int i = (bot->p_hist - ii + simparams->histLength) % simparams->histLength;
+	bot_history_point(bot, age, &x, &y);
 
 	//Uint32 ui_color = conv_RGBA(85 * bot->r_led, 85 * bot->g_led, 85 * bot->b_led, (int) i_alpha);
 	Uint32 ui_color = LEDcolor(bot, i_alpha);
-	i_alpha = i_alpha * (1-3.0/simparams->histLength);
+	i_alpha = i_alpha * (1-3.0/bot->n_hist);
 	filledCircleColor(surface,
-			  simparams->display_w/2 + simparams->display_scale * (bot->x_history[i] - c_x),
-			  simparams->display_h/2 + simparams->display_scale * (bot->y_history[i] - c_y),
+			  simparams->display_w/2 + simparams->display_scale * (x - c_x),
+			  simparams->display_h/2 + simparams->display_scale * (y - c_y),
 			  simparams->display_scale * 2, ui_color);
       }
   }
@@ -581,8 +645,8 @@ void draw_bot(SDL_Surface *surface, int w, int h, kilobot *bot)
  
   /* Draw the bot's body */
     
-  int draw_x = w/2 + scale * (bot->x - c_x);
-  int draw_y = h/2 + scale * (bot->y - c_y);
+  int draw_x = w/2 + scale * (BOT_X(bot) - c_x);
+  int draw_y = h/2 + scale * (BOT_Y(bot) - c_y);
   
   bot->screen_x = draw_x;
   bot->screen_y = draw_y;
@@ -594,21 +658,21 @@ void draw_bot(SDL_Surface *surface, int w, int h, kilobot *bot)
 
 
   /* Draw line to front */
-  int x_front = draw_x + scale * r * sin(bot->direction);
-  int y_front = draw_y + scale * r * cos(bot->direction);
+  int x_front = draw_x + scale * r * sin(BOT_DIR(bot));
+  int y_front = draw_y + scale * r * cos(BOT_DIR(bot));
   lineColor(screen, draw_x, draw_y, x_front, y_front, colorscheme->bot_line_front);
 
   
   /* Draw legs */
-  //int x_l = draw_x - scale * r * cos(bot->direction);
-  //int y_l = draw_y + scale * r * sin(bot->direction);
-  int x_l = draw_x + scale * r * sin(bot->direction + bot->leg_angle);
-  int y_l = draw_y + scale * r * cos(bot->direction + bot->leg_angle);
+  //int x_l = draw_x - scale * r * cos(BOT_DIR(bot));
+  //int y_l = draw_y + scale * r * sin(BOT_DIR(bot));
+  int x_l = draw_x + scale * r * sin(BOT_DIR(bot) + bot->leg_angle);
+  int y_l = draw_y + scale * r * cos(BOT_DIR(bot) + bot->leg_angle);
     
-  //int x_r = draw_x + scale * r * cos(bot->direction);
-  //int y_r = draw_y - scale * r * sin(bot->direction);
-  int x_r = draw_x + scale * r * sin(bot->direction - bot->leg_angle);
-  int y_r = draw_y + scale * r * cos(bot->direction - bot->leg_angle);
+  //int x_r = draw_x + scale * r * cos(BOT_DIR(bot));
+  //int y_r = draw_y - scale * r * sin(BOT_DIR(bot));
+  int x_r = draw_x + scale * r * sin(BOT_DIR(bot) - bot->leg_angle);
+  int y_r = draw_y + scale * r * cos(BOT_DIR(bot) - bot->leg_angle);
   if (colorscheme->anti_alias && scale > 1) // for smaller scales it draws weird legs 
     {
       aacircleColor(surface, x_r, y_r, scale * 2, colorscheme->bot_right_leg);
@@ -635,12 +699,12 @@ void draw_bot(SDL_Surface *surface, int w, int h, kilobot *bot)
 
   
   /* Draw a triangle pointing forward */
-  int txf = draw_x + scale * r*.4 * sin(bot->direction);
-  int tyf = draw_y + scale * r*.4 * cos(bot->direction);
-  int tx1 = draw_x + scale * r*.4 * sin(bot->direction+2*M_PI*.4);
-  int ty1 = draw_y + scale * r*.4 * cos(bot->direction+2*M_PI*.4);
-  int tx2 = draw_x + scale * r*.4 * sin(bot->direction-2*M_PI*.4);
-  int ty2 = draw_y + scale * r*.4 * cos(bot->direction-2*M_PI*.4);
+  int txf = draw_x + scale * r*.4 * sin(BOT_DIR(bot));
+  int tyf = draw_y + scale * r*.4 * cos(BOT_DIR(bot));
+  int tx1 = draw_x + scale * r*.4 * sin(BOT_DIR(bot)+2*M_PI*.4);
+  int ty1 = draw_y + scale * r*.4 * cos(BOT_DIR(bot)+2*M_PI*.4);
+  int tx2 = draw_x + scale * r*.4 * sin(BOT_DIR(bot)-2*M_PI*.4);
+  int ty2 = draw_y + scale * r*.4 * cos(BOT_DIR(bot)-2*M_PI*.4);
 
   if (colorscheme->anti_alias)
     aatrigonColor (screen, txf, tyf, tx1, ty1, tx2, ty2, colorscheme->bot_arrow);
@@ -14,6 +14,7 @@ typedef struct {
   Uint32 bot_arrow;
   Uint32 bot_line_front;
   Uint32 comm;
+  Uint32 obstacle;
   double LEDa, LEDb;
   int anti_alias;
 } ColorScheme;
@@ -28,8 +29,10 @@ void draw_bot(SDL_Surface *surface, int w, int h, kilobot *bot);
 void draw_bot_history(SDL_Surface *surface, int w, int h, kilobot *bot);
 void draw_bot_history_ring(SDL_Surface *surface, int w, int h, kilobot *bot);
 void draw_commLines(SDL_Surface *surface);
+void draw_obstacles(SDL_Surface *surface);
 void draw_status(SDL_Surface *surface, int w, int h, double time, double FPS);
 void set_display_center(double X, double Y);
+void save_frame(SDL_Surface *s, const char *fileName);
 
 extern ColorScheme *colorscheme;
 extern ColorScheme darkColors, brightColors;
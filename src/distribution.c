@@ -7,6 +7,7 @@
 #include"skilobot.h"
 #include"params.h"
 #include"stateio.h"
+#include"rng.h"
 
 
 
@@ -24,23 +25,23 @@ void distribute_pile2(int n_bots);
 void distribute_line(int n_bots)
 {
   for (int i=0; i < n_bots; i++) {
-    allbots[i]->x += 60 * i - 40 * (n_bots - 1);
+    kinematics.x[i] += 60 * i - 40 * (n_bots - 1);
   }
 }
 
 void distribute_rline(int n_bots)
 {
   for (int i=0; i < n_bots; i++) {
-    allbots[i]->x += 50 * (n_bots - i) - 40 * (n_bots - 1);
+    kinematics.x[i] += 50 * (n_bots - i) - 40 * (n_bots - 1);
   }
 }
 
 void distribute_rand(int n_bots, int w, int h)
 {
   for (int i=0; i < n_bots; i++) {
-    allbots[i]->x = rand()%w - w/2;
-    allbots[i]->y = rand()%h - h/2;
-    allbots[i]->direction = 2 * M_PI * (float) rand() / (float) RAND_MAX;
+    kinematics.x[i] = (int) (rng_u32(RNG_DISTRIBUTE, i, 0, 0) % w) - w/2;
+    kinematics.y[i] = (int) (rng_u32(RNG_DISTRIBUTE, i, 1, 0) % h) - h/2;
+    kinematics.direction[i] = 2 * M_PI * rng_uniform(RNG_DISTRIBUTE, i, 2, 0);
   }
 }
 
@@ -57,9 +58,9 @@ void distribute_circle(int n_bots)
 
 	while(bot < n_bots){
 
-		allbots[bot]->x = x_value;
-		allbots[bot]->y = y_value;
-		allbots[bot]->direction = alpha;
+		kinematics.x[bot] = x_value;
+		kinematics.y[bot] = y_value;
+		kinematics.direction[bot] = alpha;
 
 		theta += delta_theta;
 		alpha = theta - M_PI/4;
@@ -84,9 +85,9 @@ void distribute_pile(int n_bots)
 
     while(bot < n_bots){
 
-    	allbots[bot]->x = x_value;
-    	allbots[bot]->y = y_value;
-    	allbots[bot]->direction = alpha;
+    	kinematics.x[bot] = x_value;
+    	kinematics.y[bot] = y_value;
+    	kinematics.direction[bot] = alpha;
 
     	max_n_bots--;
     	if(max_n_bots > 0){
@@ -128,9 +129,9 @@ void distribute_random_pile(int n_bots)
 
     while(bot < n_bots){
 
-    	allbots[bot]->x = x_value;
-    	allbots[bot]->y = y_value;
-    	allbots[bot]->direction =  ((float)rand()/(float)(RAND_MAX)) * (2*M_PI);
+    	kinematics.x[bot] = x_value;
+    	kinematics.y[bot] = y_value;
+    	kinematics.direction[bot] =  rng_uniform(RNG_DISTRIBUTE, bot, 2, 0) * (2*M_PI);
 
     	max_n_bots--;
     	if(max_n_bots > 0){
@@ -166,9 +167,9 @@ void distribute_elipse(int n_bots)
 
     while(bot < n_bots){
 
-    	allbots[bot]->x = x_value;
-    	allbots[bot]->y = y_value;
-    	allbots[bot]->direction = alpha;
+    	kinematics.x[bot] = x_value;
+    	kinematics.y[bot] = y_value;
+    	kinematics.direction[bot] = alpha;
 
     	max_n_bots--;
     	if(max_n_bots > 0){
@@ -221,10 +222,10 @@ void distribute_pile2(int n_bots)
       
       if (cont<n_bots)
 	{
-	  allbots[cont]->x = pos_x;
-	  allbots[cont]->y = pos_y;
-	  allbots[cont]->direction = ((float)rand()/(float)(RAND_MAX)) * (2*M_PI);
-	  //allbots[cont]->direction = 0;
+	  kinematics.x[cont] = pos_x;
+	  kinematics.y[cont] = pos_y;
+	  kinematics.direction[cont] = rng_uniform(RNG_DISTRIBUTE, cont, 2, 0) * (2*M_PI);
+	  //kinematics.direction[cont] = 0;
 	}
       cont++;
       
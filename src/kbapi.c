@@ -1,17 +1,18 @@
 #include <math.h>
 #include "skilobot.h"
 #include "kilolib.h"
+#include "rng.h"
+#include "light_raster.h"
 
 /* pointers to messaging functions 
  * the kilobot program typically sets these in main()
  *
- * for simplicity we have only ONE set of these instead of
- * one for each bot. If all bots register the same functions, 
- * this will work.
+ * prepare_bot() loads the current bot's functions here and
+ * finalize_bot() stores them back. Thread local, like current_bot.
  */
-message_tx_t kilo_message_tx = NULL;
-message_tx_success_t kilo_message_tx_success = NULL;
-message_rx_t kilo_message_rx = NULL;
+__thread message_tx_t kilo_message_tx = NULL;
+__thread message_tx_success_t kilo_message_tx_success = NULL;
+__thread message_rx_t kilo_message_rx = NULL;
 
 
 /* the clock variable. Counts ticks since beginning of the program.
@@ -21,7 +22,7 @@ message_rx_t kilo_message_rx = NULL;
 volatile uint32_t kilo_ticks = 0;
 
 // the simulator will copy a new UID here, before calling each bot
-uint16_t kilo_uid = 0;
+__thread uint16_t kilo_uid = 0;
 
 /* motor calibration values 
  * In the kilobots, these are different for each robot, and are stored in the EEPROM.
@@ -124,12 +125,13 @@ void delay (uint16_t ms)
 }
 
 /* Hardware random number generator - "truly random" in the bot.
- * In the simulator, we use rand(), with the SAME generator shared by all bots
- * and shared by the simulator itself, if it uses rand somewhere internally.
+ * In the simulator, each bot draws from its own stream of the counter based
+ * generator, so the numbers do not depend on the order the bots are run in.
  */
 uint8_t rand_hard()
 {
-  return rand() & 0xFF;
+  kilobot* self = Me();
+  return rng_u32(RNG_HARD, self->ID, kilo_ticks, self->rand_count++) & 0xFF;
 }
 
 /* Software random number generator.
@@ -152,17 +154,25 @@ void rand_seed(uint8_t seed)
 }
 
 
+/* Transmission period of this bot, takes effect after the next transmission.
+ * Not in kilolib, where the period is fixed.
+ */
+void set_tx_period(uint16_t ticks)
+{
+  Me()->tx_period = ticks;
+}
+
 float get_potential(int type)
 {
   kilobot* self = Me();
   switch(type)
     {
     case POT_LINEAR:
-      return self->x;
+      return BOT_X(self);
     case POT_PARABOLIC: 
-      return pow(self->x, 2) + pow(self->y, 2);
+      return pow(BOT_X(self), 2) + pow(BOT_Y(self), 2);
     case POT_GRAVITY:
-      return 1.0 / hypot(self->x, self->y);      
+      return 1.0 / hypot(BOT_X(self), BOT_Y(self));      
     default:
       return 0;
     }
@@ -176,12 +186,14 @@ int16_t get_ambientlight()
 {
   kilobot* self = Me();
   int l;
+  double v;
 
-  if (user_light != NULL)
-	  l = user_light(self->x, self->y);
+  if (light_raster_lookup(BOT_X(self), BOT_Y(self), &v))
+	  l = v;
+  else if (light_bot_lookup(self->ID, &v))
+	  l = v;
   else
-  // parabolic well
-  	  l = ( pow(self->x, 2) + pow(self->y, 2) )/1000;
+	  l = light_field(BOT_X(self), BOT_Y(self));
 
   // constrain to interval [0,1023]
   if (l > 1023)
@@ -73,12 +73,29 @@ void set_callback_global_setup(void(*fp)(void));
 void set_callback_obstacles(int16_t (*fp)(double, double, double *, double *));
 void set_callback_lighting(int16_t (*fp)(double, double));
 
+/* Batch variants of the obstacles and lighting callbacks, called once per
+ * time step with the positions x[0..n-1], y[0..n-1] of all bots. The
+ * obstacles callback fills push_x and push_y with the displacement of each
+ * bot, 0 for bots not touching an obstacle. The lighting callback fills
+ * light with the light level at each bot. When set, they are used instead
+ * of the per-point callbacks.
+ */
+void set_callback_obstacles_batch(void (*fp)(int n, const double *x, const double *y, double *push_x, double *push_y));
+void set_callback_lighting_batch(void (*fp)(int n, const double *x, const double *y, int16_t *light));
+
+// Call when the lighting callback starts returning a different field,
+// to have the light raster (lightRaster in kilombo.json) sampled again.
+void light_raster_invalidate(void);
+
 #define SET_CALLBACK(ID, CALLBACK) set_callback_ ## ID (CALLBACK)
 
 // measure a fictive potential in the environment, for testing
 enum {POT_LINEAR, POT_PARABOLIC, POT_GRAVITY};
 float get_potential(int type);
 
+// set the current bot's transmission period in kilo_ticks, 0 for the simulator default
+void set_tx_period(uint16_t ticks);
+
 /* Original kilolib definitions follow */
 
 
@@ -147,7 +164,7 @@ extern volatile uint16_t kilo_tx_period;
  * This variable holds a 16-bit positive integer which is designated as
  * the kilobot's unique identifier during calibration.
  */
-extern uint16_t kilo_uid;
+extern __thread uint16_t kilo_uid;
 /**
  * @brief Calibrated turn left duty-cycle.
  *
@@ -230,7 +247,7 @@ extern uint8_t kilo_straight_right;
  * @note You must register a message callback before calling kilo_start.
  * @see message_t, message_crc, kilo_message_tx, kilo_message_tx_success
  */
-extern message_rx_t kilo_message_rx;
+extern __thread message_rx_t kilo_message_rx;
 /**
  * @brief Callback for message transmission.
  *
@@ -287,7 +304,7 @@ extern message_rx_t kilo_message_rx;
  *
  * @see message_t, message_crc, kilo_message_tx, kilo_message_tx_success
  */
-extern message_tx_t kilo_message_tx;
+extern __thread message_tx_t kilo_message_tx;
 
 /**
  * @brief Callback for successful message transmission.
@@ -303,7 +320,7 @@ extern message_tx_t kilo_message_tx;
  *
  * @see message_t, message_crc, kilo_message_tx, kilo_message_tx_success
  */
-extern message_tx_success_t kilo_message_tx_success;
+extern __thread message_tx_success_t kilo_message_tx_success;
 
 #ifdef __cplusplus /* If this is a C++ compiler, use C linkage */
 extern "C" {
@@ -22,10 +22,15 @@
 
 // fill in the size of the USERDATA structure,
 // used by the simulator to allocate space for it.
+// mydata is thread local, so that bots can run on several threads.
 
 #define REGISTER_USERDATA(UDT) 		\
 	int UserdataSize = sizeof(UDT); \
-	UDT *mydata;
+	__thread UDT *mydata;
+
+// declare mydata in other source files of the program
+#define EXTERN_USERDATA(UDT) 		\
+	extern __thread UDT *mydata;
 
 #else // compiling for the real kilobot
 
@@ -36,6 +41,9 @@
 	UDT myuserdata;                 \
 	UDT *mydata = &myuserdata; 
 
+#define EXTERN_USERDATA(UDT) 		\
+	extern UDT *mydata;
+
 #define SET_CALLBACK(ID, CALLBACK)
 
 #endif	// SIMULATOR
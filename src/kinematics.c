@@ -0,0 +1,207 @@
+/* Vectorized motion update for all bots.
+ *
+ * Moves the bots several at a time in AVX-512 or AVX2 lanes, chosen when
+ * compiling (e.g. with -march=native). Forward motion and the two turning
+ * modes are computed in every lane and combined with masked selects, and
+ * the sines and cosines come from a vectorized sincos.
+ *
+ * Accuracy: the directions are identical to the scalar integrator in
+ * skilobot.c. The sincos is accurate to a few ulp for angles up to about
+ * 1e5 radians, and the positions agree with the scalar ones to within
+ * 1e-9 mm per step. Collisions can amplify these differences over a
+ * long run, so trajectories are not bit-identical to the scalar path.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<math.h>
+
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+#include<immintrin.h>
+#endif
+
+#include"skilobot.h"
+#include"kinematics.h"
+
+#if defined(__AVX512F__)
+
+#define VW 8
+typedef __m512d vdouble;
+typedef __mmask8 vmask;
+#define v_set1(a)        _mm512_set1_pd(a)
+#define v_load(p)        _mm512_loadu_pd(p)
+#define v_store(p, a)    _mm512_storeu_pd(p, a)
+#define v_add(a, b)      _mm512_add_pd(a, b)
+#define v_sub(a, b)      _mm512_sub_pd(a, b)
+#define v_mul(a, b)      _mm512_mul_pd(a, b)
+#define v_fmadd(a, b, c) _mm512_fmadd_pd(a, b, c)   // a*b + c
+#define v_fnmadd(a, b, c) _mm512_fnmadd_pd(a, b, c) // c - a*b
+#define v_round(a)       _mm512_roundscale_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define v_floor(a)       _mm512_roundscale_pd(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)
+#define v_gt(a, b)       _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ)
+#define v_lt(a, b)       _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ)
+#define m_and(a, b)      ((vmask) ((a) & (b)))
+#define m_or(a, b)       ((vmask) ((a) | (b)))
+#define m_andnot(a, b)   ((vmask) (~(a) & (b)))     // !a && b
+#define v_select(m, a, b) _mm512_mask_blend_pd(m, b, a) // m ? a : b
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+#define VW 4
+typedef __m256d vdouble;
+typedef __m256d vmask;
+#define v_set1(a)        _mm256_set1_pd(a)
+#define v_load(p)        _mm256_loadu_pd(p)
+#define v_store(p, a)    _mm256_storeu_pd(p, a)
+#define v_add(a, b)      _mm256_add_pd(a, b)
+#define v_sub(a, b)      _mm256_sub_pd(a, b)
+#define v_mul(a, b)      _mm256_mul_pd(a, b)
+#define v_fmadd(a, b, c) _mm256_fmadd_pd(a, b, c)
+#define v_fnmadd(a, b, c) _mm256_fnmadd_pd(a, b, c)
+#define v_round(a)       _mm256_round_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define v_floor(a)       _mm256_round_pd(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)
+#define v_gt(a, b)       _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define v_lt(a, b)       _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define m_and(a, b)      _mm256_and_pd(a, b)
+#define m_or(a, b)       _mm256_or_pd(a, b)
+#define m_andnot(a, b)   _mm256_andnot_pd(a, b)
+#define v_select(m, a, b) _mm256_blendv_pd(b, a, m)
+
+#endif
+
+#ifdef VW
+
+// C99 does not define M_2_PI
+#define TWO_OVER_PI 0.63661977236758134308
+
+// pi/2 in three parts, for an accurate reduction of large angles
+#define PIO2_1 1.57079632673412561417e+00
+#define PIO2_2 6.07710050630396597660e-11
+#define PIO2_3 2.02226624879595063154e-21
+
+static inline vdouble v_neg(vdouble a)
+{
+  return v_sub(v_set1(0.0), a);
+}
+
+/* Sine and cosine of x, with the minimax polynomials of Cephes on
+ * [-pi/4, pi/4] after reducing x by the nearest multiple of pi/2.
+ */
+static inline void v_sincos(vdouble x, vdouble *s, vdouble *c)
+{
+  vdouble j = v_round(v_mul(x, v_set1(TWO_OVER_PI)));
+  vdouble y = v_fnmadd(j, v_set1(PIO2_1), x);
+  y = v_fnmadd(j, v_set1(PIO2_2), y);
+  y = v_fnmadd(j, v_set1(PIO2_3), y);
+  vdouble z = v_mul(y, y);
+
+  vdouble ps = v_set1(1.58962301576546568060E-10);
+  ps = v_fmadd(ps, z, v_set1(-2.50507477628578072866E-8));
+  ps = v_fmadd(ps, z, v_set1(2.75573136213857245213E-6));
+  ps = v_fmadd(ps, z, v_set1(-1.98412698295895385996E-4));
+  ps = v_fmadd(ps, z, v_set1(8.33333333332211858878E-3));
+  ps = v_fmadd(ps, z, v_set1(-1.66666666666666307295E-1));
+  vdouble sin_y = v_fmadd(v_mul(y, z), ps, y);
+
+  vdouble pc = v_set1(-1.13585365213876817300E-11);
+  pc = v_fmadd(pc, z, v_set1(2.08757008419747316778E-9));
+  pc = v_fmadd(pc, z, v_set1(-2.75573141792967388112E-7));
+  pc = v_fmadd(pc, z, v_set1(2.48015872888517045348E-5));
+  pc = v_fmadd(pc, z, v_set1(-1.38888888888730564116E-3));
+  pc = v_fmadd(pc, z, v_set1(4.16666666666665929218E-2));
+  vdouble cos_y = v_fmadd(v_mul(z, z), pc, v_fnmadd(v_set1(0.5), z, v_set1(1.0)));
+
+  // quadrant q = j mod 4, in 0 ... 3
+  vdouble q = v_fnmadd(v_floor(v_mul(j, v_set1(0.25))), v_set1(4.0), j);
+  vdouble odd = v_fnmadd(v_floor(v_mul(q, v_set1(0.5))), v_set1(2.0), q);
+  vmask swap  = v_gt(odd, v_set1(0.5));
+  vmask neg_s = v_gt(q, v_set1(1.5));
+  vmask neg_c = m_and(v_gt(q, v_set1(0.5)), v_lt(q, v_set1(2.5)));
+
+  vdouble sv = v_select(swap, cos_y, sin_y);
+  vdouble cv = v_select(swap, sin_y, cos_y);
+  *s = v_select(neg_s, v_neg(sv), sv);
+  *c = v_select(neg_c, v_neg(cv), cv);
+}
+
+/* Move bots i ... i+VW-1, in the same way as update_location() in skilobot.c.
+ *
+ * Every mode moves the bot by k1 (sin a1, cos a1) + k2 (sin a2, cos a2):
+ *  forward:  a1 = direction, k1 = timestep * speed, k2 = 0
+ *  turning:  a1, a2 = angle to the pivot leg before and after the turn,
+ *            k1 = radius, k2 = -radius
+ *  stopped:  k1 = k2 = 0
+ */
+static inline void update_block(int i, vdouble dt, vdouble r, vdouble leg)
+{
+  vdouble zero = v_set1(0.0);
+  vdouble x  = v_load(kinematics.x + i);
+  vdouble y  = v_load(kinematics.y + i);
+  vdouble d  = v_load(kinematics.direction + i);
+  vdouble v  = v_load(kinematics.speed + i);
+  vdouble tl = v_load(kinematics.turn_rate_l + i);
+  vdouble tr = v_load(kinematics.turn_rate_r + i);
+
+  vmask l_on = v_gt(tl, zero);
+  vmask r_on = v_gt(tr, zero);
+  vmask fwd   = m_and(l_on, r_on);
+  vmask right = m_andnot(fwd, r_on);
+  vmask left  = m_andnot(m_or(fwd, r_on), l_on);
+  vmask turn  = m_or(right, left);
+
+  // the turn, and the leg angle with the sign of the turn
+  vdouble turn_r = v_mul(dt, tr);
+  vdouble turn_l = v_mul(dt, tl);
+  vdouble dd = v_select(right, turn_r, v_select(left, v_neg(turn_l), zero));
+  vdouble sl = v_select(right, leg, v_select(left, v_neg(leg), zero));
+
+  vdouble d_new = v_add(d, dd);
+  vdouble a1 = v_add(d, sl);
+  vdouble a2 = v_add(d_new, sl);
+
+  vdouble k1 = v_select(turn, r, v_select(fwd, v_mul(dt, v), zero));
+  vdouble k2 = v_select(turn, v_neg(r), zero);
+
+  vdouble s1, c1, s2, c2;
+  v_sincos(a1, &s1, &c1);
+  v_sincos(a2, &s2, &c2);
+
+  x = v_add(x, v_fmadd(k1, s1, v_mul(k2, s2)));
+  y = v_add(y, v_fmadd(k1, c1, v_mul(k2, c2)));
+
+  v_store(kinematics.x + i, x);
+  v_store(kinematics.y + i, y);
+  v_store(kinematics.direction + i, d_new);
+}
+
+#endif
+
+/* Number of bots moved together, 1 if built without AVX2 or AVX-512. */
+int kinematics_simd_width(void)
+{
+#ifdef VW
+  return VW;
+#else
+  return 1;
+#endif
+}
+
+/* Move the bots in blocks of kinematics_simd_width(), assuming they all have
+ * the given radius and leg angle. Returns the number of bots moved, the
+ * caller moves the rest.
+ */
+int update_locations_simd(int n_bots, float timestep, int radius, double leg_angle)
+{
+#ifdef VW
+  vdouble dt = v_set1(timestep);
+  vdouble r = v_set1(radius);
+  vdouble leg = v_set1(leg_angle);
+
+  int i;
+  for (i = 0; i + VW <= n_bots; i += VW)
+    update_block(i, dt, r, leg);
+  return i;
+#else
+  return 0;
+#endif
+}
@@ -0,0 +1,9 @@
+#ifndef KINEMATICS_H
+#define KINEMATICS_H
+
+/* Vectorized motion update, see kinematics.c. */
+
+int kinematics_simd_width(void);
+int update_locations_simd(int n_bots, float timestep, int radius, double leg_angle);
+
+#endif
@@ -0,0 +1,254 @@
+/* Raster cache of the light field, see light_raster.h.
+ *
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+
+#include"skilobot.h"
+#include"params.h"
+#include"light_raster.h"
+
+extern volatile uint32_t kilo_ticks;
+
+static struct {
+  int on;               // a raster is set up
+  int from_file;        // the nodes were read from lightFile, never resampled
+  int file_failed;      // lightFile could not be read, it is not tried again
+  int stale;            // resample at the next update
+  uint32_t next_refresh;
+  int nx, ny;           // number of nodes
+  double x0, y0;        // position of node (0, 0)
+  double dx, dy;        // node spacing
+  double inv_dx, inv_dy;
+  float *v;             // node values, row by row
+} raster;
+
+// light at the bots from the batch callback, valid for bots below n_bot_light
+static int16_t *bot_light;
+static int n_bot_light = 0, allocated_bot_light = 0;
+
+double light_field(double x, double y)
+{
+  if (user_light_batch != NULL)
+    {
+      int16_t l;
+      user_light_batch(1, &x, &y, &l);
+      return l;
+    }
+  if (user_light != NULL)
+    return user_light(x, y);
+
+  // parabolic well
+  return (x*x + y*y) / 1000;
+}
+
+void light_raster_invalidate(void)
+{
+  raster.stale = 1;
+  n_bot_light = 0;
+}
+
+void light_bots_update(int n_bots)
+{
+  n_bot_light = 0;
+  if (user_light_batch == NULL)
+    return;
+
+  if (n_bots > allocated_bot_light)
+    {
+      allocated_bot_light = n_bots;
+      bot_light = realloc(bot_light, n_bots * sizeof(int16_t));
+      if (bot_light == NULL)
+	{
+	  fprintf(stderr, "Could not allocate the light levels of %d bots.\n", n_bots);
+	  exit(1);
+	}
+    }
+  user_light_batch(n_bots, kinematics.x, kinematics.y, bot_light);
+  n_bot_light = n_bots;
+}
+
+void light_bots_prepare(int n_bots)
+{
+  if (n_bot_light != n_bots)
+    light_bots_update(n_bots);
+}
+
+int light_bot_lookup(int id, double *l)
+{
+  if (id >= n_bot_light)
+    return 0;
+  *l = bot_light[id];
+  return 1;
+}
+
+/* Allocate nx x ny nodes with spacing dx, dy, starting at the lower
+ * corner of lightRasterArea.
+ */
+static void raster_alloc(int nx, int ny, double dx, double dy)
+{
+  raster.nx = nx;
+  raster.ny = ny;
+  raster.v = realloc(raster.v, (size_t) nx * ny * sizeof(float));
+  if (raster.v == NULL)
+    {
+      fprintf(stderr, "Could not allocate a light raster of %d x %d nodes.\n", nx, ny);
+      exit(1);
+    }
+  raster.x0 = simparams->lightRasterArea[0];
+  raster.y0 = simparams->lightRasterArea[1];
+  raster.dx = dx;
+  raster.dy = dy;
+  raster.inv_dx = 1 / dx;
+  raster.inv_dy = 1 / dy;
+}
+
+/* Read the nodes from a binary PGM (P5) image, scaled to 0 ... 1023.
+ * The first row of the image is at the lowest y, as on the screen.
+ */
+static int raster_load(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Could not open the light file %s.\n", filename);
+      return 0;
+    }
+
+  int w, h, maxval, c;
+  char magic[3] = {0};
+  if (fscanf(f, "%2s", magic) != 1 || magic[0] != 'P' || magic[1] != '5')
+    goto bad;
+  // header fields, separated by whitespace and # comments
+  int fields[3];
+  for (int k = 0; k < 3; k++)
+    {
+      while ((c = fgetc(f)) == '#' || c == ' ' || c == '\t' || c == '\n' || c == '\r')
+	if (c == '#')
+	  while ((c = fgetc(f)) != '\n' && c != EOF)
+	    ;
+      ungetc(c, f);
+      if (fscanf(f, "%d", &fields[k]) != 1)
+	goto bad;
+    }
+  w = fields[0];
+  h = fields[1];
+  maxval = fields[2];
+  fgetc(f); // the single whitespace before the pixels
+  if (w < 2 || h < 2 || maxval < 1 || maxval > 65535)
+    goto bad;
+
+  double *a = simparams->lightRasterArea;
+  raster_alloc(w, h, (a[2] - a[0]) / (w - 1), (a[3] - a[1]) / (h - 1));
+  for (int i = 0; i < w * h; i++)
+    {
+      int p = fgetc(f);
+      if (p >= 0 && maxval > 255)
+	{
+	  int lo = fgetc(f);
+	  p = lo < 0 ? lo : (p << 8) | lo;
+	}
+      if (p < 0)
+	goto bad;
+      raster.v[i] = p * 1023.0 / maxval;
+    }
+  fclose(f);
+  return 1;
+
+ bad:
+  fprintf(stderr, "The light file %s is not a binary PGM image.\n", filename);
+  fclose(f);
+  return 0;
+}
+
+static void raster_sample(void)
+{
+  if (user_light_batch == NULL)
+    {
+      for (int j = 0; j < raster.ny; j++)
+	for (int i = 0; i < raster.nx; i++)
+	  raster.v[j * raster.nx + i] = light_field(raster.x0 + i * raster.dx, raster.y0 + j * raster.dy);
+      return;
+    }
+
+  // one call per row of nodes
+  double *x = malloc(raster.nx * sizeof(double));
+  double *y = malloc(raster.nx * sizeof(double));
+  int16_t *l = malloc(raster.nx * sizeof(int16_t));
+  if (x == NULL || y == NULL || l == NULL)
+    {
+      fprintf(stderr, "Could not allocate a row of the light raster.\n");
+      exit(1);
+    }
+  for (int i = 0; i < raster.nx; i++)
+    x[i] = raster.x0 + i * raster.dx;
+  for (int j = 0; j < raster.ny; j++)
+    {
+      for (int i = 0; i < raster.nx; i++)
+	y[i] = raster.y0 + j * raster.dy;
+      user_light_batch(raster.nx, x, y, l);
+      for (int i = 0; i < raster.nx; i++)
+	raster.v[j * raster.nx + i] = l[i];
+    }
+  free(x);
+  free(y);
+  free(l);
+}
+
+void light_raster_update(void)
+{
+  if (!raster.on)
+    {
+      if (simparams->lightFile != NULL && !raster.file_failed)
+	{
+	  raster.on = raster.from_file = raster_load(simparams->lightFile);
+	  if (!raster.on)
+	    {
+	      fprintf(stderr, " Using the light field without it.\n");
+	      raster.file_failed = 1;
+	    }
+	}
+      if (!raster.on && simparams->lightRaster > 0)
+	{
+	  // the last nodes may lie beyond the area, to keep the spacing
+	  double *a = simparams->lightRasterArea;
+	  double d = simparams->lightRaster;
+	  raster_alloc(2 + (int) ((a[2] - a[0]) / d), 2 + (int) ((a[3] - a[1]) / d), d, d);
+	  raster.on = raster.stale = 1;
+	}
+      if (!raster.on)
+	return;
+    }
+  if (raster.from_file)
+    return;
+
+  if (simparams->lightRasterRefresh > 0 && kilo_ticks >= raster.next_refresh)
+    raster.stale = 1;
+  if (raster.stale)
+    {
+      raster_sample();
+      raster.stale = 0;
+      raster.next_refresh = kilo_ticks + simparams->lightRasterRefresh;
+    }
+}
+
+int light_raster_lookup(double x, double y, double *l)
+{
+  if (!raster.on)
+    return 0;
+
+  double fx = (x - raster.x0) * raster.inv_dx;
+  double fy = (y - raster.y0) * raster.inv_dy;
+  if (!(fx >= 0 && fy >= 0 && fx < raster.nx - 1 && fy < raster.ny - 1))
+    return 0;
+
+  int ix = (int) fx;
+  int iy = (int) fy;
+  double tx = fx - ix;
+  double ty = fy - iy;
+  const float *v = raster.v + iy * raster.nx + ix;
+  *l = (1 - ty) * ((1 - tx) * v[0]         + tx * v[1])
+     +      ty  * ((1 - tx) * v[raster.nx] + tx * v[raster.nx + 1]);
+  return 1;
+}
@@ -0,0 +1,38 @@
+#ifndef LIGHT_RASTER_H
+#define LIGHT_RASTER_H
+
+/* Cache of the light field on a raster, for get_ambientlight().
+ *
+ * With lightRaster > 0, the field (the lighting callback, or the default
+ * parabolic well) is sampled on the nodes of a grid with that spacing over
+ * lightRasterArea. With lightFile, the nodes are read from a PGM image
+ * instead. A reading is then a bilinear interpolation of the four nodes
+ * around the bot, without calling the callback.
+ *
+ * The field is given by the lighting callback, its batch variant, or the
+ * default parabolic well.
+ */
+
+// The light field without the raster.
+double light_field(double x, double y);
+
+// Sample the field again at the start of the next step, e.g. after it changed.
+void light_raster_invalidate(void);
+
+/* With a batch lighting callback, the light at every bot is computed with
+ * one call per step, after the bots moved, and read by light_bot_lookup().
+ * light_bots_prepare() computes it only if it is missing, e.g. in the first
+ * step or after light_raster_invalidate().
+ */
+void light_bots_update(int n_bots);
+void light_bots_prepare(int n_bots);
+int light_bot_lookup(int id, double *l);
+
+// Called at the start of every step: set up or resample the raster if needed.
+void light_raster_update(void);
+
+// Set *l to the light at (x, y) from the raster. Returns 0 if (x, y) is
+// outside of the raster, or there is none.
+int light_raster_lookup(double x, double y, double *l);
+
+#endif
@@ -3,25 +3,60 @@
  */
 
 #include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
 #include<math.h>
 
 #define NDEBUG // define to turn assertions off
 #include<assert.h>
 #include"skilobot.h"
+#include"params.h"
 #include"cd_matrix.h"
 #include "neighbors.h"
+#include"cell_list.h"
+#include"spatial_hash.h"
+#include"thread_pool.h"
+#include"collisions.h"
+#include"obstacles.h"
+
+neighbor_store neighbors;
 
 pv_matrix grid_cache;
-coord2D gc_offset = {0, 0};
+cell_list cells;
+spatial_hash cell_hash;
 coord2D gc_cell_sz = {100, 100};
 
+/* The grid cache is kept from one step to the next, and only the bots
+ * that crossed a cell boundary are moved between cells.
+ *
+ * Cells are anchored at the origin: a bot at x is in the absolute cell
+ * floor(x / gc_cell_sz.x), which is column (that - gc_origin_x) of the matrix.
+ * Growing the matrix on the low side then only changes gc_origin,
+ * and the cells stored for the bots stay valid.
+ */
+int gc_origin_x = 0, gc_origin_y = 0;
+int *gc_bot_x = NULL, *gc_bot_y = NULL; // absolute cell of each bot in the cache
+int gc_n_bots = 0;                      // number of bots in the cache, 0 if it needs a rebuild
+kilobot **gc_bots = NULL;               // the bot array the cache was filled from
+coord2D gc_filled_sz = {0, 0};          // cell size the cache was filled with
+
 // initialized in update_all_bots before movement
 coord2D max_coord, min_coord;
 
+static inline int gc_abs_x(double x)
+{
+  return floor(x / gc_cell_sz.x);
+}
+
+static inline int gc_abs_y(double y)
+{
+  return floor(y / gc_cell_sz.y);
+}
+
 size_t bot2gc_x(double x)
 {
   // using int here to be able to detect if it is ever negative
-  int xi = (x-gc_offset.x) / gc_cell_sz.x;
+  int xi = gc_abs_x(x) - gc_origin_x;
   // printf ("x:%f, max_coord.x:%f, xi:%d grid_cache.x_size:%zd\n", x, max_coord.x, xi, grid_cache.x_size);
   assert (xi >= 0);                  // make sure we always return a valid index
   assert (xi < grid_cache.x_size);
@@ -30,26 +65,32 @@ size_t bot2gc_x(double x)
 
 size_t bot2gc_y(double y)
 {
-  int yi = (y-gc_offset.y) / gc_cell_sz.y;
+  int yi = gc_abs_y(y) - gc_origin_y;
   assert (yi >= 0);                  // make sure we always return a valid index
   assert (yi < grid_cache.y_size);
   return yi;
 }
 
+/* Throw away the grid cache, e.g. when the cell size changes. */
+void reset_grid_cache()
+{
+  for (size_t i = 0; i < grid_cache.x_size * grid_cache.y_size; i++)
+    free(grid_cache.data[i].data);
+  free(grid_cache.data);
+  grid_cache.data = NULL;
+  grid_cache.x_size = grid_cache.y_size = 0;
+  gc_n_bots = 0;
+}
+
 void prepare_grid_cache(double cr)
 {
   //printf("area: %g, %g - %g, %g\n", min_coord.x, min_coord.y, max_coord.x, max_coord.y);
-  // for now we fill the matrix from scratch
-  // it might be good to only do that if it had to be extended
-  matrix_clear_all(&grid_cache);
-  
   assert(max_coord.x >= min_coord.x);
   assert(max_coord.y >= min_coord.y);
 
     
   double eps = .1; // small margin to avoid rounding trouble
                    // risk: rightmost point's x+cr gets rounded to one past the last index in matrix.
-                   // TODO: ceil is dangerous in some (very rare) cases -- DONE?
 
   // increase grid cell size to cr
   if (cr+eps > gc_cell_sz.x)
@@ -57,23 +98,41 @@ void prepare_grid_cache(double cr)
   if (cr+eps > gc_cell_sz.y)
     gc_cell_sz.y = cr+eps;
 
-  size_t x_range = ceil((max_coord.x - min_coord.x + 2*cr + 2*eps)/gc_cell_sz.x);
-  size_t y_range = ceil((max_coord.y - min_coord.y + 2*cr + 2*eps)/gc_cell_sz.y);
+  // the bots' cells are stored in units of the cell size
+  if (gc_filled_sz.x != gc_cell_sz.x || gc_filled_sz.y != gc_cell_sz.y)
+    {
+      reset_grid_cache();
+      gc_filled_sz = gc_cell_sz;
+    }
+
+  // absolute cells the grid must cover
   // here eps is important, to ensure the grid extends a bit beyond the outermost robots
-  
-  // this looks like a lot of effort compared to just creating a new matrix
-  // but it saves us expensive reallocation of the per-cell arrays
-  if (x_range < grid_cache.x_size)
-    x_range = grid_cache.x_size;
-  
-  if (y_range < grid_cache.y_size)
-    y_range = grid_cache.y_size;
-  
-  if (x_range > grid_cache.x_size || y_range > grid_cache.y_size)
-    matrix_extend(&grid_cache, 0, x_range-grid_cache.x_size, 0, y_range-grid_cache.y_size);
-  
-  gc_offset.x = min_coord.x - cr - eps;
-  gc_offset.y = min_coord.y - cr - eps;
+  int lo_x = gc_abs_x(min_coord.x - cr - eps);
+  int hi_x = gc_abs_x(max_coord.x + cr + eps);
+  int lo_y = gc_abs_y(min_coord.y - cr - eps);
+  int hi_y = gc_abs_y(max_coord.y + cr + eps);
+
+  if (grid_cache.x_size == 0)
+    {
+      gc_origin_x = lo_x;
+      gc_origin_y = lo_y;
+    }
+
+  // the grid is never shrunk, and only grows by the cells it is missing.
+  // this saves us expensive reallocation of the per-cell arrays
+  size_t xmi_p = lo_x < gc_origin_x ? gc_origin_x - lo_x : 0;
+  size_t ymi_p = lo_y < gc_origin_y ? gc_origin_y - lo_y : 0;
+  int x_end = gc_origin_x + (int) grid_cache.x_size;
+  int y_end = gc_origin_y + (int) grid_cache.y_size;
+  size_t xma_p = hi_x >= x_end ? hi_x - x_end + 1 : 0;
+  size_t yma_p = hi_y >= y_end ? hi_y - y_end + 1 : 0;
+
+  if (xmi_p || xma_p || ymi_p || yma_p)
+    {
+      matrix_extend(&grid_cache, xmi_p, xma_p, ymi_p, yma_p);
+      gc_origin_x -= xmi_p;
+      gc_origin_y -= ymi_p;
+    }
 }
 
 
@@ -81,94 +140,258 @@ void store_cache(kilobot * bot)
 {
   assert(bot != NULL);
   
-  p_vec * cell = matrix_get(&grid_cache, bot2gc_x(bot->x), bot2gc_y(bot->y));
+  p_vec * cell = matrix_get(&grid_cache, bot2gc_x(BOT_X(bot)), bot2gc_y(BOT_Y(bot)));
   p_vec_push(cell, bot);
 }
 
+/* Bring the grid cache up to date with the bots' positions.
+ *
+ * Only the bots that moved to a different cell since the last step are
+ * moved in the grid. The cache is filled from scratch the first time and
+ * whenever the set of bots changed.
+ */
+void update_grid_cache(int n_bots)
+{
+  if (gc_n_bots != n_bots || gc_bots != allbots)
+    {
+      matrix_clear_all(&grid_cache);
+      gc_bot_x = realloc(gc_bot_x, n_bots * sizeof(int));
+      gc_bot_y = realloc(gc_bot_y, n_bots * sizeof(int));
+      assert(gc_bot_x != NULL && gc_bot_y != NULL);
 
-int check_bots_in_bounds(int n_bots)
+      for (int i = 0; i < n_bots; i++)
+	{
+	  store_cache(allbots[i]);
+	  gc_bot_x[i] = gc_abs_x(kinematics.x[i]);
+	  gc_bot_y[i] = gc_abs_y(kinematics.y[i]);
+	}
+
+      gc_n_bots = n_bots;
+      gc_bots = allbots;
+      return;
+    }
+
+  for (int i = 0; i < n_bots; i++)
+    {
+      kilobot *bot = allbots[i];
+      int ax = gc_abs_x(kinematics.x[i]);
+      int ay = gc_abs_y(kinematics.y[i]);
+
+      if (ax != gc_bot_x[i] || ay != gc_bot_y[i])
+	{
+	  p_vec_rm_unsorted(matrix_get(&grid_cache, gc_bot_x[i] - gc_origin_x, gc_bot_y[i] - gc_origin_y), bot);
+	  p_vec_push(matrix_get(&grid_cache, ax - gc_origin_x, ay - gc_origin_y), bot);
+	  gc_bot_x[i] = ax;
+	  gc_bot_y[i] = ay;
+	}
+    }
+}
+
+
+/* Start collecting the pairs of a new neighbor search into store s.
+ */
+void store_reset(neighbor_store *s, int n_bots)
 {
-  int i;
-  kilobot *bot;
-  for (i = 0; i < n_bots; i++)
+  s->n_bots = n_bots;
+
+  if (s->allocated_bots < n_bots+1)
     {
-      bot = allbots[i];
-      assert(bot->x >= min_coord.x);
-      assert(bot->x <= max_coord.x);
-      assert(bot->y >= min_coord.y);
-      assert(bot->y <= max_coord.y);
+      s->allocated_bots = n_bots+1;
+      s->offset = realloc(s->offset, s->allocated_bots * sizeof(int));
+      s->fill = realloc(s->fill, s->allocated_bots * sizeof(int));
+      s->moved = realloc(s->moved, s->allocated_bots);
+      assert(s->offset != NULL && s->fill != NULL && s->moved != NULL);
     }
 
-  return 1;
+  // one pair buffer per thread
+  int n_threads = pool_threads();
+  if (s->n_found < n_threads)
+    {
+      s->found = realloc(s->found, n_threads * sizeof(pair_buffer));
+      assert(s->found != NULL);
+      memset(s->found + s->n_found, 0, (n_threads - s->n_found) * sizeof(pair_buffer));
+      s->n_found = n_threads;
+    }
+  for (int t = 0; t < s->n_found; t++)
+    s->found[t].n_pairs = 0;
+
+  // no neighbors until store_build() is called
+  memset(s->offset, 0, (n_bots+1) * sizeof(int));
+  memset(s->moved, 0, n_bots);
 }
 
-/* Update the bots' interactions with each other.
+void neighbors_reset(int n_bots)
+{
+  store_reset(&neighbors, n_bots);
+}
+
+void pair_buffer_add(pair_buffer *buf, int a, int b, double sq_dist)
+{
+  if (buf->n_pairs == buf->allocated_pairs)
+    {
+      buf->allocated_pairs = buf->allocated_pairs < 1024 ? 1024 : 2*buf->allocated_pairs;
+      buf->pairs = realloc(buf->pairs, buf->allocated_pairs * sizeof(bot_pair));
+      assert(buf->pairs != NULL);
+    }
+
+  bot_pair *p = &buf->pairs[buf->n_pairs++];
+  p->a = a;
+  p->b = b;
+  p->dist = sqrt(sq_dist);
+}
+
+void neighbors_add_pair(int a, int b, double sq_dist)
+{
+  pair_buffer_add(&neighbors.found[0], a, b, sq_dist);
+}
+
+static void store_reserve_entries(neighbor_store *s, size_t n_entries)
+{
+  if (s->allocated_entries < n_entries)
+    {
+      s->allocated_entries = 2 * n_entries;
+      s->index     = realloc(s->index,     s->allocated_entries * sizeof(int));
+      s->dist      = realloc(s->dist,      s->allocated_entries * sizeof(double));
+      s->tmp_index = realloc(s->tmp_index, s->allocated_entries * sizeof(int));
+      s->tmp_dist  = realloc(s->tmp_dist,  s->allocated_entries * sizeof(double));
+      assert(s->index != NULL && s->dist != NULL);
+      assert(s->tmp_index != NULL && s->tmp_dist != NULL);
+    }
+}
+
+/* Build the CSR neighbor lists of store s from the collected pairs.
  *
- * - Move clashing bots apart.
- * - Update which bots can communicate with each other.
- *  -- pointers to bots in range are stored in bot->in_range[]
+ * The pairs can arrive in any order. They are first scattered into
+ * unsorted rows, which are then transposed: walking the rows in order of
+ * increasing i and appending i to the rows of i's neighbors fills every
+ * row in sorted order. The result is independent of the order in which
+ * the neighbor search found the pairs, and of how they were split
+ * between the threads' buffers.
  */
-void update_interactions_grid (int n_bots)
+void store_build(neighbor_store *s)
 {
-  if (user_obstacles != NULL) {
-    double push_x, push_y;
+  int n = s->n_bots;
+  int *offset = s->offset;
+  int *fill = s->fill;
 
-    for (int i=0; i<n_bots; i++) {
-      if (user_obstacles(allbots[i]->x, allbots[i]->y, &push_x, &push_y)){
-        allbots[i]->x += push_x;
-	allbots[i]->y += push_y;
+  size_t n_entries = 0;
+  for (int t = 0; t < s->n_found; t++)
+    n_entries += 2 * s->found[t].n_pairs;
+  store_reserve_entries(s, n_entries);
+
+  // count the neighbors of every bot, then sum up to row offsets
+  memset(offset, 0, (n+1) * sizeof(int));
+  for (int t = 0; t < s->n_found; t++)
+    for (size_t k = 0; k < s->found[t].n_pairs; k++)
+      {
+	offset[s->found[t].pairs[k].a + 1]++;
+	offset[s->found[t].pairs[k].b + 1]++;
       }
-    }
-  }
+  for (int i = 0; i < n; i++)
+    offset[i+1] += offset[i];
 
-  // initialize bounding box
-  max_coord.x = min_coord.x = allbots[0]->x;
-  max_coord.y = min_coord.y = allbots[0]->y;
+  // scatter the pairs into unsorted rows
+  memcpy(fill, offset, n * sizeof(int));
+  for (int t = 0; t < s->n_found; t++)
+    for (size_t k = 0; k < s->found[t].n_pairs; k++)
+      {
+	bot_pair *p = &s->found[t].pairs[k];
+	s->tmp_index[fill[p->a]] = p->b;
+	s->tmp_dist[fill[p->a]++] = p->dist;
+	s->tmp_index[fill[p->b]] = p->a;
+	s->tmp_dist[fill[p->b]++] = p->dist;
+      }
 
-  double cr = allbots[0]->cr;
-  double sq_r = allbots[0]->radius * allbots[0]->radius;
-  double sq_cr = cr * cr;
+  // transpose, giving rows sorted by neighbor index
+  memcpy(fill, offset, n * sizeof(int));
+  for (int i = 0; i < n; i++)
+    for (int k = offset[i]; k < offset[i+1]; k++)
+      {
+	int j = s->tmp_index[k];
+	s->index[fill[j]] = i;
+	s->dist[fill[j]++] = s->tmp_dist[k];
+      }
+}
+
+void neighbors_build(void)
+{
+  store_build(&neighbors);
+}
+
+static void refresh_dist_task(void *arg, int t, int n_threads)
+{
+  int lo, hi;
+  pool_range(neighbors.n_bots, t, n_threads, &lo, &hi);
+
+  for (int i = lo; i < hi; i++)
+    for (int k = neighbors.offset[i]; k < neighbors.offset[i+1]; k++)
+      {
+	int j = neighbors.index[k];
+	if (neighbors.moved[i] || neighbors.moved[j])
+	  neighbors.dist[k] = sqrt(bot_sq_dist(i, j));
+      }
+}
 
+/* Recompute the stored distances of the pairs where a bot has moved
+ * since the search, so that messages report the distance at the time
+ * they are passed. Only moved bots cost a square root.
+ */
+void neighbors_refresh_dist(void)
+{
+  pool_run(refresh_dist_task, NULL);
+  memset(neighbors.moved, 0, neighbors.n_bots);
+}
+
+
+int check_bots_in_bounds(int n_bots)
+{
   int i;
   kilobot *bot;
-  // bounding box
   for (i = 0; i < n_bots; i++)
     {
       bot = allbots[i];
-
-      bot->x > max_coord.x ? (max_coord.x = bot->x) :
-	(bot->x < min_coord.x ? (min_coord.x = bot->x) : 0);
-      
-      bot->y > max_coord.y ? (max_coord.y = bot->y) :
-	(bot->y < min_coord.y ? (min_coord.y = bot->y) : 0);
+      assert(BOT_X(bot) >= min_coord.x);
+      assert(BOT_X(bot) <= max_coord.x);
+      assert(BOT_Y(bot) >= min_coord.y);
+      assert(BOT_Y(bot) <= max_coord.y);
     }
-  // use assert here so that the call gets compiled out in release
-  assert(check_bots_in_bounds(n_bots));
-  prepare_grid_cache(cr);
-  assert(check_bots_in_bounds(n_bots));
-   
-   // insert bots into the grid
-   for (i=0; i<n_bots; i++)
-     {
-       store_cache(allbots[i]);
-       allbots[i]->n_in_range = 0;
-     }
+
+  return 1;
+}
+
+/* Bring the grid cache up to date before searching it.
+ */
+void prepare_grid(int n_bots, double cr)
+{
+   prepare_grid_cache(cr);
    assert(check_bots_in_bounds(n_bots));
    
+   // move the bots that changed cells
+   update_grid_cache(n_bots);
+   assert(check_bots_in_bounds(n_bots));
+}
+
+/* Find the pairs within communication range of the bots lo ... hi-1
+ * using the grid cache of per-cell bot pointer vectors.
+ */
+void find_pairs_grid(int lo, int hi, double cr, pair_buffer *out)
+{
+   double sq_cr = cr * cr;
+
    // loop over the bots, find neighbors using the grid
-   for (int i=0; i<n_bots; i++) {
-     kilobot * cur = allbots[i];
+   for (int i=lo; i<hi; i++) {
+     double x = kinematics.x[i];
+     double y = kinematics.y[i];
 
      // range of cells we have to check
-     //     printf ("bot:%d x:%f y:%f cr:%f\n", i, cur->x, cur->y, cr);
-     size_t low_x = bot2gc_x(cur->x - cr);
-     size_t high_x = bot2gc_x(cur->x + cr);
-     size_t low_y = bot2gc_y(cur->y - cr);
-     size_t high_y = bot2gc_y(cur->y + cr);
+     //     printf ("bot:%d x:%f y:%f cr:%f\n", i, x, y, cr);
+     size_t low_x = bot2gc_x(x - cr);
+     size_t high_x = bot2gc_x(x + cr);
+     size_t low_y = bot2gc_y(y - cr);
+     size_t high_y = bot2gc_y(y + cr);
 
      //printf("(%d, %d, %d, %d)", low_x, high_x, low_y, high_y);
      
-     // FIXME: what about movement? update cache?
      for (size_t y=low_y; y<=high_y; y++)
        for (size_t x=low_x; x<=high_x; x++)
 	 {
@@ -178,37 +401,540 @@ void update_interactions_grid (int n_bots)
 	     {
 	       kilobot * other = cell->data[b];
 	       assert(other != NULL);
+	       int j = other->ID;
 	       
 	       // only process each pair once and don't pair with self
-	       if (other <= cur)
+	       if (j <= i)
 		 continue;
 	       
-	       double sq_bd = bot_sq_dist(cur, other);
+	       double sq_bd = bot_sq_dist(i, j);
 	       if (sq_bd < sq_cr) {
 		 //if (i == 0) printf("%d and %d in range\n", i, j);
-		 cur->in_range[cur->n_in_range++] = other->ID;  // ugly conversion back to index
-		 other->in_range[other->n_in_range++] = cur->ID;
+		 pair_buffer_add(out, i, j, sq_bd);
 	       }
 	     }
 	 }
       }
+}
+
+/* The first of n_units units handled by thread t, when unit u starts at
+ * bot start[u*stride]. Splits the units so that each thread gets about
+ * the same number of bots.
+ */
+static size_t balanced_split(int *start, size_t n_units, size_t stride, int t, int n_threads)
+{
+  if (t == n_threads)
+    return n_units;
+
+  long target = (long) start[n_units * stride] * t / n_threads;
+  size_t lo = 0, hi = n_units;
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (start[mid * stride] < target)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo;
+}
+
+typedef struct {
+  int n_bots;
+  double range;
+  coord2D *t_min, *t_max;  // per-thread bounding boxes
+  size_t allocated;
+} search_job;
 
+search_job search;
+
+static void bounding_box_task(void *arg, int t, int n_threads)
+{
+  int lo, hi;
+  pool_range(search.n_bots, t, n_threads, &lo, &hi);
+
+  coord2D mi = {kinematics.x[0], kinematics.y[0]};
+  coord2D ma = mi;
+  for (int i = lo; i < hi; i++)
+    {
+      double x = kinematics.x[i];
+      double y = kinematics.y[i];
+
+      x > ma.x ? (ma.x = x) :
+	(x < mi.x ? (mi.x = x) : 0);
+      
+      y > ma.y ? (ma.y = y) :
+	(y < mi.y ? (mi.y = y) : 0);
+    }
+  search.t_min[t] = mi;
+  search.t_max[t] = ma;
+}
+
+/* Every thread searches its own stripe of the spatial index,
+ * and collects the pairs in its own buffer.
+ */
+static void search_task(void *arg, int t, int n_threads)
+{
+  pair_buffer *out = &neighbors.found[t];
+  size_t lo, hi;
+  int lo_bot, hi_bot;
+
+  switch (simparams->neighborIndex)
+    {
+    case NEIGHBOR_INDEX_CELLS:
+      // stripes of cell rows
+      lo = balanced_split(cells.cell_start, cells.y_size, cells.x_size, t, n_threads);
+      hi = balanced_split(cells.cell_start, cells.y_size, cells.x_size, t+1, n_threads);
+      cell_list_find_pairs(&cells, search.range, lo, hi, out);
+      break;
+    case NEIGHBOR_INDEX_HASH:
+      lo = balanced_split(cell_hash.cell_start, cell_hash.n_cells, 1, t, n_threads);
+      hi = balanced_split(cell_hash.cell_start, cell_hash.n_cells, 1, t+1, n_threads);
+      spatial_hash_find_pairs(&cell_hash, search.range, lo, hi, out);
+      break;
+    default:
+      pool_range(search.n_bots, t, n_threads, &lo_bot, &hi_bot);
+      find_pairs_grid(lo_bot, hi_bot, search.range, out);
+    }
+}
+
+/* Find the pairs closer than range with the configured spatial index,
+ * and add them to the neighbor store.
+ */
+void find_pairs(int n_bots, double range)
+{
+  int n_threads = pool_threads();
+  search.n_bots = n_bots;
+  search.range = range;
+  if (search.allocated < n_threads)
+    {
+      search.allocated = n_threads;
+      search.t_min = realloc(search.t_min, n_threads * sizeof(coord2D));
+      search.t_max = realloc(search.t_max, n_threads * sizeof(coord2D));
+      assert(search.t_min != NULL && search.t_max != NULL);
+    }
+
+  // bounding box
+  pool_run(bounding_box_task, NULL);
+  min_coord = search.t_min[0];
+  max_coord = search.t_max[0];
+  for (int t = 1; t < n_threads; t++)
+    {
+      if (search.t_min[t].x < min_coord.x) min_coord.x = search.t_min[t].x;
+      if (search.t_min[t].y < min_coord.y) min_coord.y = search.t_min[t].y;
+      if (search.t_max[t].x > max_coord.x) max_coord.x = search.t_max[t].x;
+      if (search.t_max[t].y > max_coord.y) max_coord.y = search.t_max[t].y;
+    }
+  // use assert here so that the call gets compiled out in release
+  assert(check_bots_in_bounds(n_bots));
+
+  // the index is built serially, then searched in parallel
+  switch (simparams->neighborIndex)
+    {
+    case NEIGHBOR_INDEX_CELLS:
+      cell_list_build(&cells, n_bots, min_coord, max_coord, range);
+      break;
+    case NEIGHBOR_INDEX_HASH:
+      spatial_hash_build(&cell_hash, n_bots, range);
+      break;
+    default:
+      prepare_grid(n_bots, range);
+    }
+
+  pool_run(search_task, NULL);
+}
+
+
+/* Verlet list: the candidate neighbors within cr + skin found by the last
+ * full search, in CSR form with sorted rows like the neighbor store.
+ *
+ * As long as no bot has moved more than skin/2 since that search, every
+ * pair now within cr is among the candidates, so the neighbor lists can be
+ * found by filtering the candidates by distance.
+ */
+typedef struct {
+  int n_bots;
+  kilobot **bots;    // the bot array the list was built for, NULL if invalid
+  int *offset, *index;
+  double *x0, *y0;   // positions at the last full search
+  size_t allocated_bots, allocated_entries;
+
+  // per-thread results of the parallel passes
+  int *t_flag, *t_end;
+  size_t allocated_threads;
+  double sq_lim;
+} verlet_list;
+
+verlet_list verlet;
+
+static void verlet_check_task(void *arg, int t, int n_threads)
+{
+  int lo, hi;
+  pool_range(verlet.n_bots, t, n_threads, &lo, &hi);
+
+  verlet.t_flag[t] = 0;
+  for (int i = lo; i < hi; i++)
+    {
+      double dx = kinematics.x[i] - verlet.x0[i];
+      double dy = kinematics.y[i] - verlet.y0[i];
+      if (dx*dx + dy*dy > verlet.sq_lim)
+	{
+	  verlet.t_flag[t] = 1;
+	  return;
+	}
+    }
+}
+
+int verlet_needs_rebuild(int n_bots, double skin)
+{
+  int n_threads = pool_threads();
+  if (verlet.allocated_threads < n_threads)
+    {
+      verlet.allocated_threads = n_threads;
+      verlet.t_flag = realloc(verlet.t_flag, n_threads * sizeof(int));
+      verlet.t_end  = realloc(verlet.t_end,  n_threads * sizeof(int));
+      assert(verlet.t_flag != NULL && verlet.t_end != NULL);
+    }
+
+  if (verlet.bots != allbots || verlet.n_bots != n_bots)
+    return 1;
+
+  verlet.sq_lim = skin * skin / 4;
+  pool_run(verlet_check_task, NULL);
+
+  for (int t = 0; t < n_threads; t++)
+    if (verlet.t_flag[t])
+      return 1;
+
+  return 0;
+}
+
+/* Store the neighbor lists just built as the new candidates,
+ * and remember where the bots were.
+ */
+void verlet_store_candidates(int n_bots)
+{
+  size_t n_entries = neighbors.offset[n_bots];
+
+  if (verlet.allocated_bots < n_bots+1)
+    {
+      verlet.allocated_bots = n_bots+1;
+      verlet.offset = realloc(verlet.offset, verlet.allocated_bots * sizeof(int));
+      verlet.x0 = realloc(verlet.x0, verlet.allocated_bots * sizeof(double));
+      verlet.y0 = realloc(verlet.y0, verlet.allocated_bots * sizeof(double));
+      assert(verlet.offset != NULL && verlet.x0 != NULL && verlet.y0 != NULL);
+    }
+
+  if (verlet.allocated_entries < n_entries)
+    {
+      verlet.allocated_entries = 2 * n_entries;
+      verlet.index = realloc(verlet.index, verlet.allocated_entries * sizeof(int));
+      assert(verlet.index != NULL);
+    }
+
+  memcpy(verlet.offset, neighbors.offset, (n_bots+1) * sizeof(int));
+  memcpy(verlet.index, neighbors.index, n_entries * sizeof(int));
+
+  for (int i = 0; i < n_bots; i++)
+    {
+      verlet.x0[i] = kinematics.x[i];
+      verlet.y0[i] = kinematics.y[i];
+    }
+
+  verlet.n_bots = n_bots;
+  verlet.bots = allbots;
+}
+
+/* Filter the rows of the bots handled by thread t. The kept entries are
+ * packed from the start of the thread's candidates, verlet.offset[lo].
+ */
+static void verlet_filter_task(void *arg, int t, int n_threads)
+{
+  double sq_cr = *(double *) arg;
+  int lo, hi;
+  pool_range(verlet.n_bots, t, n_threads, &lo, &hi);
+
+  int n = verlet.offset[lo];
+  for (int i = lo; i < hi; i++)
+    {
+      for (int k = verlet.offset[i]; k < verlet.offset[i+1]; k++)
+	{
+	  int j = verlet.index[k];
+	  double sq_bd = bot_sq_dist(i, j);
+	  if (sq_bd < sq_cr)
+	    {
+	      neighbors.index[n] = j;
+	      neighbors.dist[n++] = sqrt(sq_bd);
+	    }
+	}
+      neighbors.offset[i+1] = n;
+    }
+  verlet.t_end[t] = n;
+}
+
+/* Fill the neighbor store with the candidates closer than cr.
+ *
+ * Filtering keeps the rows sorted, so the store is written directly
+ * without collecting pairs. The threads' parts are then moved together.
+ */
+void verlet_filter(int n_bots, double cr)
+{
+  double sq_cr = cr * cr;
+
+  neighbors_reset(n_bots);
+  store_reserve_entries(&neighbors, verlet.offset[n_bots]);
+
+  pool_run(verlet_filter_task, &sq_cr);
+
+  int n_threads = pool_threads();
+  int n = verlet.t_end[0];
+  for (int t = 1; t < n_threads; t++)
+    {
+      int lo, hi;
+      pool_range(n_bots, t, n_threads, &lo, &hi);
+      int start = verlet.offset[lo];
+      int shift = start - n;
+      if (shift > 0)
+	{
+	  memmove(neighbors.index + n, neighbors.index + start, (verlet.t_end[t] - start) * sizeof(int));
+	  memmove(neighbors.dist + n, neighbors.dist + start, (verlet.t_end[t] - start) * sizeof(double));
+	  for (int i = lo; i < hi; i++)
+	    neighbors.offset[i+1] -= shift;
+	}
+      n = verlet.t_end[t] - shift;
+    }
+}
+
+
+/* Communication neighbors found on demand, see comm_neighbors().
+ * The bots are binned with the spatial hash, which needs no bounding box,
+ * and each listed bot looks up the bots in its 3x3 cells.
+ */
+neighbor_store comm_store;
+spatial_hash comm_hash;
+
+static struct {
+  int *bots, n;
+  double cr;
+} comm_query;
+
+static void comm_query_task(void *arg, int t, int n_threads)
+{
+  int lo, hi;
+  pool_range(comm_query.n, t, n_threads, &lo, &hi);
+
+  pair_buffer *out = &comm_store.found[t];
+  for (int q = lo; q < hi; q++)
+    spatial_hash_find_near(&comm_hash, comm_query.bots[q], comm_query.cr, out);
+}
+
+neighbor_store *comm_neighbors(int n_bots, int *bots, int n)
+{
+  if (!simparams->useGrid || !simparams->lazyCommNeighbors)
+    return &neighbors;
+
+  store_reset(&comm_store, n_bots);
+  if (n > 0)
+    {
+      comm_query.bots = bots;
+      comm_query.n = n;
+      comm_query.cr = allbots[0]->cr;
+      spatial_hash_build(&comm_hash, n_bots, comm_query.cr);
+      pool_run(comm_query_task, NULL);
+    }
+
+  size_t n_entries = 0;
+  for (int t = 0; t < comm_store.n_found; t++)
+    n_entries += comm_store.found[t].n_pairs;
+  store_reserve_entries(&comm_store, n_entries);
+
+  // the threads handled consecutive parts of the list, so the pairs
+  // arrive ordered by row
+  int *offset = comm_store.offset;
+  int e = 0, next = 0;
+  for (int t = 0; t < comm_store.n_found; t++)
+    for (size_t k = 0; k < comm_store.found[t].n_pairs; k++)
+      {
+	bot_pair *p = &comm_store.found[t].pairs[k];
+	while (next <= p->a)
+	  offset[next++] = e;
+	comm_store.index[e] = p->b;
+	comm_store.dist[e++] = p->dist;
+      }
+  while (next <= n_bots)
+    offset[next++] = e;
+
+  return &comm_store;
+}
+
+
+/* Bots in collision range, found with a spatial hash with cells of the
+ * range, about one and a half bot diameters, independently of the
+ * communication range. Used for the clash
+ * pass with collisionGrid or lazyCommNeighbors. In dense piles the cells of
+ * the communication search hold dozens of bots each, while a contact cell
+ * holds a few.
+ */
+neighbor_store contacts;
+spatial_hash contact_hash;
+
+static void contact_search_task(void *arg, int t, int n_threads)
+{
+  size_t lo = balanced_split(contact_hash.cell_start, contact_hash.n_cells, 1, t, n_threads);
+  size_t hi = balanced_split(contact_hash.cell_start, contact_hash.n_cells, 1, t+1, n_threads);
+  spatial_hash_find_pairs(&contact_hash, *(double *) arg, lo, hi, &contacts.found[t]);
+}
+
+static void find_contacts(int n_bots, double range)
+{
+  store_reset(&contacts, n_bots);
+  spatial_hash_build(&contact_hash, n_bots, range);
+  pool_run(contact_search_task, &range);
+  store_build(&contacts);
+}
+
+
+/* Rows that may contain a clash: initially clashing pairs, found in parallel,
+ * and rows where a bot has been moved apart since.
+ */
+unsigned char *clash_row = NULL;
+size_t allocated_clash_rows = 0;
+neighbor_store *clashes = &neighbors; // the store the clash pass walks
+
+static void clash_rows_task(void *arg, int t, int n_threads)
+{
+  double sq_clash = *(double *) arg;
+  int lo, hi;
+  pool_range(clashes->n_bots, t, n_threads, &lo, &hi);
+
+  for (int i = lo; i < hi; i++)
+    {
+      clash_row[i] = 0;
+      for (int k = clashes->offset[i]; k < clashes->offset[i+1]; k++)
+	if (bot_sq_dist(i, clashes->index[k]) < sq_clash)
+	  {
+	    clash_row[i] = 1;
+	    break;
+	  }
+    }
+}
+
+/* A bot was moved apart: its distance to every neighbor may have changed. */
+static void mark_clash_rows(int i)
+{
+  clash_row[i] = 1;
+  for (int k = clashes->offset[i]; k < clashes->offset[i+1]; k++)
+    clash_row[clashes->index[k]] = 1;
+}
+
+
+/* Update the bots' interactions with each other.
+ *
+ * - Move clashing bots apart.
+ * - Update which bots can communicate with each other.
+ *  -- the bots in range are stored in the neighbors store,
+ *     which stays empty with lazyCommNeighbors
+ *
+ * With several threads, the search and the distance checks are split
+ * between them. The results do not depend on the number of threads.
+ */
+void update_interactions_grid (int n_bots)
+{
+  apply_user_obstacles(n_bots);
+  resolve_obstacles(n_bots);
+
+  double cr = allbots[0]->cr;
+  double sq_r = allbots[0]->radius * allbots[0]->radius;
+  double skin = simparams->neighborSkin;
+  int i;
+
+  if (simparams->lazyCommNeighbors)
+    {
+      // found on demand by comm_neighbors()
+      neighbors_reset(n_bots);
+    }
+  else if (skin > 0)
+    {
+      // search the wider range cr + skin only when the candidates expired
+      if (verlet_needs_rebuild(n_bots, skin))
+	{
+	  neighbors_reset(n_bots);
+	  find_pairs(n_bots, cr + skin);
+	  neighbors_build();
+	  verlet_store_candidates(n_bots);
+	}
+      verlet_filter(n_bots, cr);
+    }
+  else
+    {
+      neighbors_reset(n_bots);
+      find_pairs(n_bots, cr);
+      neighbors_build();
+    }
    
-   // Move colliding robots appart, using the list of neighbors in range.
+   // Move colliding robots appart, using the list of neighbors in range,
+   // or the contacts found with their own grid.
    // Note: Once the bots are moved, the grid cache is no longer valid
+   //
+   // Separating a pair moves the bots, which changes later checks, so this
+   // runs serially in the same order as always. A row without an initial
+   // clash, where no bot has been moved yet, has nothing to do and is skipped.
+
+   if (simparams->collisionSolver == COLLISION_SOLVER_JACOBI)
+     {
+       // the contacts, with a margin of one radius for the pairs
+       // that the iterations push together
+       find_contacts(n_bots, 3 * allbots[0]->radius);
+       solve_collisions_jacobi(&contacts, n_bots, simparams->collisionIterations);
+       neighbors_refresh_dist();
+       return;
+     }
+
+   if (simparams->collisionGrid || simparams->lazyCommNeighbors)
+     {
+       // with the same margin, for the pairs pushed into contact
+       // during the pass
+       find_contacts(n_bots, 3 * allbots[0]->radius);
+       clashes = &contacts;
+     }
+   else
+     clashes = &neighbors;
+
+   if (allocated_clash_rows < n_bots)
+     {
+       allocated_clash_rows = n_bots;
+       clash_row = realloc(clash_row, n_bots);
+       assert(clash_row != NULL);
+     }
+   double sq_clash = 4 * sq_r;
+   pool_run(clash_rows_task, &sq_clash);
    
-   int j;
+   int k;
    for (i = 0; i < n_bots; i++)
      {
+      if (!clash_row[i])
+	continue;
       kilobot * cur = allbots[i];
-      for (j = 0; j < cur->n_in_range; j++)
+      for (k = clashes->offset[i]; k < clashes->offset[i+1]; k++)
 	{
-	  kilobot * other = allbots[cur->in_range[j]];
-	  double sq_bd = bot_sq_dist(cur, other);
+	  kilobot * other = allbots[clashes->index[k]];
+	  double sq_bd = bot_sq_dist(i, clashes->index[k]);
 	  if (sq_bd < (4 * sq_r))
 	    {
 	    //	  printf("Whack %d %d\n", i, j);
         separate_clashing_bots(cur, other);
+        // a bot's rows only need to be flagged the first time it moves
+        int j = clashes->index[k];
+        if (!neighbors.moved[i])
+          {
+            neighbors_mark_moved(i);
+            mark_clash_rows(i);
+          }
+        if (!neighbors.moved[j])
+          {
+            neighbors_mark_moved(j);
+            mark_clash_rows(j);
+          }
 	    // we move the bots, this changes the distance.
 	    // so bd should be recalculated.
 	    // but we only need it below to tell if the bots are
@@ -217,5 +943,7 @@ void update_interactions_grid (int n_bots)
 	  }
 	}
      }
+
+   neighbors_refresh_dist();
 	   
 }
@@ -2,17 +2,89 @@
 #define __NEIGHBORS_H
 void update_interactions_grid (int n_bots);
 
-static inline double bot_sq_dist(kilobot *bot1, kilobot *bot2)
+static inline double bot_sq_dist(int i, int j)
 {
-  double x1 = bot1->x;
-  double x2 = bot2->x;
-  double y1 = bot1->y;
-  double y2 = bot2->y;
+  double x1 = kinematics.x[i];
+  double x2 = kinematics.x[j];
+  double y1 = kinematics.y[i];
+  double y2 = kinematics.y[j];
 
   return (x2 - x1) * (x2 - x1) + (y2 - y1) * (y2 - y1);
 }
 
-#endif
 
+/* A pair of bots within communication range. */
+typedef struct {
+  int a, b;
+  double dist;
+} bot_pair;
+
+/* Pairs found by one thread of the neighbor search. */
+typedef struct {
+  bot_pair *pairs;
+  size_t n_pairs, allocated_pairs;
+} pair_buffer;
+
+/* Neighbor lists of all bots, in compressed sparse row (CSR) form.
+ *
+ * The bots in communication range of bot i are
+ *   index[offset[i]] ... index[offset[i+1]-1]
+ * sorted by increasing index, and dist[] holds the matching pair distances.
+ *
+ * The store is rebuilt every time step from the list of pairs found by
+ * the neighbor search, so the memory use is proportional to the number
+ * of pairs in range, not to n_bots^2. With several threads, each thread
+ * collects its pairs in its own buffer, found[thread].
+ */
+typedef struct {
+  int n_bots;
+  int *offset;      // n_bots+1 entries
+  int *index;
+  double *dist;
+  size_t allocated_bots, allocated_entries;
+
+  // pairs collected since the last reset, one buffer per thread
+  pair_buffer *found;
+  int n_found;
+
+  // bots moved after the search, whose distances need refreshing
+  unsigned char *moved;
+
+  // scratch space for building the sorted rows
+  int *fill;
+  int *tmp_index;
+  double *tmp_dist;
+} neighbor_store;
+
+extern neighbor_store neighbors;
+extern neighbor_store contacts; // the bots in collision range, with collisionGrid
+
+void store_reset(neighbor_store *s, int n_bots);
+void store_build(neighbor_store *s);
 
+// the same for the neighbor store
+void neighbors_reset(int n_bots);
+void neighbors_add_pair(int a, int b, double sq_dist);
+void pair_buffer_add(pair_buffer *buf, int a, int b, double sq_dist);
+void neighbors_build(void);
+void neighbors_refresh_dist(void);
 
+/* Mark bot i as moved since the neighbor search, e.g. by a collision. */
+static inline void neighbors_mark_moved(int i)
+{
+  neighbors.moved[i] = 1;
+}
+
+/* The communication neighbors of the bots in the sorted list bots.
+ * Returns the neighbor store, unless lazyCommNeighbors is set: then the
+ * store only holds the bots in collision range, and the rows of the listed
+ * bots are found on demand, in a separate store where all other rows are empty.
+ */
+neighbor_store *comm_neighbors(int n_bots, int *bots, int n);
+
+static inline int n_neighbors(int i)
+{
+  return neighbors.offset[i+1] - neighbors.offset[i];
+}
+
+#endif
@@ -0,0 +1,296 @@
+/* Static obstacles, see obstacles.h.
+ *
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<math.h>
+
+#define NDEBUG // define to turn assertions off
+#include<assert.h>
+#include"skilobot.h"
+#include"thread_pool.h"
+#include"obstacles.h"
+
+obstacle *obstacles = NULL;
+int n_obstacles = 0;
+static int allocated_obstacles = 0;
+
+/* Node of the bounding volume hierarchy. The left child of an inner node
+ * directly follows it, a leaf holds the obstacles first ... first+count-1.
+ */
+typedef struct {
+  double min_x, min_y, max_x, max_y;
+  int first, count;  // count is 0 for inner nodes
+  int right;         // the right child of an inner node
+} bvh_node;
+
+#define BVH_LEAF_SIZE 4
+
+static struct {
+  bvh_node *nodes;
+  int n_nodes, allocated_nodes;
+  int valid;
+} bvh;
+
+void obstacles_clear(void)
+{
+  n_obstacles = 0;
+  bvh.valid = 0;
+}
+
+static obstacle *new_obstacle(int type)
+{
+  if (n_obstacles == allocated_obstacles)
+    {
+      allocated_obstacles = allocated_obstacles < 64 ? 64 : 2 * allocated_obstacles;
+      obstacles = realloc(obstacles, allocated_obstacles * sizeof(obstacle));
+      if (obstacles == NULL)
+	{
+	  fprintf(stderr, "Could not allocate %d obstacles.\n", allocated_obstacles);
+	  exit(1);
+	}
+    }
+  bvh.valid = 0;
+  obstacle *o = &obstacles[n_obstacles++];
+  o->type = type;
+  o->x1 = o->y1 = o->x2 = o->y2 = o->r = 0;
+  return o;
+}
+
+void obstacles_add_segment(double x1, double y1, double x2, double y2)
+{
+  obstacle *o = new_obstacle(OBSTACLE_SEGMENT);
+  o->x1 = x1;
+  o->y1 = y1;
+  o->x2 = x2;
+  o->y2 = y2;
+}
+
+void obstacles_add_circle(double x, double y, double r)
+{
+  obstacle *o = new_obstacle(OBSTACLE_CIRCLE);
+  o->x1 = x;
+  o->y1 = y;
+  o->r = r;
+}
+
+static void obstacle_box(obstacle *o, double *min_x, double *min_y, double *max_x, double *max_y)
+{
+  if (o->type == OBSTACLE_CIRCLE)
+    {
+      *min_x = o->x1 - o->r;
+      *max_x = o->x1 + o->r;
+      *min_y = o->y1 - o->r;
+      *max_y = o->y1 + o->r;
+    }
+  else
+    {
+      *min_x = fmin(o->x1, o->x2);
+      *max_x = fmax(o->x1, o->x2);
+      *min_y = fmin(o->y1, o->y2);
+      *max_y = fmax(o->y1, o->y2);
+    }
+}
+
+static int split_axis;
+
+static int compare_centers(const void *a, const void *b)
+{
+  const obstacle *p = a, *q = b;
+  double cp = split_axis ? (p->y1 + (p->type == OBSTACLE_SEGMENT ? p->y2 : p->y1))
+                         : (p->x1 + (p->type == OBSTACLE_SEGMENT ? p->x2 : p->x1));
+  double cq = split_axis ? (q->y1 + (q->type == OBSTACLE_SEGMENT ? q->y2 : q->y1))
+                         : (q->x1 + (q->type == OBSTACLE_SEGMENT ? q->x2 : q->x1));
+  return (cp > cq) - (cp < cq);
+}
+
+/* Build the subtree of the obstacles first ... first+count-1, splitting
+ * them at the median along the longer side of their bounding box.
+ * Returns the index of its root.
+ */
+static int build_node(int first, int count)
+{
+  int node = bvh.n_nodes++;
+  bvh_node *b = &bvh.nodes[node];
+
+  obstacle_box(&obstacles[first], &b->min_x, &b->min_y, &b->max_x, &b->max_y);
+  for (int k = first+1; k < first+count; k++)
+    {
+      double x0, y0, x1, y1;
+      obstacle_box(&obstacles[k], &x0, &y0, &x1, &y1);
+      b->min_x = fmin(b->min_x, x0);
+      b->min_y = fmin(b->min_y, y0);
+      b->max_x = fmax(b->max_x, x1);
+      b->max_y = fmax(b->max_y, y1);
+    }
+  b->first = first;
+  b->count = count;
+  b->right = -1;
+  if (count <= BVH_LEAF_SIZE)
+    return node;
+
+  split_axis = b->max_y - b->min_y > b->max_x - b->min_x;
+  qsort(obstacles + first, count, sizeof(obstacle), compare_centers);
+
+  int half = count / 2;
+  build_node(first, half);
+  int right = build_node(first + half, count - half);
+  // nodes do not move, they were allocated for the whole tree
+  bvh.nodes[node].count = 0;
+  bvh.nodes[node].right = right;
+  return node;
+}
+
+static void obstacles_build(void)
+{
+  // a tree with leaves of at least one obstacle has fewer than 2*n nodes
+  if (bvh.allocated_nodes < 2 * n_obstacles)
+    {
+      bvh.allocated_nodes = 2 * n_obstacles;
+      bvh.nodes = realloc(bvh.nodes, bvh.allocated_nodes * sizeof(bvh_node));
+      if (bvh.nodes == NULL)
+	{
+	  fprintf(stderr, "Could not allocate the obstacle tree.\n");
+	  exit(1);
+	}
+    }
+  bvh.n_nodes = 0;
+  build_node(0, n_obstacles);
+  bvh.valid = 1;
+}
+
+/* Move the disc of radius r at (*x, *y) out of obstacle o, if they overlap. */
+static void push_out(obstacle *o, double *x, double *y, double r)
+{
+  double cx = o->x1, cy = o->y1;
+  double ux = 1, uy = 0;  // direction to push in if the center is on the obstacle
+  double reach = r;
+
+  if (o->type == OBSTACLE_SEGMENT)
+    {
+      // closest point of the segment
+      double dx = o->x2 - o->x1;
+      double dy = o->y2 - o->y1;
+      double len2 = dx*dx + dy*dy;
+      double t = len2 > 0 ? ((*x - o->x1) * dx + (*y - o->y1) * dy) / len2 : 0;
+      t = t < 0 ? 0 : (t > 1 ? 1 : t);
+      cx += t * dx;
+      cy += t * dy;
+      if (len2 > 0)
+	{
+	  ux = -dy / sqrt(len2);
+	  uy = dx / sqrt(len2);
+	}
+    }
+  else
+    reach += o->r;
+
+  double vx = *x - cx;
+  double vy = *y - cy;
+  double sq_d = vx*vx + vy*vy;
+  if (sq_d >= reach * reach)
+    return;
+
+  double d = sqrt(sq_d);
+  if (d > 1e-9)
+    {
+      ux = vx / d;
+      uy = vy / d;
+    }
+  *x = cx + reach * ux;
+  *y = cy + reach * uy;
+}
+
+static void resolve_bot(int i, double r)
+{
+  double x = kinematics.x[i];
+  double y = kinematics.y[i];
+  int stack[64];
+  int n = 0;
+
+  stack[n++] = 0;
+  while (n > 0)
+    {
+      bvh_node *b = &bvh.nodes[stack[--n]];
+      if (x + r <= b->min_x || x - r >= b->max_x || y + r <= b->min_y || y - r >= b->max_y)
+	continue;
+
+      if (b->count > 0)
+	for (int k = b->first; k < b->first + b->count; k++)
+	  push_out(&obstacles[k], &x, &y, r);
+      else
+	{
+	  assert(n + 2 <= 64);
+	  stack[n++] = b->right;
+	  stack[n++] = b - bvh.nodes + 1;
+	}
+    }
+
+  kinematics.x[i] = x;
+  kinematics.y[i] = y;
+}
+
+static void resolve_task(void *arg, int t, int n_threads)
+{
+  int lo, hi;
+  pool_range(*(int *) arg, t, n_threads, &lo, &hi);
+
+  double r = allbots[0]->radius;
+  for (int i = lo; i < hi; i++)
+    resolve_bot(i, r);
+}
+
+void resolve_obstacles(int n_bots)
+{
+  if (n_obstacles == 0)
+    return;
+  if (!bvh.valid)
+    obstacles_build();
+
+  pool_run(resolve_task, &n_bots);
+}
+
+/* Pushes of the user's obstacles callbacks, one per bot. */
+static double *user_push_x, *user_push_y;
+static int allocated_pushes = 0;
+
+/* The per-point callback as a batch callback. A bot is pushed only when
+ * the callback reports an obstacle.
+ */
+static void obstacles_point_shim(int n, const double *x, const double *y, double *push_x, double *push_y)
+{
+  for (int i = 0; i < n; i++)
+    if (!user_obstacles(x[i], y[i], &push_x[i], &push_y[i]))
+      push_x[i] = push_y[i] = 0;
+}
+
+void apply_user_obstacles(int n_bots)
+{
+  void (*batch)(int, const double *, const double *, double *, double *) = user_obstacles_batch;
+  if (batch == NULL)
+    {
+      if (user_obstacles == NULL)
+	return;
+      batch = obstacles_point_shim;
+    }
+
+  if (n_bots > allocated_pushes)
+    {
+      allocated_pushes = n_bots;
+      user_push_x = realloc(user_push_x, n_bots * sizeof(double));
+      user_push_y = realloc(user_push_y, n_bots * sizeof(double));
+      if (user_push_x == NULL || user_push_y == NULL)
+	{
+	  fprintf(stderr, "Could not allocate the obstacle pushes.\n");
+	  exit(1);
+	}
+    }
+
+  batch(n_bots, kinematics.x, kinematics.y, user_push_x, user_push_y);
+  for (int i = 0; i < n_bots; i++)
+    {
+      kinematics.x[i] += user_push_x[i];
+      kinematics.y[i] += user_push_y[i];
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef OBSTACLES_H
+#define OBSTACLES_H
+
+/* Static obstacles, declared in the "obstacles" parameter.
+ *
+ * Walls are line segments, polygons and the arena bounds are stored as
+ * their edges, and circles are solid discs. The obstacles are kept in a
+ * bounding volume hierarchy, so a bot only checks the few obstacles near
+ * it, also in arenas with thousands of walls.
+ */
+enum {OBSTACLE_SEGMENT, OBSTACLE_CIRCLE};
+
+typedef struct {
+  int type;
+  double x1, y1, x2, y2;  // the ends of a segment, or the center of a circle in x1, y1
+  double r;               // radius of a circle
+} obstacle;
+
+extern obstacle *obstacles;
+extern int n_obstacles;
+
+void obstacles_clear(void);
+void obstacles_add_segment(double x1, double y1, double x2, double y2);
+void obstacles_add_circle(double x, double y, double r);
+
+// Push the bots out of the obstacles they overlap.
+void resolve_obstacles(int n_bots);
+
+// Move the bots by the pushes of the obstacles callback, calling the
+// batch callback once, or the per-point one for every bot.
+void apply_user_obstacles(int n_bots);
+
+#endif
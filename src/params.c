@@ -1,7 +1,119 @@
 #include"params.h"
+#include"obstacles.h"
 
 simulation_params *simparams = NULL;
 
+/* Read the coordinates of an obstacle into c. Returns their number, -1 if they are not all numbers. */
+static int obstacle_coords(json_t *a, double *c, int max)
+{
+  if (!json_is_array(a) || json_array_size(a) > max)
+    return -1;
+  for (size_t k = 0; k < json_array_size(a); k++)
+    {
+      if (!json_is_number(json_array_get(a, k)))
+	return -1;
+      c[k] = json_number_value(json_array_get(a, k));
+    }
+  return json_array_size(a);
+}
+
+/* The "stateFields" parameter, a list of "position", "direction", "led"
+ * and "userdata", and the "stateBots" parameter, a list of bot IDs.
+ */
+static void parse_state_projection(void)
+{
+  simparams->stateFields = STATE_POSITION | STATE_DIRECTION | STATE_LED;
+  json_t *fields = json_object_get(simparams->root, "stateFields");
+  if (json_is_array(fields))
+    {
+      simparams->stateFields = 0;
+      for (size_t k = 0; k < json_array_size(fields); k++)
+	{
+	  const char *f = json_string_value(json_array_get(fields, k));
+	  if (f != NULL && strcmp(f, "position") == 0)
+	    simparams->stateFields |= STATE_POSITION;
+	  else if (f != NULL && strcmp(f, "direction") == 0)
+	    simparams->stateFields |= STATE_DIRECTION;
+	  else if (f != NULL && strcmp(f, "led") == 0)
+	    simparams->stateFields |= STATE_LED;
+	  else if (f != NULL && strcmp(f, "userdata") == 0)
+	    simparams->stateFields |= STATE_USERDATA;
+	  else
+	    fprintf(stderr, "Unknown state field %d in stateFields.\n Ignoring it.\n", (int) k);
+	}
+    }
+  else if (fields != NULL)
+    fprintf(stderr, "Parameter stateFields is not an array.\n Ignoring it.\n");
+
+  simparams->stateBots = NULL;
+  simparams->n_stateBots = 0;
+  json_t *bots = json_object_get(simparams->root, "stateBots");
+  if (json_is_array(bots))
+    {
+      simparams->stateBots = malloc(json_array_size(bots) * sizeof(int) + 1);
+      for (size_t k = 0; k < json_array_size(bots); k++)
+	{
+	  json_t *id = json_array_get(bots, k);
+	  if (json_is_integer(id) && json_integer_value(id) >= 0)
+	    simparams->stateBots[simparams->n_stateBots++] = json_integer_value(id);
+	  else
+	    fprintf(stderr, "Entry %d of stateBots is not a bot ID.\n Ignoring it.\n", (int) k);
+	}
+    }
+  else if (bots != NULL)
+    fprintf(stderr, "Parameter stateBots is not an array.\n Ignoring it.\n");
+}
+
+/* The "obstacles" parameter, a list of objects with one of the keys
+ *   "segment": [x1, y1, x2, y2]
+ *   "polygon": [x1, y1, x2, y2, x3, y3, ...] closed, walls only
+ *   "circle":  [x, y, r]
+ *   "bounds":  [xmin, ymin, xmax, ymax] walls around the arena
+ */
+static void parse_obstacles(void)
+{
+  obstacles_clear();
+  json_t *list = json_object_get(simparams->root, "obstacles");
+  if (list == NULL)
+    return;
+  if (!json_is_array(list))
+    {
+      fprintf(stderr, "Parameter obstacles is not an array.\n Ignoring it.\n");
+      return;
+    }
+
+  for (size_t k = 0; k < json_array_size(list); k++)
+    {
+      json_t *o = json_array_get(list, k);
+      json_t *polygon = json_object_get(o, "polygon");
+      size_t size = json_array_size(polygon) > 4 ? json_array_size(polygon) : 4;
+      double *c = malloc(size * sizeof(double));
+      if (c == NULL)
+	{
+	  fprintf(stderr, "Could not allocate obstacle %d.\n", (int) k);
+	  exit(1);
+	}
+      int n;
+      if ((n = obstacle_coords(json_object_get(o, "segment"), c, 4)) == 4)
+	obstacles_add_segment(c[0], c[1], c[2], c[3]);
+      else if ((n = obstacle_coords(json_object_get(o, "circle"), c, 3)) == 3)
+	obstacles_add_circle(c[0], c[1], c[2]);
+      else if ((n = obstacle_coords(json_object_get(o, "bounds"), c, 4)) == 4)
+	{
+	  obstacles_add_segment(c[0], c[1], c[2], c[1]);
+	  obstacles_add_segment(c[2], c[1], c[2], c[3]);
+	  obstacles_add_segment(c[2], c[3], c[0], c[3]);
+	  obstacles_add_segment(c[0], c[3], c[0], c[1]);
+	}
+      else if ((n = obstacle_coords(polygon, c, size)) >= 6 && n % 2 == 0)
+	for (int v = 0; v < n; v += 2)
+	  obstacles_add_segment(c[v], c[v+1], c[(v+2) % n], c[(v+3) % n]);
+      else
+	fprintf(stderr, "Obstacle %d is not a segment, polygon, circle or bounds.\n Ignoring it.\n", (int) k);
+      free(c);
+    }
+}
+
 void parse_param_file(const char *filename)
 {
   json_error_t error;
@@ -55,6 +167,7 @@ void parse_param_file(const char *filename)
   simparams->displayHeightPercent = get_float_param("displayHeightPercent", 0.9);
   simparams->histLength           = get_int_param("histLength", 500); // number of history points to draw
   simparams->showHist             = get_int_param("showHist", 0);
+  simparams->historyMemoryMB      = get_float_param("historyMemoryMB", 0); // limit, thins out the history
   simparams->randSeed             = get_int_param("randSeed", 0);
   simparams->GUI                  = get_int_param("GUI", 1);
   simparams->distance_noise       = get_float_param("distanceNoise", 0);
@@ -69,6 +182,71 @@ void parse_param_file(const char *filename)
   simparams->displayX             = get_float_param("displayX", 0);
   simparams->displayY             = get_float_param("displayY", 0);
   simparams->useGrid              = get_int_param("useGrid", 1);
+  simparams->neighborSkin         = get_float_param("neighborSkin", 0);
+  simparams->threads              = get_int_param("threads", 1);
+  simparams->simdKinematics       = get_int_param("simdKinematics", 0);
+  simparams->parallelUserLoop     = get_int_param("parallelUserLoop", 0);
+  simparams->batchedDelivery      = get_int_param("batchedDelivery", 0);
+  simparams->lazyCommNeighbors    = get_int_param("lazyCommNeighbors", 0);
+  simparams->collisionGrid        = get_int_param("collisionGrid", 0);
+  simparams->collisionIterations  = get_int_param("collisionIterations", 4);
+
+  const char *index               = get_string_param("neighborIndex", "grid");
+  if (index != NULL && strcmp(index, "cells") == 0)
+    simparams->neighborIndex = NEIGHBOR_INDEX_CELLS;
+  else if (index != NULL && strcmp(index, "hash") == 0)
+    simparams->neighborIndex = NEIGHBOR_INDEX_HASH;
+  else
+    {
+      if (index != NULL && strcmp(index, "grid") != 0)
+	fprintf(stderr, "Unknown neighborIndex %s.\n Using grid.\n", index);
+      simparams->neighborIndex = NEIGHBOR_INDEX_GRID;
+    }
+
+  const char *format              = get_string_param("stateFormat", "json");
+  if (format != NULL && strcmp(format, "binary") == 0)
+    simparams->stateFormat = STATE_FORMAT_BINARY;
+  else if (format != NULL && strcmp(format, "ndjson") == 0)
+    simparams->stateFormat = STATE_FORMAT_NDJSON;
+  else
+    {
+      if (format != NULL && strcmp(format, "json") != 0)
+	fprintf(stderr, "Unknown stateFormat %s.\n Using json.\n", format);
+      simparams->stateFormat = STATE_FORMAT_JSON;
+    }
+  parse_state_projection();
+  simparams->writerBuffers        = get_int_param("writerBuffers", 2);
+  simparams->checkpointFile       = get_string_param("checkpointFile", NULL);
+  simparams->checkpointSteps      = get_int_param("checkpointSteps", 0);
+
+  const char *solver              = get_string_param("collisionSolver", "push");
+  if (solver != NULL && strcmp(solver, "jacobi") == 0)
+    simparams->collisionSolver = COLLISION_SOLVER_JACOBI;
+  else
+    {
+      if (solver != NULL && strcmp(solver, "push") != 0)
+	fprintf(stderr, "Unknown collisionSolver %s.\n Using push.\n", solver);
+      simparams->collisionSolver = COLLISION_SOLVER_PUSH;
+    }
+
+  simparams->hugePages            = get_int_param("hugePages", 0);
+  simparams->lightRaster          = get_float_param("lightRaster", 0);
+  simparams->lightFile            = get_string_param("lightFile", NULL);
+  simparams->lightRasterRefresh   = get_int_param("lightRasterRefresh", 0);
+  double area[4] = {-1000, -1000, 1000, 1000};
+  if (json_object_get(root, "lightRasterArea") != NULL)
+    for (int k = 0; k < 4; k++)
+      area[k] = get_float_array_param("lightRasterArea", k, area[k]);
+  if (area[2] <= area[0] || area[3] <= area[1])
+    {
+      fprintf(stderr, "lightRasterArea is empty.\n Using [-1000, -1000, 1000, 1000].\n");
+      area[0] = area[1] = -1000;
+      area[2] = area[3] = 1000;
+    }
+  for (int k = 0; k < 4; k++)
+    simparams->lightRasterArea[k] = area[k];
+
+  parse_obstacles();
 }
 
 int get_int_param(const char *param_name, int default_val)
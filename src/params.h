@@ -20,6 +20,13 @@ typedef struct {
   int saveVideo;
   const char *stateFileName; 
   int stateFileSteps; 
+  int stateFormat; // STATE_FORMAT_JSON, STATE_FORMAT_NDJSON or STATE_FORMAT_BINARY
+  int stateFields; // STATE_* fields in the binary frames
+  int *stateBots;  // IDs of the bots in the binary frames, NULL for all
+  int n_stateBots;
+  int writerBuffers; // staging buffers of the writer thread, 0 to write on the simulation thread
+  const char *checkpointFile; // binary checkpoint, written every checkpointSteps steps and on SIGTERM or SIGUSR1
+  int checkpointSteps; // steps between checkpoints, 0 for only on a signal
   int stepsPerFrame; 
   const char *bot_name;
   float display_scale;  
@@ -44,8 +51,29 @@ typedef struct {
   double distanceCoefficient; // slope of measured distance
   double displayX, displayY;
   int useGrid; // if true, use the grid cache
+  int neighborIndex; // spatial index used for the neighbor search when useGrid is set
+  double neighborSkin; // Verlet list margin in mm, 0 to search every step
+  int threads; // number of threads for the parallel parts of a step
+  int simdKinematics; // if true, move the bots with the vectorized integrator
+  int parallelUserLoop; // if true, run the bots' loop functions on the thread pool
+  int batchedDelivery; // if true, deliver the messages of a step grouped by receiver
+  int lazyCommNeighbors; // if true, find the communication neighbors only for the transmitting bots
+  int collisionGrid; // if true, find the colliding bots with their own grid, not the neighbor lists
+  int collisionSolver; // how clashing bots are moved apart when useGrid is set
+  int collisionIterations; // iterations of the jacobi collision solver per step
+  double lightRaster; // node spacing in mm of the light field cache, 0 for none
+  double lightRasterArea[4]; // xmin, ymin, xmax, ymax covered by the light field cache
+  const char *lightFile; // PGM image with the light field, instead of sampling it
+  int lightRasterRefresh; // resample the light field cache every this many kilo_ticks, 0 for never
+  int hugePages; // back the bot arena with huge pages
+  double historyMemoryMB; // memory for the histories of all bots, 0 for no limit
 } simulation_params;
 
+enum {NEIGHBOR_INDEX_GRID, NEIGHBOR_INDEX_CELLS, NEIGHBOR_INDEX_HASH};
+enum {COLLISION_SOLVER_PUSH, COLLISION_SOLVER_JACOBI};
+enum {STATE_FORMAT_JSON, STATE_FORMAT_NDJSON, STATE_FORMAT_BINARY};
+enum {STATE_POSITION = 1, STATE_DIRECTION = 2, STATE_LED = 4, STATE_USERDATA = 8};
+
 void parse_param_file(const char *filename);
 int get_int_param(const char *param_name, int default_val);
 float get_float_param(const char *param_name, float default_val);
@@ -0,0 +1,83 @@
+/* Counter based random number generator, see rng.h.
+ *
+ * Philox4x32 with 10 rounds, from Salmon et al., "Parallel random numbers:
+ * as easy as 1, 2, 3", SC 2011. It has no state besides the key, so it can
+ * be called from any thread without locking.
+ */
+
+#include<math.h>
+#include"rng.h"
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+#define TWO_PI 6.28318530717958647693
+
+static uint32_t rng_key[2] = {0, 0x6b696c6fu};
+
+void rng_seed(uint32_t seed)
+{
+  rng_key[0] = seed;
+}
+
+uint32_t rng_get_seed(void)
+{
+  return rng_key[0];
+}
+
+static void philox_round(uint32_t c[4], const uint32_t k[2])
+{
+  uint64_t p0 = (uint64_t) PHILOX_M0 * c[0];
+  uint64_t p1 = (uint64_t) PHILOX_M1 * c[2];
+  uint32_t c1 = c[1], c3 = c[3];
+
+  c[0] = (uint32_t) (p1 >> 32) ^ c1 ^ k[0];
+  c[1] = (uint32_t) p1;
+  c[2] = (uint32_t) (p0 >> 32) ^ c3 ^ k[1];
+  c[3] = (uint32_t) p0;
+}
+
+/* Four random words for the counter (a, b, c, purpose). */
+void rng_block(int purpose, uint32_t a, uint32_t b, uint32_t c, uint32_t out[4])
+{
+  uint32_t k[2] = {rng_key[0], rng_key[1]};
+
+  out[0] = a;
+  out[1] = b;
+  out[2] = c;
+  out[3] = purpose;
+  for (int r = 0; r < 10; r++)
+    {
+      philox_round(out, k);
+      k[0] += PHILOX_W0;
+      k[1] += PHILOX_W1;
+    }
+}
+
+uint32_t rng_u32(int purpose, uint32_t a, uint32_t b, uint32_t c)
+{
+  uint32_t out[4];
+  rng_block(purpose, a, b, c, out);
+  return out[0];
+}
+
+// uniform in [0, 1), with 53 random bits
+double rng_uniform(int purpose, uint32_t a, uint32_t b, uint32_t c)
+{
+  uint32_t out[4];
+  rng_block(purpose, a, b, c, out);
+  return ((out[0] >> 5) * 67108864.0 + (out[1] >> 6)) / 9007199254740992.0;
+}
+
+// gaussian, with the Box-Muller transform of two words of the block
+double rng_gauss(int purpose, uint32_t a, uint32_t b, uint32_t c, double mean, double sig)
+{
+  uint32_t out[4];
+  rng_block(purpose, a, b, c, out);
+
+  double u1 = (out[0] + 0.5) / 4294967296.0; // in (0, 1), so log(u1) is finite
+  double u2 = out[1] / 4294967296.0;
+  return mean + sig * sqrt(-2.0 * log(u1)) * cos(TWO_PI * u2);
+}
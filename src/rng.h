@@ -0,0 +1,29 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include<stdint.h>
+
+/* Counter based random numbers (Philox4x32-10).
+ *
+ * A draw is a pure function of the seed and its counter: what the number is
+ * used for, and three words (a, b, c) that identify the draw, e.g. bot ID,
+ * kilo_ticks and a sequence number. The results therefore do not depend on
+ * the order of the draws, or on which thread makes them.
+ */
+enum {
+  RNG_HARD,        // rand_hard(): bot ID, kilo_ticks, draw number of the bot
+  RNG_MOTOR,       // motor calibration and speed noise: bot ID, quantity
+  RNG_TX_TICKS,    // initial transmission time: bot ID
+  RNG_DISTANCE,    // distance measurement noise: tx ID, rx ID, tx_ticks of tx
+  RNG_MESSAGE,     // message loss: tx ID, rx ID, tx_ticks of tx
+  RNG_DISTRIBUTE   // initial placement: bot ID, coordinate
+};
+
+void rng_seed(uint32_t seed);
+uint32_t rng_get_seed(void);
+void rng_block(int purpose, uint32_t a, uint32_t b, uint32_t c, uint32_t out[4]);
+uint32_t rng_u32(int purpose, uint32_t a, uint32_t b, uint32_t c);
+double rng_uniform(int purpose, uint32_t a, uint32_t b, uint32_t c);
+double rng_gauss(int purpose, uint32_t a, uint32_t b, uint32_t c, double mean, double sig);
+
+#endif
@@ -4,6 +4,7 @@
 #include<getopt.h>
 #include<math.h>
 #include<time.h>
+#include<signal.h>
 #include<jansson.h>
 
 #include"kilolib.h"
@@ -24,6 +25,12 @@
 #include"skilobot.h"
 #include"params.h"
 #include"stateio.h"
+#include"thread_pool.h"
+#include"kinematics.h"
+#include"rng.h"
+#include"trajectory.h"
+#include"async_writer.h"
+#include"checkpoint.h"
 
 // timing macros.
 // http://stackoverflow.com/questions/173409/how-can-i-find-the-execution-time-of-a-section-of-my-program-in-c
@@ -35,6 +42,10 @@ clock_t startm, stopm;
 int n_bots = 100;
 int state = RUNNING;
 int fullSpeed = 0;     // if nonzero, run without delay between frames
+int video_frame = 0;   // number of the next video frame
+
+// the last of SIGTERM and SIGUSR1 received, handled after the current step
+static volatile sig_atomic_t checkpoint_signal = 0;
 
 
 void distribute_bots(int n_bots);
@@ -48,6 +59,41 @@ void die(char *s)
 }
 
 
+static void on_checkpoint_signal(int sig)
+{
+  checkpoint_signal = sig;
+  signal(sig, on_checkpoint_signal);
+}
+
+void save_checkpoint(double time, int n_step, int save_states)
+{
+  checkpoint_run run = {time, n_step, video_frame, 0, 0, 0};
+  if (save_states)
+    {
+      // where the state file will be continued
+      run.state_format = simparams->stateFormat + 1;
+      if (simparams->stateFormat == STATE_FORMAT_BINARY)
+	run.state_offset = trajectory_tell(&run.state_frames);
+      else
+	run.state_offset = state_writer_tell(&run.state_frames);
+    }
+  if (checkpoint_save(simparams->checkpointFile, n_bots, &run))
+    printf("Checkpoint saved to %s at %d steps\n", simparams->checkpointFile, n_step);
+  else
+    fprintf(stderr, "Error saving the checkpoint to %s\n", simparams->checkpointFile);
+}
+
+// nonzero if the file exists and is not empty
+int file_has_data(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return 0;
+  int c = fgetc(f);
+  fclose(f);
+  return c != EOF;
+}
+
 void initialise_simulator(const char *param_filename)
 {
   /* Parse parameter file and perform initialisation */
@@ -56,10 +102,13 @@ void initialise_simulator(const char *param_filename)
   // fill in the global simparams structure
   parse_param_file(param_filename);
 
+  // rand() is left for the user program, the simulator uses the rng.h streams
   if (!simparams->randSeed) {
     srand(time(0));
+    rng_seed(time(0));
   } else {
     srand(simparams->randSeed);
+    rng_seed(simparams->randSeed);
   }
 #ifndef SKILO_HEADLESS
   set_display_center(simparams->displayX, simparams->displayY);
@@ -74,6 +123,8 @@ void draw()
   for (int i=0; i <n_bots; i++) 
     draw_bot_history_ring(screen, simparams->display_w, simparams->display_h, allbots[i]);
   
+  draw_obstacles(screen);
+
   if (simparams->showComms) 
     draw_commLines(screen);
   
@@ -114,6 +165,12 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  pool_init(simparams->threads);
+  writer_init(simparams->writerBuffers);
+
+  if (simparams->simdKinematics && kinematics_simd_width() == 1)
+    fprintf(stderr, "simdKinematics: built without AVX2 or AVX-512, using the scalar integrator.\n");
+
 #ifndef SKILO_HEADLESS
   double frameTimeAvg = 0;
 
@@ -138,7 +195,13 @@ int main(int argc, char *argv[])
 #endif
   
   allbots = NULL;
-  if (bot_state_file) {
+  int resume = bot_state_file ? checkpoint_bots(bot_state_file) : 0;
+  if (resume) {
+    // a checkpoint, the bots are restored after their main()
+    n_bots = resume;
+    create_bots(n_bots);
+  }
+  else if (bot_state_file) {
     allbots = bot_loader(bot_state_file, &n_bots);
     if (allbots == NULL)
 	die("Could not parse the given bot file");
@@ -169,8 +232,27 @@ int main(int argc, char *argv[])
 	  callback_global_setup();
 
   // call the per-bot setup here so that global setup can provide
-  // e.g. simulation-specific parameter values to it
-  user_setup_all_bots(n_bots);
+  // e.g. simulation-specific parameter values to it.
+  // A resumed run continues from the bots' state in the checkpoint instead.
+  int n_step = 0;
+  checkpoint_run run = {0, 0, 0, 0, 0, 0};
+  if (resume)
+    {
+      if (!checkpoint_load(bot_state_file, n_bots, &run))
+	die("Could not resume from the checkpoint");
+      time = run.time;
+      n_step = run.n_step;
+      video_frame = run.video_frame;
+      printf("Resuming from %s at %d steps\n", bot_state_file, n_step);
+    }
+  else
+    user_setup_all_bots(n_bots);
+
+  if (simparams->checkpointFile)
+    {
+      signal(SIGTERM, on_checkpoint_signal);
+      signal(SIGUSR1, on_checkpoint_signal);
+    }
 
 
 #ifndef SKILO_HEADLESS
@@ -185,7 +267,33 @@ int main(int argc, char *argv[])
   char buf[2000];  
 #endif
   
-  json_t *j_state = json_array();
+  int save_states = simparams->stateFileName && simparams->stateFileSteps != 0;
+  if (save_states && resume && run.state_format)
+    {
+      // continue the states of the interrupted run where the checkpoint was taken
+      int ok;
+      if (run.state_format != simparams->stateFormat + 1)
+	die("The checkpoint was taken with another stateFormat");
+      if (simparams->stateFormat == STATE_FORMAT_BINARY)
+	ok = trajectory_resume(simparams->stateFileName, n_bots, run.state_frames);
+      else
+	ok = state_writer_resume(simparams->stateFileName, simparams->stateFormat == STATE_FORMAT_NDJSON,
+				 run.state_offset, run.state_frames);
+      if (!ok)
+	die("Could not continue the state file from the checkpoint");
+    }
+  else if (save_states)
+    {
+      int ok;
+      if (resume && file_has_data(simparams->stateFileName))
+	die("The checkpoint has no saved states, not overwriting the state file");
+      if (simparams->stateFormat == STATE_FORMAT_BINARY)
+	ok = trajectory_open(simparams->stateFileName, n_bots);
+      else
+	ok = state_writer_open(simparams->stateFileName, simparams->stateFormat == STATE_FORMAT_NDJSON);
+      if (!ok)
+	die("Could not open the state file");
+    }
 
   printf ("Size of kilobot structure : %zd\n", sizeof(kilobot));
   extern int UserdataSize;
@@ -194,8 +302,6 @@ int main(int argc, char *argv[])
   printf("Running %d bots with timestep %f for total time %f\n", 
 	 n_bots, simparams->timeStep, simparams->maxTime);
 
-  int n_step = 0;
-
   START
   
   while(time < simparams->maxTime || simparams->maxTime <= 0) {
@@ -208,14 +314,15 @@ int main(int argc, char *argv[])
 	time += simparams->timeStep;
 	kilo_ticks = time * TICKS_PER_SEC;
        
-	// save simulation state as JSON
-	if (simparams->stateFileSteps != 0)
-	  if (simparams->stateFileName && n_step % simparams->stateFileSteps == 0)
-	    {
+	// save simulation state as JSON, or as a binary frame
+	if (save_states && n_step % simparams->stateFileSteps == 0)
+	  {
+	    if (simparams->stateFormat == STATE_FORMAT_BINARY)
+	      trajectory_write_frame(kilo_ticks);
+	    else
 	      // printf("Saving state to JSON at %6d steps\n", n_step);
-	      json_t *t = json_rep_all_bots(allbots, n_bots, kilo_ticks);
-	      json_array_append_new(j_state, t);
-	    }
+	      state_writer_write(allbots, n_bots, kilo_ticks);
+	  }
 
 #ifndef SKILO_HEADLESS	
 	// save screenshots for video
@@ -223,15 +330,10 @@ int main(int argc, char *argv[])
 	  if (n_step % simparams->saveVideoN == 0)
 	    {
 	      draw(); 
-	      static int frame = 0;
-	      snprintf (buf, 2000, simparams->imageName, frame);
+	      snprintf (buf, 2000, simparams->imageName, video_frame);
 	      // printf("Saving video screenshot to %s at %6d steps\n", buf, n_step);
-	      frame++;
-	      if (SDL_SaveBMP(screen, buf))
-		{
-		  fprintf(stderr, "Error saving video frame to file %s\n", buf);
-		  exit(1);
-		}
+	      video_frame++;
+	      save_frame(screen, buf);
 	    }
 #endif
 	if (n_step % 1000 == 0)
@@ -243,6 +345,10 @@ int main(int argc, char *argv[])
 
 	    START
 	  }
+
+	if (simparams->checkpointFile && simparams->checkpointSteps > 0 &&
+	    (n_step + 1) % simparams->checkpointSteps == 0)
+	  save_checkpoint(time, n_step + 1, save_states);
       } // if RUNNING
 
 #ifndef SKILO_HEADLESS	
@@ -271,6 +377,16 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+  // SIGUSR1 saves a checkpoint, SIGTERM saves one and ends the run
+  if (checkpoint_signal)
+    {
+      if (simparams->checkpointFile)
+	save_checkpoint(time, n_step + 1, save_states);
+      if (checkpoint_signal == SIGTERM)
+	break;
+      checkpoint_signal = 0;
+    }
+
   // increment step here so that state is printed at t=0
   n_step++;
   } // while running
@@ -279,11 +395,20 @@ int main(int argc, char *argv[])
   
   save_bot_state_to_file(allbots, n_bots, "endstate.json");
 
-  if (simparams->stateFileName && simparams->stateFileSteps != 0)
-    {
-      json_dump_file(j_state, simparams->stateFileName, JSON_INDENT(2) | JSON_SORT_KEYS);
-	  json_decref(j_state);
-    }
+  if (save_states && simparams->stateFormat == STATE_FORMAT_BINARY)
+    trajectory_close();
+  else if (save_states)
+    state_writer_close();
+
+  // the time the simulation waited for the disk, after the last video
+  // frames are written
+  writer_stats ws;
+  writer_drain();
+  writer_get_stats(&ws);
+  writer_finish();
+  if (ws.submitted > 0)
+    printf("Writer: %ld states and frames, %.1f MB, at most %d queued. Waited %ld times for %.3f s, writing took %.3f s.\n",
+	   ws.submitted, ws.bytes / 1e6, ws.max_queued, ws.stalls, ws.stall_time, ws.busy_time);
 
 #ifndef SKILO_HEADLESS	
   if (simparams->finalImage)
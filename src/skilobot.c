@@ -1,9 +1,12 @@
 /* Core kilobot simulation code.
  */
 
+#define _DEFAULT_SOURCE // posix_memalign, madvise
 #include<stdio.h>
 #include<stdlib.h>
 #include<math.h>
+#include<string.h>
+#include<sys/mman.h>
 
 #include <jansson.h>
 
@@ -12,6 +15,12 @@
 #include "kilolib.h"
 
 #include "neighbors.h"
+#include "kinematics.h"
+#include "thread_pool.h"
+#include "rng.h"
+#include "tx_wheel.h"
+#include "obstacles.h"
+#include "light_raster.h"
 
 /* Global variables.
  */
@@ -22,7 +31,8 @@ extern int UserdataSize ;
 
 // Variables used to simulate many bots.
 kilobot** allbots;
-kilobot* current_bot;
+__thread kilobot* current_bot;
+bot_kinematics kinematics;
 
 // Settings of the simulation.
 int tx_period_ticks = 15;  // Message twice a second.
@@ -48,6 +58,8 @@ char* (*callback_botinfo) (void) = botinfo_simple;
 
 int16_t (*user_obstacles)(double, double, double *, double *) = NULL;
 int16_t (*user_light)(double, double) = NULL;
+void (*user_obstacles_batch)(int, const double *, const double *, double *, double *) = NULL;
+void (*user_light_batch)(int, const double *, const double *, int16_t *) = NULL;
 void (*callback_global_setup) (void) = NULL;
 
 /* Dummy functions for messaging. exactly as in kilolib.c */
@@ -55,8 +67,6 @@ void message_rx_dummy(message_t *m, distance_measurement_t *d) { }
 message_t *message_tx_dummy() { return NULL; }
 void message_tx_success_dummy() {}
 
-double rnd_gauss (double mean, double sig);
-
 void set_callback_params(void (*fp)(void))
 {
   callback_F5 = fp;
@@ -91,6 +101,18 @@ void set_callback_obstacles(int16_t (*fp)(double, double, double *, double *))
 void set_callback_lighting(int16_t (*fp)(double, double))
 {
   user_light = fp;
+  light_raster_invalidate();
+}
+
+void set_callback_obstacles_batch(void (*fp)(int, const double *, const double *, double *, double *))
+{
+  user_obstacles_batch = fp;
+}
+
+void set_callback_lighting_batch(void (*fp)(int, const double *, const double *, int16_t *))
+{
+  user_light_batch = fp;
+  light_raster_invalidate();
 }
   
 // OBSOLETE callback setting functions - will be removed
@@ -102,6 +124,7 @@ void register_user_obstacles(int16_t (*fp)(double, double, double *, double *)){
 void register_user_lighting(int16_t (*fp)(double, double))
 {
   user_light = fp;
+  light_raster_invalidate();
 }
 
 void register_callback(Callback_t type, void (*fp)(void))
@@ -133,24 +156,179 @@ void register_callback(Callback_t type, void (*fp)(void))
 
 /* Functions for initialising the bots to be used in the simulation. */
 
+/* Make room in the kinematics arrays for bots 0 ... n_bots-1.
+ */
+void kinematics_reserve(int n_bots)
+{
+  if (kinematics.allocated >= n_bots)
+    return;
+
+  int n = kinematics.allocated;
+  kinematics.allocated = n_bots;
+  kinematics.x           = realloc(kinematics.x,           n_bots * sizeof(double));
+  kinematics.y           = realloc(kinematics.y,           n_bots * sizeof(double));
+  kinematics.direction   = realloc(kinematics.direction,   n_bots * sizeof(double));
+  kinematics.speed       = realloc(kinematics.speed,       n_bots * sizeof(double));
+  kinematics.turn_rate_l = realloc(kinematics.turn_rate_l, n_bots * sizeof(double));
+  kinematics.turn_rate_r = realloc(kinematics.turn_rate_r, n_bots * sizeof(double));
+  if (!kinematics.x || !kinematics.y || !kinematics.direction || !kinematics.speed ||
+      !kinematics.turn_rate_l || !kinematics.turn_rate_r)
+    {
+      fprintf(stderr, "Could not allocate the state of %d bots.\n", n_bots);
+      exit(1);
+    }
+
+  for (int i = n; i < n_bots; i++)
+    {
+      kinematics.x[i] = kinematics.y[i] = kinematics.direction[i] = 0;
+      kinematics.speed[i] = kinematics.turn_rate_l[i] = kinematics.turn_rate_r[i] = 0;
+    }
+}
+
+/* All bots live in one arena: an array of kilobot structs, a slab with the
+ * user data of each bot in UserdataSize rounded up to whole cache lines, and
+ * a slab with the history rings. allbots[i] points to bot i in the
+ * arena, and the user data of all bots can be copied in one go, see
+ * bots_userdata(). The slabs are mapped from the OS, page aligned and
+ * zeroed only when first touched. With hugePages, the kernel is asked to
+ * back them with huge pages.
+ */
+#define CACHE_LINE 64
+#define HUGE_PAGE (2 << 20)
+
+typedef struct {
+  void *p;
+  size_t size;
+} slab;
+
+static struct {
+  slab bots;        // kilobot structs
+  slab data;        // user data of bot i at data + i * stride
+  size_t stride;
+  slab history;     // history ring of bot i at history + i * n_hist
+  int n_hist;       // history points per bot, 0 without storeHistory
+  int hist_every;   // store the position every hist_every steps
+  int allocated;
+} arena;
+
+/* Grow a slab to at least size bytes, keeping the first used bytes.
+ * Returns 0 if out of memory.
+ */
+static int slab_grow(slab *s, size_t used, size_t size)
+{
+  size_t page = simparams->hugePages ? HUGE_PAGE : 4096;
+  size = (size + page - 1) / page * page;
+  if (size <= s->size)
+    return 1;
+
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return 0;
+#ifdef MADV_HUGEPAGE
+  if (simparams->hugePages)
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+  if (s->p != NULL)
+    {
+      memcpy(p, s->p, used);
+      munmap(s->p, s->size);
+    }
+  s->p = p;
+  s->size = size;
+  return 1;
+}
+
+static hist_point *arena_history(int ID)
+{
+  return (hist_point *) arena.history.p + (size_t) ID * arena.n_hist;
+}
+
+/* Fit the histories of n_bots bots into historyMemoryMB, by storing the
+ * position only every hist_every steps. The histories still cover the last
+ * histLength steps, with fewer points.
+ */
+static void plan_history(int n_bots)
+{
+  int len = simparams->storeHistory ? simparams->histLength : 0;
+  arena.hist_every = 1;
+  arena.n_hist = len > 0 ? len : 0;
+  if (len <= 0 || simparams->historyMemoryMB <= 0)
+    return;
+
+  double fit = simparams->historyMemoryMB * 1048576 / ((double) n_bots * sizeof(hist_point));
+  if (fit >= len)
+    return;
+  if (fit < 1)
+    fit = 1;
+  arena.hist_every = (int) ceil(len / fit);
+  arena.n_hist = (len + arena.hist_every - 1) / arena.hist_every;
+}
+
+static char *arena_data(int ID)
+{
+  return (char *) arena.data.p + ID * arena.stride;
+}
+
+/* Make room in the arena for bots 0 ... n_bots-1. The bots already there
+ * may move, so allbots and the bots' pointers into the arena are updated.
+ */
+void bots_reserve(int n_bots)
+{
+  kinematics_reserve(n_bots);
+  if (arena.allocated >= n_bots)
+    return;
+
+  int n = arena.allocated;
+  if (n == 0)
+    {
+      arena.stride = (UserdataSize + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+      plan_history(n_bots);
+    }
+  size_t hist = (size_t) arena.n_hist * sizeof(hist_point);
+  allbots = realloc(allbots, n_bots * sizeof(kilobot *));
+  if (!slab_grow(&arena.bots, n * sizeof(kilobot), n_bots * sizeof(kilobot)) ||
+      !slab_grow(&arena.data, n * arena.stride, n_bots * arena.stride) ||
+      !slab_grow(&arena.history, n * hist, n_bots * hist) || !allbots)
+    {
+      fprintf(stderr, "Could not allocate the memory of %d bots.\n", n_bots);
+      exit(1);
+    }
+  arena.allocated = n_bots;
+
+  kilobot *bots = arena.bots.p;
+  for (int i = 0; i < n_bots; i++)
+    allbots[i] = &bots[i];
+  for (int i = 0; i < n; i++)
+    {
+      kilobot *bot = allbots[i];
+      bot->data = arena_data(i);
+      if (arena.n_hist > 0)
+	bot->history = arena_history(i);
+    }
+}
+
+void *bots_userdata(size_t *stride)
+{
+  *stride = arena.stride;
+  return arena.data.p;
+}
+
 kilobot *new_kilobot(int ID, int n_bots)
 {
-  /* Allocates the memory for a kilobot struct and populates it with default
+  /* Sets up the kilobot struct of bot ID in the arena with default
    * values.*/
 
-  kilobot* bot = (kilobot*) calloc(1, sizeof(kilobot));
-  // calloc sets the memory area to 0 - guarantees initialization of user data.
+  bots_reserve(ID+1 > n_bots ? ID+1 : n_bots);
+  kilobot* bot = allbots[ID];
+  memset(bot, 0, sizeof(kilobot));
 
   bot->ID = ID;
-  bot->x = 0;
-  bot->y = 0;
+  BOT_X(bot) = 0;
+  BOT_Y(bot) = 0;
 
-  bot->n_hist = simparams->histLength;
-  if (simparams->storeHistory)
-    {
-      bot->x_history = (double *) calloc(bot->n_hist, sizeof(double));
-      bot->y_history = (double *) calloc(bot->n_hist, sizeof(double));
-    }
+  bot->n_hist = arena.n_hist;
+  if (arena.n_hist > 0)
+    bot->history = arena_history(ID);
   bot->p_hist = 0;
   bot->l_hist = 0;
   
@@ -161,27 +339,24 @@ kilobot *new_kilobot(int ID, int n_bots)
   bot->right_motor_power = 0;
   bot->left_motor_power = 0;
 
-  bot->left_motor_offset = 60 + rnd_gauss(0, simparams->offsetVariation);
-  bot->right_motor_offset = 60 + rnd_gauss(0, simparams->offsetVariation);
-  bot->left_motor_slope = 1.0 + rnd_gauss(0, simparams->slopeVariation);
-  bot->right_motor_slope = 1.0 + rnd_gauss(0, simparams->slopeVariation);
+  bot->left_motor_offset = rng_gauss(RNG_MOTOR, ID, 0, 0, 60, simparams->offsetVariation);
+  bot->right_motor_offset = rng_gauss(RNG_MOTOR, ID, 1, 0, 60, simparams->offsetVariation);
+  bot->left_motor_slope = rng_gauss(RNG_MOTOR, ID, 2, 0, 1.0, simparams->slopeVariation);
+  bot->right_motor_slope = rng_gauss(RNG_MOTOR, ID, 3, 0, 1.0, simparams->slopeVariation);
   
-  bot->speed = simparams->speed + rnd_gauss(0, simparams->speedVariation);
-  bot->turn_rate_l = 0;
-  bot->turn_rate_r = 0;
+  BOT_SPEED(bot) = rng_gauss(RNG_MOTOR, ID, 4, 0, simparams->speed, simparams->speedVariation);
+  BOT_TURN_L(bot) = 0;
+  BOT_TURN_R(bot) = 0;
 
   
-  bot->direction = (2 * M_PI / 4);
+  BOT_DIR(bot) = (2 * M_PI / 4);
   bot->r_led = 0;
   bot->g_led = 0;
   bot->b_led = 0;
 
   bot->cr = simparams->commsRadius;
-            
-  bot->in_range = (int*) malloc(sizeof(int) * n_bots);
-  bot->n_in_range = 0;
 
-  bot->tx_ticks = rand() % tx_period_ticks;
+  bot->tx_ticks = rng_u32(RNG_TX_TICKS, ID, 0, 0) % tx_period_ticks;
 
   bot->user_setup = NULL;
   bot->user_loop  = NULL;
@@ -190,23 +365,32 @@ kilobot *new_kilobot(int ID, int n_bots)
   bot->kilo_message_tx_success = message_tx_success_dummy;
   bot->kilo_message_rx = message_rx_dummy;
 
-  bot->data = malloc(UserdataSize);
+  // zeroed, guarantees initialization of user data.
+  bot->data = arena_data(ID);
+  memset(bot->data, 0, arena.stride);
   
   return bot;
 }
 
+static void create_bots_task(void *arg, int t, int n_threads)
+{
+  int n_bots = *(int *) arg;
+  int lo, hi;
+  pool_range(n_bots, t, n_threads, &lo, &hi);
+  for (int i = lo; i < hi; i++)
+    new_kilobot(i, n_bots);
+}
+
 void create_bots(int n_bots)
 {
   /*
-   * Allocate the memory required to store n pointers to bots and
-   * creates n new kilobots.
+   * Make room for n bots in the arena, which also fills allbots,
+   * and create n new kilobots. The bots' random parameters only
+   * depend on their IDs, so they can be created on the threads.
    */
 
-  allbots = (kilobot**) malloc(sizeof(kilobot*) * n_bots);
-
-  for (int i=0; i<n_bots; i++) {
-    allbots[i] = new_kilobot(i, n_bots);
-  }
+  bots_reserve(n_bots);
+  pool_run(create_bots_task, &n_bots);
 }
 
 void init_all_bots(int n_bots)
@@ -277,7 +461,7 @@ void dump_bot_info(kilobot *self)
   /* Dump bot info to stdout. */
 
   printf("B %d: At (%f, %f), speed (%d, %d)\n", 
-    self->ID, self->x, self->y, self->right_motor_power, self->left_motor_power);
+    self->ID, BOT_X(self), BOT_Y(self), self->right_motor_power, self->left_motor_power);
 }
 
 void dump_all_bots(int n_bots)
@@ -290,43 +474,86 @@ void dump_all_bots(int n_bots)
 }
 
 
-/* Functions for managing the history of the bots. */
+/* Functions for managing the history of the bots.
+ *
+ * The history of a bot is a ring of n_hist points, stored as 16 bit
+ * offsets in 1/HIST_SCALE mm from an anchor, which is reset to the bot's
+ * position when it moves out of range, about 2 m from the anchor.
+ */
 
-void manage_bot_history_memory(kilobot *bot)
+static int hist_fits(double d)
 {
-  /* If our history is longer than the memory allocation, reallocate. */
+  return fabs(d) * HIST_SCALE < 32767;
+}
 
-  if (1 + bot->p_hist > bot->n_hist) {
-    bot->n_hist += 100;
-    bot->x_history = (double *) realloc(bot->x_history, sizeof(double) * bot->n_hist);
-    bot->y_history = (double *) realloc(bot->y_history, sizeof(double) * bot->n_hist);
-  }
+// the ring index of the point stored age points before the newest
+static int hist_index(kilobot *bot, int age)
+{
+  return (bot->p_hist - 1 - age + bot->n_hist) % bot->n_hist;
+}
+
+/* Move the anchor to the bot's position, on the 1/HIST_SCALE mm grid so
+ * that the stored points move exactly. Points too far from it are dropped.
+ */
+static void rebase_bot_history(kilobot *bot)
+{
+  double x0 = round(BOT_X(bot) * HIST_SCALE) / HIST_SCALE;
+  double y0 = round(BOT_Y(bot) * HIST_SCALE) / HIST_SCALE;
+  int kept;
+  for (kept = 0; kept < bot->l_hist; kept++)
+    {
+      hist_point *p = &bot->history[hist_index(bot, kept)];
+      double x = bot->hist_x + (double) p->x / HIST_SCALE - x0;
+      double y = bot->hist_y + (double) p->y / HIST_SCALE - y0;
+      if (!hist_fits(x) || !hist_fits(y))
+	break;
+      p->x = (int16_t) lrint(x * HIST_SCALE);
+      p->y = (int16_t) lrint(y * HIST_SCALE);
+    }
+  bot->l_hist = kept;
+  bot->hist_x = x0;
+  bot->hist_y = y0;
 }
 
 void update_bot_history(kilobot *bot)
 {
-  /* Update the bot's history of where it has been. */
+  /* Store the bot's position as the newest point of its history. */
+
+  if (bot->n_hist == 0)
+    return;
+  if (bot->l_hist == 0 || !hist_fits(BOT_X(bot) - bot->hist_x) || !hist_fits(BOT_Y(bot) - bot->hist_y))
+    rebase_bot_history(bot);
 
-  bot->x_history[bot->p_hist] = bot->x;
-  bot->y_history[bot->p_hist] = bot->y;
+  bot->p_hist %= bot->n_hist;
+  bot->history[bot->p_hist].x = (int16_t) lrint((BOT_X(bot) - bot->hist_x) * HIST_SCALE);
+  bot->history[bot->p_hist].y = (int16_t) lrint((BOT_Y(bot) - bot->hist_y) * HIST_SCALE);
   bot->p_hist++;
 
-  manage_bot_history_memory(bot);
+  // count valid history entries in the buffer 
+  if (bot->l_hist < bot->n_hist)
+    bot->l_hist++;
 }
 
 void update_bot_history_ring(kilobot *bot)
 {
-  /* Update the bot's history of where it has been, using a ring buffer,
-     of size simparams->histLength */
+  /* Update the bot's history of where it has been, every hist_every
+     steps, to stay within historyMemoryMB */
 
-  bot->p_hist %= simparams->histLength;
-  bot->x_history[bot->p_hist] = bot->x;
-  bot->y_history[bot->p_hist] = bot->y;
-  bot->p_hist++;
+  if (bot->hist_count++ % arena.hist_every == 0)
+    update_bot_history(bot);
+}
 
-  // count valid history entries in the buffer 
-  if (bot->l_hist < simparams->histLength)
-    bot->l_hist++;
+/* Get the point of the bot's history stored age points before the newest.
+ * Returns 0 if there is none.
+ */
+int bot_history_point(kilobot *bot, int age, double *x, double *y)
+{
+  if (age < 0 || age >= bot->l_hist)
+    return 0;
+  hist_point *p = &bot->history[hist_index(bot, age)];
+  *x = bot->hist_x + (double) p->x / HIST_SCALE;
+  *y = bot->hist_y + (double) p->y / HIST_SCALE;
+  return 1;
 }
 
 
@@ -336,76 +563,103 @@ void set_speeds(kilobot * bot, uint8_t left, uint8_t right)
   bot->right_motor_power  = right;
 
   double tr = (left - bot->left_motor_offset)/15 * bot->left_motor_slope;
-  bot->turn_rate_r = (tr < 0.5 || tr > 2.0 ? 0 : tr) * simparams->turn_rate * M_PI/180;
+  BOT_TURN_R(bot) = (tr < 0.5 || tr > 2.0 ? 0 : tr) * simparams->turn_rate * M_PI/180;
   tr = (right - bot->right_motor_offset)/15 * bot->right_motor_slope;
-  bot->turn_rate_l = (tr < 0.5 || tr > 2.0 ? 0 : tr) * simparams->turn_rate * M_PI/180;
-  //printf("turn rates: %g, %g\n", bot->turn_rate_l, bot->turn_rate_r);
+  BOT_TURN_L(bot) = (tr < 0.5 || tr > 2.0 ? 0 : tr) * simparams->turn_rate * M_PI/180;
+  //printf("turn rates: %g, %g\n", BOT_TURN_L(bot), BOT_TURN_R(bot));
   }
 
-/* Functions for moving the bots. */
+/* Functions for moving the bots.
+ *
+ * The kernels work on the kinematics arrays by bot index,
+ * the kilobot versions are kept for single bots.
+ */
 
-void move_bot_forward(kilobot *bot, float timestep)
+static inline void move_forward(int i, float timestep)
 {
   /* Move the bot forwards by a timestep dependent increment. */
 
   //int velocity = 0.5 * (bot->left_motor_power + bot->right_motor_power);
 
-  bot->y += timestep * bot->speed * cos(bot->direction);
-  bot->x += timestep * bot->speed * sin(bot->direction);
+  kinematics.y[i] += timestep * kinematics.speed[i] * cos(kinematics.direction[i]);
+  kinematics.x[i] += timestep * kinematics.speed[i] * sin(kinematics.direction[i]);
 }
 
-
-void turn_bot_right(kilobot *bot, float timestep)
+static inline void turn_right(int i, int r, double leg_angle, float timestep)
 {
   /* Turn the bot to the right by a timestep dependent increment. */
 
-  int r = bot->radius;
-  // double x_r = bot->x + r * cos(bot->direction);
-  // double y_r = bot->y - r * sin(bot->direction);
-  double x_r = bot->x + r * sin(bot->direction + bot->leg_angle);
-  double y_r = bot->y + r * cos(bot->direction + bot->leg_angle);
-  // bot->direction += timestep * (double) (bot->left_motor_power) / 30;
-  bot->direction += timestep * bot->turn_rate_r; 
+  // double x_r = x + r * cos(direction);
+  // double y_r = y - r * sin(direction);
+  double x_r = kinematics.x[i] + r * sin(kinematics.direction[i] + leg_angle);
+  double y_r = kinematics.y[i] + r * cos(kinematics.direction[i] + leg_angle);
+  // direction += timestep * (double) (bot->left_motor_power) / 30;
+  kinematics.direction[i] += timestep * kinematics.turn_rate_r[i]; 
   // note: turn_rate_r is in radians per sec
   // note: motor power is ignored
   
-  bot->x = x_r - r * sin(bot->direction + bot->leg_angle);
-  bot->y = y_r - r * cos(bot->direction + bot->leg_angle);
+  kinematics.x[i] = x_r - r * sin(kinematics.direction[i] + leg_angle);
+  kinematics.y[i] = y_r - r * cos(kinematics.direction[i] + leg_angle);
 }
 
-void turn_bot_left(kilobot *bot, float timestep)
+static inline void turn_left(int i, int r, double leg_angle, float timestep)
 {
   /* Turn the bot to the left by a timestep dependent increment. */
 
-  int r = bot->radius;
-  // double x_l = bot->x - r * cos(bot->direction);
-  // double y_l = bot->y + r * sin(bot->direction);
-  double x_l = bot->x + r * sin(bot->direction - bot->leg_angle);
-  double y_l = bot->y + r * cos(bot->direction - bot->leg_angle);
-  //  bot->direction -= timestep * (double) (bot->right_motor_power) / 30;
-  bot->direction -= timestep * bot->turn_rate_l; 
+  // double x_l = x - r * cos(direction);
+  // double y_l = y + r * sin(direction);
+  double x_l = kinematics.x[i] + r * sin(kinematics.direction[i] - leg_angle);
+  double y_l = kinematics.y[i] + r * cos(kinematics.direction[i] - leg_angle);
+  //  direction -= timestep * (double) (bot->right_motor_power) / 30;
+  kinematics.direction[i] -= timestep * kinematics.turn_rate_l[i]; 
   // note: turn_rate_r is in radians per sec
   // note: motor power is ignored
-  bot->x = x_l - r * sin(bot->direction - bot->leg_angle);
-  bot->y = y_l - r * cos(bot->direction - bot->leg_angle);
+  kinematics.x[i] = x_l - r * sin(kinematics.direction[i] - leg_angle);
+  kinematics.y[i] = y_l - r * cos(kinematics.direction[i] - leg_angle);
 }
 
-void update_bot_location(kilobot *bot, float timestep)
+static inline void update_location(int i, float timestep)
 {
   /* Update the bot's location by a timestep dependent increment. */
-  if (bot->turn_rate_l > 0 && bot->turn_rate_r > 0) { // forward movement
-    move_bot_forward(bot, timestep);
+  if (kinematics.turn_rate_l[i] > 0 && kinematics.turn_rate_r[i] > 0) { // forward movement
+    move_forward(i, timestep);
   }
   else {
-    if (bot->turn_rate_r > 0) {
-      turn_bot_right(bot, timestep);
+    // only turning needs the bot's geometry
+    if (kinematics.turn_rate_r[i] > 0) {
+      turn_right(i, allbots[i]->radius, allbots[i]->leg_angle, timestep);
     }
-	else if (bot->turn_rate_l > 0) {
-      turn_bot_left(bot, timestep);
+	else if (kinematics.turn_rate_l[i] > 0) {
+      turn_left(i, allbots[i]->radius, allbots[i]->leg_angle, timestep);
     }
   }
 }
 
+void move_bot_forward(kilobot *bot, float timestep)
+{
+  move_forward(bot->ID, timestep);
+}
+
+void turn_bot_right(kilobot *bot, float timestep)
+{
+  turn_right(bot->ID, bot->radius, bot->leg_angle, timestep);
+}
+
+void turn_bot_left(kilobot *bot, float timestep)
+{
+  turn_left(bot->ID, bot->radius, bot->leg_angle, timestep);
+}
+
+void update_bot_location(kilobot *bot, float timestep)
+{
+  if (BOT_TURN_L(bot) > 0 && BOT_TURN_R(bot) > 0)
+    move_bot_forward(bot, timestep);
+  else if (BOT_TURN_R(bot) > 0)
+    turn_bot_right(bot, timestep);
+  else if (BOT_TURN_L(bot) > 0)
+    turn_bot_left(bot, timestep);
+}
+
 
 /* Functions for updating both the history and the location of the bots. */
 
@@ -428,10 +682,10 @@ double bot_dist(kilobot *bot1, kilobot *bot2)
 {
   /* Return the bot2bot distance. */
 
-  double x1 = bot1->x;
-  double x2 = bot2->x;
-  double y1 = bot1->y;
-  double y2 = bot2->y;
+  double x1 = BOT_X(bot1);
+  double x2 = BOT_X(bot2);
+  double y1 = BOT_Y(bot1);
+  double y2 = BOT_Y(bot2);
 
   return sqrt((x2 - x1) * (x2 - x1) + (y2 - y1) * (y2 - y1));
 }
@@ -467,8 +721,8 @@ coord2D separation_unit_vector(kilobot* bot1, kilobot* bot2)
 
   coord2D separation_vector;
 
-  separation_vector.x = bot2->x - bot1->x;
-  separation_vector.y = bot2->y - bot1->y;
+  separation_vector.x = BOT_X(bot2) - BOT_X(bot1);
+  separation_vector.y = BOT_Y(bot2) - BOT_Y(bot1);
 
   return normalise(separation_vector);
 }
@@ -491,35 +745,10 @@ void separate_clashing_bots(kilobot* bot1, kilobot* bot2)
     p1 = simparams->pushDisplacement;
 
   coord2D suv = separation_unit_vector(bot1, bot2);
-  bot1->x -= p1 * suv.x;
-  bot1->y -= p1 * suv.y;
-  bot2->x += p2 * suv.x;
-  bot2->y += p2 * suv.y;
-}
-
-
-/* Functions for determining which bots can communicate with each other. */
-
-void reset_n_in_range_indices(int n_bots)
-{
-  /* Set all n_in_range variables to 0.
-   *
-   * I.e. after this function has been called the bots will have no bots within
-   * communication radius.
-   */
-
-  for (int i=0; i<n_bots; i++) {
-    allbots[i]->n_in_range = 0;
-  }
-}
-
-void update_n_in_range_indices(kilobot* bot1, kilobot* bot2)
-{
-  /* Set bot1 and bot2 to be within commuication radius of each other
-   * and increment the n_in_range counters. */
-
-  bot1->in_range[bot1->n_in_range++] = bot2->ID;
-  bot2->in_range[bot2->n_in_range++] = bot1->ID;
+  BOT_X(bot1) -= p1 * suv.x;
+  BOT_Y(bot1) -= p1 * suv.y;
+  BOT_X(bot2) += p2 * suv.x;
+  BOT_Y(bot2) += p2 * suv.y;
 }
 
 
@@ -540,26 +769,20 @@ void update_interactions(int n_bots)
   
   //printf("update_interactions!\n");
 
-  reset_n_in_range_indices(n_bots);
-
-  if (user_obstacles != NULL) {
-    double push_x, push_y;
+  neighbors_reset(n_bots);
 
-    for (int i=0; i<n_bots; i++) {
-      if (user_obstacles(allbots[i]->x, allbots[i]->y, &push_x, &push_y)){
-        allbots[i]->x += push_x;
-	allbots[i]->y += push_y;
-      }
-    }
-  }
+  apply_user_obstacles(n_bots);
+  resolve_obstacles(n_bots);
 
   for (int i=0; i<n_bots; i++) {
     for (int j=i+1; j<n_bots; j++) {
-      double bot2bot_sq_distance = bot_sq_dist(allbots[i], allbots[j]);
+      double bot2bot_sq_distance = bot_sq_dist(i, j);
 
       if (bot2bot_sq_distance < d_sq) {
         //printf("Whack %d %d\n", i, j); 
         separate_clashing_bots(allbots[i], allbots[j]);
+        neighbors_mark_moved(i);
+        neighbors_mark_moved(j);
         // We move the bots, this changes the distance.
         // So bot2bot_distance should be recalculated.
         // But we only need it below to tell if the bots are
@@ -570,10 +793,13 @@ void update_interactions(int n_bots)
       }
       if (bot2bot_sq_distance < communication_radius_sq) {
         //if (i == 0) printf("%d and %d in range\n", i, j);
-        update_n_in_range_indices(allbots[i], allbots[j]);
+        neighbors_add_pair(i, j, bot2bot_sq_distance);
       }
     }
   }
+
+  neighbors_build();
+  neighbors_refresh_dist();
 }
 
 void addCommLine(kilobot *from, kilobot *to)
@@ -602,40 +828,14 @@ void removeOldCommLines(int dt, int maxt)
   }
 }
 
-// random number between 0 and 1
-// NOTE: this can return 1!
-double rnd_uniform()
-{
-  return rand() / (double)RAND_MAX;
-}
-
-double rnd_gauss (double mean, double sig)
-	{
-	double x, y, r2;
-	
-	do
-		{
-		// choose x,y in uniform square (-1,-1) to (+1,+1)
-		x = -1.0 + 2.0 * rnd_uniform();
-		y = -1.0 + 2.0 * rnd_uniform();
-		
-		// see if it is in the unit circle
-		r2 = x * x + y * y;
-		}
-	while (r2 > 1.0 || r2 == 0.0);
-	
-	// Box-Muller transform
-	return mean + sig * y * sqrt (-2.0 * log (r2) / r2);
-	}
-
-/* Simulate a distance measurement
+/* Simulate a distance measurement from tx to rx
  * with optional gaussian noise and a linear correction.
  * 
  * observations, with bots on whiteboard, not yet simulated 
  * - more noise on long distances, maybe noise proportional to distance-d0
  * - measured distance vs distance starts as linear but flattens out at ~100 mm . 
  */
-double noisy_distance(double dist)
+double noisy_distance(double dist, kilobot *tx, kilobot *rx)
 {
   double alpha = simparams->distanceCoefficient;
   double d0 = 2 * allbots[0]->radius; 
@@ -646,22 +846,28 @@ double noisy_distance(double dist)
 
   // add noise
   if (simparams->distance_noise > 0.0)
-    dist += rnd_gauss(0, simparams->distance_noise);
+    dist += rng_gauss(RNG_DISTANCE, tx->ID, rx->ID, tx->tx_ticks, 0, simparams->distance_noise);
   
   return dist > 0 ? dist : 0;
 }
 
-int message_success()
+/* Whether a message from tx reaches rx.
+ * Random numbers are drawn per link and transmission, see rng.h.
+ */
+int message_success(kilobot *tx, kilobot *rx)
 {
   return simparams->msg_success_rate >= 1 ? 
-    1 : (double)rand() / RAND_MAX <= simparams->msg_success_rate;
+    1 : rng_uniform(RNG_MESSAGE, tx->ID, rx->ID, tx->tx_ticks) < simparams->msg_success_rate;
 }
 
+// the communication neighbors of the bots transmitting in this step
+static neighbor_store *comms = &neighbors;
+
 void pass_message(kilobot* tx)
 {
   /* Pass message from tx to all bots in range. */
   distance_measurement_t distm;
-  int i;
+  int k;
   prepare_bot(tx);
   //  kilo_uid = tx->ID;
   //  mydata = tx->data;
@@ -671,22 +877,23 @@ void pass_message(kilobot* tx)
   if (msg)
     {
       tx->tx_enabled = 1;
-      //printf ("n_in_range=%d\n",tx->n_in_range);
-      for (i = 0; i < tx->n_in_range; i++) {
-	kilobot *rx = allbots[tx->in_range[i]];
+      //printf ("n_neighbors=%d\n", n_neighbors(tx->ID));
+      for (k = comms->offset[tx->ID]; k < comms->offset[tx->ID+1]; k++) {
+	kilobot *rx = allbots[comms->index[k]];
 #ifndef SKILO_HEADLESS
 	if (simparams->GUI)
 	  addCommLine(tx, rx);
 #endif
 	
-	if (message_success()) // messages arrive with some probability
+	if (message_success(tx, rx)) // messages arrive with some probability
 	  {
 	    /* Set up a distance measurement structure.
-	     * We know the true distance, so we just store it in the structure.
+	     * We know the true distance from the neighbor search,
+	     * so we just store it in the structure.
 	     * estimate_distance() will just return high_gain.
 	     */
 	    distm.low_gain = 0;
-	    distm.high_gain = noisy_distance(bot_dist(tx, rx));
+	    distm.high_gain = noisy_distance(comms->dist[k], tx, rx);
 	    
 	    prepare_bot(rx);
 	    kilo_message_rx(msg, &distm);
@@ -705,16 +912,244 @@ void pass_message(kilobot* tx)
     }
 }
  
+/* Messages of one step, for delivery grouped by receiver.
+ * The deliveries to receiver i are inbox[inbox_offset[i] ... inbox_offset[i+1]-1].
+ */
+typedef struct {
+  int msg;            // index into outbox
+  int16_t distance;   // the measured distance, see noisy_distance()
+} delivery;
+
+static struct {
+  int *due, n_due;    // the transmitting bots
+  message_t *outbox;  // copies of their messages, by position in due
+  unsigned char *sent; // whether due[k] sent a message
+  int allocated_out;
+
+  int *inbox_offset;
+  delivery *inbox;
+  // by position in the neighbor store, whether the message gets through and the measured distance
+  unsigned char *arrives;
+  int16_t *distance;
+  int allocated_bots, allocated_entries, allocated_arrives;
+} mail;
+
+static void mail_reserve(int n_bots, int n_out, int n_entries, int n_store)
+{
+  if (mail.allocated_bots < n_bots)
+    {
+      mail.allocated_bots = n_bots;
+      mail.inbox_offset = realloc(mail.inbox_offset, (n_bots+1) * sizeof(int));
+    }
+  if (mail.allocated_out < n_out)
+    {
+      mail.allocated_out = 2*n_out;
+      mail.outbox = realloc(mail.outbox, mail.allocated_out * sizeof(message_t));
+      mail.sent = realloc(mail.sent, mail.allocated_out);
+    }
+  if (mail.allocated_entries < n_entries)
+    {
+      mail.allocated_entries = 2*n_entries;
+      mail.inbox = realloc(mail.inbox, mail.allocated_entries * sizeof(delivery));
+    }
+  if (mail.allocated_arrives < n_store)
+    {
+      mail.allocated_arrives = 2*n_store;
+      mail.arrives = realloc(mail.arrives, mail.allocated_arrives);
+      mail.distance = realloc(mail.distance, mail.allocated_arrives * sizeof(int16_t));
+    }
+  if (mail.inbox_offset == NULL || mail.outbox == NULL || mail.sent == NULL ||
+      mail.inbox == NULL || mail.arrives == NULL || mail.distance == NULL)
+    {
+      fprintf(stderr, "Could not allocate the messages of %d bots.\n", n_bots);
+      exit(1);
+    }
+}
+
+/* The phases of deliver_batched() as thread pool tasks. Every bot's
+ * callbacks are called by one thread only, and the random draws are keyed
+ * by the pair of bots, so the result does not depend on the number of threads.
+ */
+static void collect_task(void *arg, int t, int n_threads)
+{
+  int lo, hi;
+  pool_range(mail.n_due, t, n_threads, &lo, &hi);
+  for (int k = lo; k < hi; k++) {
+    kilobot *tx = allbots[mail.due[k]];
+    prepare_bot(tx);
+    message_t *msg = kilo_message_tx();
+    finalize_bot(tx);
+
+    tx->tx_enabled = mail.sent[k] = msg != NULL;
+    if (msg)
+      mail.outbox[k] = *msg;
+  }
+}
+
+static void measure_task(void *arg, int t, int n_threads)
+{
+  int lo, hi;
+  pool_range(mail.n_due, t, n_threads, &lo, &hi);
+  for (int k = lo; k < hi; k++) {
+    if (!mail.sent[k])
+      continue;
+    kilobot *tx = allbots[mail.due[k]];
+    for (int j = comms->offset[tx->ID]; j < comms->offset[tx->ID+1]; j++) {
+      kilobot *rx = allbots[comms->index[j]];
+      mail.arrives[j] = message_success(tx, rx);
+      if (mail.arrives[j])
+	mail.distance[j] = noisy_distance(comms->dist[j], tx, rx);
+    }
+  }
+}
+
+// receivers are split into ranges with about the same number of deliveries
+static int inbox_split(int n_bots, int t, int n_threads)
+{
+  if (t == n_threads)
+    return n_bots;
+
+  long target = (long) mail.inbox_offset[n_bots] * t / n_threads;
+  int lo = 0, hi = n_bots;
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (mail.inbox_offset[mid] < target)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo;
+}
+
+static void receive_task(void *arg, int t, int n_threads)
+{
+  int n_bots = *(int *) arg;
+  int lo = inbox_split(n_bots, t, n_threads);
+  int hi = inbox_split(n_bots, t+1, n_threads);
+  int *offset = mail.inbox_offset;
+
+  distance_measurement_t distm;
+  distm.low_gain = 0;
+  for (int i = lo; i < hi; i++) {
+    if (offset[i] == offset[i+1])
+      continue;
+    prepare_bot(allbots[i]);
+    for (int e = offset[i]; e < offset[i+1]; e++) {
+      distm.high_gain = mail.inbox[e].distance;
+      kilo_message_rx(&mail.outbox[mail.inbox[e].msg], &distm);
+    }
+    finalize_bot(allbots[i]);
+  }
+}
+
+static void tx_success_task(void *arg, int t, int n_threads)
+{
+  int lo, hi;
+  pool_range(mail.n_due, t, n_threads, &lo, &hi);
+  for (int k = lo; k < hi; k++)
+    if (mail.sent[k]) {
+      kilobot *tx = allbots[mail.due[k]];
+      prepare_bot(tx);
+      kilo_message_tx_success();
+      finalize_bot(tx);
+    }
+}
+
+/* Deliver the messages of the bots in due in two phases.
+ *
+ * First every transmitter produces its message, then each receiver gets all
+ * its messages in a row, receivers in order of ID and the messages to one
+ * receiver in order of the sender's ID. Last, kilo_message_tx_success() is
+ * called for the transmitters. Unlike pass_message(), a message sent in a
+ * step never depends on the messages received in the same step.
+ *
+ * With parallelUserLoop the callbacks run on the thread pool, with the
+ * receivers partitioned between the threads.
+ */
+static void deliver_batched(int n_bots, int *due, int n_due)
+{
+  int n_entries = 0;
+  for (int k=0; k<n_due; k++)
+    n_entries += comms->offset[due[k]+1] - comms->offset[due[k]];
+  mail_reserve(n_bots, n_due, n_entries, comms->offset[n_bots]);
+  mail.due = due;
+  mail.n_due = n_due;
+
+  int parallel = simparams->parallelUserLoop && pool_threads() > 1;
+
+  // phase 1: collect the messages, and decide which deliveries succeed
+  if (parallel)
+    pool_run(collect_task, NULL);
+  else
+    collect_task(NULL, 0, 1);
+  pool_run(measure_task, NULL);
+
+  // count the deliveries to each receiver
+  int *offset = mail.inbox_offset;
+  memset(offset, 0, (n_bots+1) * sizeof(int));
+  for (int k = 0; k < n_due; k++) {
+    if (!mail.sent[k])
+      continue;
+    int tx = due[k];
+    for (int j = comms->offset[tx]; j < comms->offset[tx+1]; j++) {
+#ifndef SKILO_HEADLESS
+      if (simparams->GUI)
+	addCommLine(allbots[tx], allbots[comms->index[j]]);
+#endif
+      offset[comms->index[j]+1] += mail.arrives[j];
+    }
+  }
+
+  // sort the deliveries into the inboxes, keeping the sender order
+  for (int i = 0; i < n_bots; i++)
+    offset[i+1] += offset[i];
+  for (int k = 0; k < n_due; k++) {
+    if (!mail.sent[k])
+      continue;
+    int tx = due[k];
+    for (int j = comms->offset[tx]; j < comms->offset[tx+1]; j++)
+      if (mail.arrives[j]) {
+	delivery *d = &mail.inbox[offset[comms->index[j]]++];
+	d->msg = k;
+	d->distance = mail.distance[j];
+      }
+  }
+  // offset[i] is now the start of inbox i+1
+  memmove(offset+1, offset, n_bots * sizeof(int));
+  offset[0] = 0;
+
+  // phase 2: each receiver reads its inbox
+  if (parallel)
+    pool_run(receive_task, &n_bots);
+  else
+    receive_task(&n_bots, 0, 1);
+
+  // phase 3: the transmitters learn that their message was sent
+  if (parallel)
+    pool_run(tx_success_task, NULL);
+  else
+    tx_success_task(NULL, 0, 1);
+}
+
 void process_messaging(int n_bots)
 {
   /* Update messaging between bots. */
 
-  for (int i=0; i<n_bots; i++) {
-    if (kilo_ticks >= allbots[i]->tx_ticks) {
-      allbots[i]->tx_ticks += tx_period_ticks;
-      pass_message(allbots[i]);
-    }
+  // only the bots due for transmission, from the timing wheel
+  int *due;
+  int n_due = tx_wheel_due(n_bots, kilo_ticks, &due);
+  comms = comm_neighbors(n_bots, due, n_due);
+  for (int k=0; k<n_due; k++) {
+    kilobot *bot = allbots[due[k]];
+    bot->tx_ticks += bot->tx_period > 0 ? bot->tx_period : tx_period_ticks;
+    if (!simparams->batchedDelivery)
+      pass_message(bot);
   }
+  if (simparams->batchedDelivery)
+    deliver_batched(n_bots, due, n_due);
+  for (int k=0; k<n_due; k++)
+    tx_wheel_schedule(due[k], kilo_ticks);
 
 #ifndef SKILO_HEADLESS
   // Run removeOldCommLines at most once every kilo_ticks.
@@ -729,9 +1164,30 @@ void process_messaging(int n_bots)
 
 /* Functions called by the runsim/headless process_bots function. */
 
+static void run_bots_task(void *arg, int t, int n_threads)
+{
+  int lo, hi;
+  pool_range(*(int *) arg, t, n_threads, &lo, &hi);
+  for (int i=lo; i<hi; i++) {
+    prepare_bot(allbots[i]);
+    current_bot->user_loop();
+    finalize_bot(allbots[i]);
+  }
+}
+
 void run_all_bots(int n_bots)
 {
-  /* Run the user program for each bot. */
+  /* Run the user program for each bot.
+   *
+   * With parallelUserLoop, the bots are split between the threads of the pool.
+   * Each thread has its own current_bot, mydata, kilo_uid and kilo_message_*,
+   * but the user program must not share any other state between bots.
+   */
+  if (simparams->parallelUserLoop && pool_threads() > 1) {
+    pool_run(run_bots_task, &n_bots);
+    return;
+  }
+
   int i;
   for (i=0; i<n_bots; i++) {
     prepare_bot(allbots[i]);
@@ -745,15 +1201,24 @@ void update_all_bots(int n_bots, float timestep)
 {
   /* Progress the simulation by a timestep. */
 
-  for (int i=0; i<n_bots; i++) {
-    update_bot(allbots[i], timestep);
-  }
+  // save the history before updating the locations
+  if (simparams->storeHistory)
+    for (int i=0; i<n_bots; i++)
+      update_bot_history_ring(allbots[i]);
+
+  // all bots have the same geometry, see new_kilobot()
+  int i = 0;
+  if (simparams->simdKinematics)
+    i = update_locations_simd(n_bots, timestep, allbots[0]->radius, allbots[0]->leg_angle);
+  for (; i<n_bots; i++)
+    update_location(i, timestep);
 
   if (simparams->useGrid)
     update_interactions_grid(n_bots);
   else
     update_interactions(n_bots);
 
+  light_bots_update(n_bots);
   process_messaging(n_bots);
 }
 
@@ -772,8 +1237,8 @@ void spread_out(int n_bots, double k)
   for (j = 0; j < n_bots; j++)
     for (i = 0; i < j; i++)
       {
-	double dx = allbots[i]->x - allbots[j]->x;
-	double dy = allbots[i]->y - allbots[j]->y;
+	double dx = kinematics.x[i] - kinematics.x[j];
+	double dy = kinematics.y[i] - kinematics.y[j];
 	double r = hypot(dx, dy);
 
 	// arbitrary cap to avoid large forces
@@ -784,15 +1249,17 @@ void spread_out(int n_bots, double k)
 	double fx = 1/(r*r) * dx/r ;
 	double fy = 1/(r*r) * dy/r;
 
-	allbots[i]->x += fx * k;
-	allbots[i]->y += fy * k;
-	allbots[j]->x -= fx * k;
-	allbots[j]->y -= fy * k;	
+	kinematics.x[i] += fx * k;
+	kinematics.y[i] += fy * k;
+	kinematics.x[j] -= fx * k;
+	kinematics.y[j] -= fy * k;	
       }
 }
 
 void process_bots(int n_bots, float timestep)
 {
+    light_raster_update();
+    light_bots_prepare(n_bots);
     run_all_bots(n_bots);
     update_all_bots(n_bots, timestep);
 }
@@ -15,9 +15,45 @@
 
 #define MAXCOMMLINES 10000
 
+/* Per-step physics state of all bots, as a struct of arrays indexed by
+ * bot ID. The motion update and the neighbor search stream through these
+ * arrays instead of the much larger kilobot structs.
+ */
 typedef struct {
-  double x, y;
-  double *x_history, *y_history;
+  double *x, *y;
+  double *direction;                // Angle relative to constant x, +ve y in radians
+  double *speed;                    // speed in mm / s
+  double *turn_rate_l, *turn_rate_r;  // turning rate right and left, radians / s
+  int allocated;
+} bot_kinematics;
+
+extern bot_kinematics kinematics;
+
+void kinematics_reserve(int n_bots);
+
+// the physics state of a single bot, usable as an lvalue
+#define BOT_X(bot)         (kinematics.x[(bot)->ID])
+#define BOT_Y(bot)         (kinematics.y[(bot)->ID])
+#define BOT_DIR(bot)       (kinematics.direction[(bot)->ID])
+#define BOT_SPEED(bot)     (kinematics.speed[(bot)->ID])
+#define BOT_TURN_L(bot)    (kinematics.turn_rate_l[(bot)->ID])
+#define BOT_TURN_R(bot)    (kinematics.turn_rate_r[(bot)->ID])
+
+/* A point of a bot's history, in 1/HIST_SCALE mm from the bot's history
+ * anchor. Read with bot_history_point().
+ */
+#define HIST_SCALE 16
+typedef struct {
+  int16_t x, y;
+} hist_point;
+
+/* The rest of a bot's state. Position, direction, speed and turning rates
+ * are in kinematics, at index ID.
+ */
+typedef struct {
+  hist_point *history;   // ring buffer of the positions, in the arena
+  double hist_x, hist_y; // anchor of the history points
+  int hist_count; // steps since the start, every hist_every-th is stored, see historyMemoryMB
   int p_hist; // current index in history (ring) buffer
   int n_hist; // size of the history ring buffer 
   int l_hist; // number of history points stored
@@ -30,29 +66,23 @@ typedef struct {
   double left_motor_offset, right_motor_offset;
   double left_motor_slope, right_motor_slope;
 
-  // actual physical speed
-  double speed;                     // speed in mm / s
-  double turn_rate_l, turn_rate_r;  // turning rate right and left, radians / s
-  
   int ID;
-  double direction; // Angle relative to constant x, +ve y in radians
   int r_led, g_led, b_led;
   int radius;       // kilobot radius in mm
   double leg_angle; // angle front leg - center - rear leg in radians
 
-  int *in_range;
-  int n_in_range;
-
   /* Messaging */
   double cr; // Communication radius
   int tx_enabled;  //1 if the bot is transmitting - used for drawing communication circles
   int tx_ticks;    //the time in ticks when this bot is to transmit next
+  int tx_period;   //ticks between transmissions, 0 to use tx_period_ticks
   
   int screen_x, screen_y; //where the bot is drawn on screen
 
   /* Random number generator */ 
   uint8_t seed;  //for the software random number generator
   uint8_t accumulator;
+  uint32_t rand_count; // number of rand_hard() draws so far
 
   /* Setup and loop functions */
   void (*user_setup)(void);
@@ -90,6 +120,10 @@ extern int n_bots;
 extern kilobot** allbots;
 void create_bots(int n_bots);
 kilobot *new_kilobot(int ID, int n_bots);
+void bots_reserve(int n_bots);
+// the user data of bot i is at the returned pointer + i * stride
+void *bots_userdata(size_t *stride);
+int bot_history_point(kilobot *bot, int age, double *x, double *y);
 void init_all_bots(int n_bots);
 void user_setup_all_bots(int n_bots);
 void run_all_bots(int n_bots);
@@ -102,11 +136,14 @@ coord2D separation_unit_vector(kilobot* bot1, kilobot* bot2);
 void separate_clashing_bots(kilobot* bot1, kilobot* bot2);
 void spread_out(int n_bots, double k);
 
-extern kilobot* current_bot;
+/* The bot being run, and the kilolib variables that refer to it, are
+ * thread local, so that user loops can run on several threads.
+ */
+extern __thread kilobot* current_bot;
 
 // we need to supress this declaration in user code
 #ifndef KILOMBO_H
-extern void* mydata;
+extern __thread void* mydata;
 #endif
 
 kilobot *Me();
@@ -125,5 +162,7 @@ extern int stepsPerFrame;
 
 extern int16_t (*user_obstacles)(double, double, double *, double *);
 extern int16_t (*user_light)(double, double);
+extern void (*user_obstacles_batch)(int, const double *, const double *, double *, double *);
+extern void (*user_light_batch)(int, const double *, const double *, int16_t *);
 
 #endif
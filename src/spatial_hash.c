@@ -0,0 +1,208 @@
+/* Sparse hashed grid for finding neighbors, for swarms spread over a large area.
+ *
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<math.h>
+
+#define NDEBUG // define to turn assertions off
+#include<assert.h>
+#include"skilobot.h"
+#include"neighbors.h"
+#include"spatial_hash.h"
+
+static void spatial_hash_reserve(spatial_hash *sh, int n_bots)
+{
+  // keep the table at most half full
+  size_t n_slots = 16;
+  while (n_slots < 2 * (size_t) n_bots)
+    n_slots *= 2;
+  sh->n_slots = n_slots;
+
+  if (sh->allocated_slots < n_slots)
+    {
+      sh->allocated_slots = n_slots;
+      sh->slot_cell = realloc(sh->slot_cell, n_slots * sizeof(int));
+      assert(sh->slot_cell != NULL);
+    }
+
+  // there are never more occupied cells than bots
+  if (sh->allocated_bots < n_bots)
+    {
+      sh->allocated_bots = n_bots;
+      sh->cell_x     = realloc(sh->cell_x,     n_bots * sizeof(int));
+      sh->cell_y     = realloc(sh->cell_y,     n_bots * sizeof(int));
+      sh->cell_start = realloc(sh->cell_start, (n_bots+1) * sizeof(int));
+      sh->bots       = realloc(sh->bots,       n_bots * sizeof(int));
+      sh->bot_cell   = realloc(sh->bot_cell,   n_bots * sizeof(int));
+      sh->x          = realloc(sh->x,          n_bots * sizeof(double));
+      sh->y          = realloc(sh->y,          n_bots * sizeof(double));
+      assert(sh->cell_x != NULL && sh->cell_y != NULL && sh->cell_start != NULL);
+      assert(sh->bots != NULL && sh->bot_cell != NULL && sh->x != NULL && sh->y != NULL);
+    }
+}
+
+static inline size_t cell_hash(spatial_hash *sh, int cx, int cy)
+{
+  uint32_t h = (uint32_t) cx * 73856093u ^ (uint32_t) cy * 19349663u;
+  return h & (sh->n_slots - 1);
+}
+
+/* The slot of cell (cx, cy), or the empty slot where it belongs. */
+static inline size_t find_slot(spatial_hash *sh, int cx, int cy)
+{
+  size_t s = cell_hash(sh, cx, cy);
+  while (sh->slot_cell[s] >= 0)
+    {
+      int c = sh->slot_cell[s];
+      if (sh->cell_x[c] == cx && sh->cell_y[c] == cy)
+	break;
+      s = (s + 1) & (sh->n_slots - 1);
+    }
+  return s;
+}
+
+/* The occupied cell with coordinates (cx, cy), or -1. */
+static inline int find_cell(spatial_hash *sh, int cx, int cy)
+{
+  return sh->slot_cell[find_slot(sh, cx, cy)];
+}
+
+/* Bin all bots into cells of side range+eps, anchored at the origin.
+ */
+void spatial_hash_build(spatial_hash *sh, int n_bots, double range)
+{
+  double eps = .1; // small margin, so that a pair at exactly range is never two cells apart
+
+  sh->cell_sz = range + eps;
+  spatial_hash_reserve(sh, n_bots);
+  memset(sh->slot_cell, 0xff, sh->n_slots * sizeof(int));
+  sh->n_cells = 0;
+
+  // find the cell of each bot, count the bots in each cell in cell_start[c+1]
+  int *start = sh->cell_start;
+  start[0] = 0;
+  for (int i = 0; i < n_bots; i++)
+    {
+      int cx = floor(kinematics.x[i] / sh->cell_sz);
+      int cy = floor(kinematics.y[i] / sh->cell_sz);
+
+      size_t s = find_slot(sh, cx, cy);
+      int c = sh->slot_cell[s];
+      if (c < 0)
+	{
+	  c = sh->n_cells++;
+	  sh->slot_cell[s] = c;
+	  sh->cell_x[c] = cx;
+	  sh->cell_y[c] = cy;
+	  start[c+1] = 0;
+	}
+      sh->bot_cell[i] = c;
+      start[c+1]++;
+    }
+
+  size_t n_cells = sh->n_cells;
+  for (size_t c = 0; c < n_cells; c++)
+    start[c+1] += start[c];
+
+  // scatter, using start[c] as the fill cursor of cell c.
+  // Afterwards start[c] is the start of cell c+1, shift it back.
+  for (int i = 0; i < n_bots; i++)
+    {
+      int k = start[sh->bot_cell[i]]++;
+      sh->bots[k] = i;
+      sh->x[k] = kinematics.x[i];
+      sh->y[k] = kinematics.y[i];
+    }
+  memmove(start+1, start, n_cells * sizeof(int));
+  start[0] = 0;
+}
+
+/* Add the pairs in range between cell c1 and the cell at (cx, cy), if occupied. */
+static void cell_pairs(spatial_hash *sh, int c1, int cx, int cy, double sq_range, pair_buffer *out)
+{
+  int c2 = find_cell(sh, cx, cy);
+  if (c2 < 0)
+    return;
+
+  for (int k = sh->cell_start[c1]; k < sh->cell_start[c1+1]; k++)
+    for (int l = sh->cell_start[c2]; l < sh->cell_start[c2+1]; l++)
+      {
+	double dx = sh->x[l] - sh->x[k];
+	double dy = sh->y[l] - sh->y[k];
+	double sq_d = dx*dx + dy*dy;
+	if (sq_d < sq_range)
+	  pair_buffer_add(out, sh->bots[k], sh->bots[l], sq_d);
+      }
+}
+
+/* Find all pairs closer than range with a bot in the occupied cells
+ * c_lo ... c_hi-1, and add them to out.
+ *
+ * Same half-shell stencil as the cell list, but only the occupied cells
+ * are visited, and their neighbor cells are looked up in the hash table.
+ */
+void spatial_hash_find_pairs(spatial_hash *sh, double range, size_t c_lo, size_t c_hi, pair_buffer *out)
+{
+  double sq_range = range * range;
+
+  for (size_t c = c_lo; c < c_hi; c++)
+    {
+      int cx = sh->cell_x[c];
+      int cy = sh->cell_y[c];
+
+      // pairs within the cell
+      for (int k = sh->cell_start[c]; k < sh->cell_start[c+1]; k++)
+	for (int l = k+1; l < sh->cell_start[c+1]; l++)
+	  {
+	    double dx = sh->x[l] - sh->x[k];
+	    double dy = sh->y[l] - sh->y[k];
+	    double sq_d = dx*dx + dy*dy;
+	    if (sq_d < sq_range)
+	      pair_buffer_add(out, sh->bots[k], sh->bots[l], sq_d);
+	  }
+
+      cell_pairs(sh, c, cx+1, cy,   sq_range, out);
+      cell_pairs(sh, c, cx-1, cy+1, sq_range, out);
+      cell_pairs(sh, c, cx,   cy+1, sq_range, out);
+      cell_pairs(sh, c, cx+1, cy+1, sq_range, out);
+    }
+}
+
+static int compare_pair_b(const void *p, const void *q)
+{
+  return ((const bot_pair *) p)->b - ((const bot_pair *) q)->b;
+}
+
+/* Add the pairs (i, j) for all bots j closer than range to bot i,
+ * in order of increasing j. range must not exceed the one the hash was built for.
+ */
+void spatial_hash_find_near(spatial_hash *sh, int i, double range, pair_buffer *out)
+{
+  double sq_range = range * range;
+  int cx = floor(kinematics.x[i] / sh->cell_sz);
+  int cy = floor(kinematics.y[i] / sh->cell_sz);
+  size_t first = out->n_pairs;
+
+  for (int y = cy-1; y <= cy+1; y++)
+    for (int x = cx-1; x <= cx+1; x++)
+      {
+	int c = find_cell(sh, x, y);
+	if (c < 0)
+	  continue;
+	for (int l = sh->cell_start[c]; l < sh->cell_start[c+1]; l++)
+	  {
+	    int j = sh->bots[l];
+	    if (j == i)
+	      continue;
+	    double sq_d = bot_sq_dist(i, j);
+	    if (sq_d < sq_range)
+	      pair_buffer_add(out, i, j, sq_d);
+	  }
+      }
+
+  qsort(out->pairs + first, out->n_pairs - first, sizeof(bot_pair), compare_pair_b);
+}
@@ -0,0 +1,36 @@
+#ifndef SPATIAL_HASH_H
+#define SPATIAL_HASH_H
+
+/* A sparse grid for finding bots within a given range of each other.
+ *
+ * Like the cell list, the bots are binned into square cells with a counting
+ * sort, but only the occupied cells are stored, in an open addressing hash
+ * table keyed by the cell coordinates. Memory and build time depend on the
+ * number of bots only, not on how far apart they are.
+ *
+ * Occupied cell c has coordinates (cell_x[c], cell_y[c]) and holds the bots
+ * bots[cell_start[c]] ... bots[cell_start[c+1]-1], in order of increasing
+ * index, with their positions in x[], y[].
+ */
+typedef struct {
+  double cell_sz;    // side of a cell, at least the search range
+
+  size_t n_slots;    // size of the hash table, a power of two
+  int *slot_cell;    // occupied cell in each slot, -1 if empty
+
+  size_t n_cells;    // number of occupied cells
+  int *cell_x, *cell_y;
+  int *cell_start;   // n_cells+1 entries
+
+  int *bots;         // bot indices, sorted by cell
+  double *x, *y;     // positions, in the same order as bots
+  int *bot_cell;     // the cell of each bot
+
+  size_t allocated_slots, allocated_bots;
+} spatial_hash;
+
+void spatial_hash_build(spatial_hash *sh, int n_bots, double range);
+void spatial_hash_find_pairs(spatial_hash *sh, double range, size_t c_lo, size_t c_hi, pair_buffer *out);
+void spatial_hash_find_near(spatial_hash *sh, int i, double range, pair_buffer *out);
+
+#endif
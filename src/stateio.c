@@ -1,6 +1,11 @@
+#define _POSIX_C_SOURCE 200809L // for fseeko, ftello and ftruncate
+
 #include <ctype.h>
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <math.h>
@@ -9,9 +14,10 @@
 #include "skilobot.h"
 #include "params.h"
 #include "kilolib.h"
+#include "async_writer.h"
 #include <jansson.h>
 
-json_t* (*callback_json_state) (void);
+extern json_t* (*callback_json_state) (void);
 
 void json_store_double(json_t* root, const char *key, double value)
 {
@@ -27,26 +33,25 @@ json_object_set_new(root, key, jvalue);
 
 json_t* json_bot_rep(kilobot *bot)
 {
-  //printf("%d: %f, %f, %f\n", bot->ID, bot->x, bot->y, bot->direction);
+  //printf("%d: %f, %f, %f\n", bot->ID, BOT_X(bot), BOT_Y(bot), BOT_DIR(bot));
 
   json_t* root = json_object();
 
   json_store_int(root, "ID", bot->ID);
-  json_store_double(root, "direction", bot->direction);
-  json_store_double(root, "x_position", bot->x);
-  json_store_double(root, "y_position", bot->y);
+  json_store_double(root, "direction", BOT_DIR(bot));
+  json_store_double(root, "x_position", BOT_X(bot));
+  json_store_double(root, "y_position", BOT_Y(bot));
 
   /*
   // store history in bot state
   // not in use currently, since full bot states can be stored periodically.
   json_t* j_x_hist = json_array();
   json_t* j_y_hist = json_array();
-  json_t *j_xhval, *j_yhval;
-  for (int i=0; i<bot->p_hist; i++) {
-    j_xhval = json_real(bot->x_history[i]);
-    json_array_append(j_x_hist, j_xhval);
-    j_yhval = json_real(bot->y_history[i]);
-    json_array_append(j_y_hist, j_yhval);
+  double x, y;
+  for (int age=bot->l_hist-1; age>=0; age--) {
+    bot_history_point(bot, age, &x, &y);
+    json_array_append_new(j_x_hist, json_real(x));
+    json_array_append_new(j_y_hist, json_real(y));
   }
 
   json_object_set(root, "x_history", j_x_hist);
@@ -103,6 +108,228 @@ void save_bot_state_to_file(kilobot **bot_array, int array_size, const char *fil
 
 
 
+/* Streaming state writer.
+ *
+ * Each snapshot is formatted as one compact line, with the same keys as
+ * json_rep_all_bots(), and written out right away, so the memory does not
+ * grow with the length of the run. In JSON mode the lines are the
+ * elements of an array, the file becoming valid JSON when the writer is
+ * closed. In NDJSON mode each line is a document.
+ *
+ * The simulation thread only copies the numbers into a staging buffer,
+ * and dumps the json_state of each bot, which needs the bot's context.
+ * The formatting and the writing are done by the writer thread, see
+ * async_writer.h. The sw buffer is only used there.
+ */
+static struct {
+  FILE *f;
+  int ndjson;
+  int n_written;
+  char *buf;          // the snapshot being formatted
+  size_t len, size;
+} sw;
+
+// a staged snapshot is a sw_header followed by n sw_bots
+typedef struct {
+  int ticks;
+  int n;
+  int empty_states;   // no json_state callback, every bot gets "state":{}
+} sw_header;
+
+typedef struct {
+  double x, y, direction;
+  char *state;        // from json_dumps(), freed by the writer, or NULL
+  int ID;
+} sw_bot;
+
+static void sw_reserve(size_t more)
+{
+  if (sw.len + more <= sw.size)
+    return;
+  while (sw.len + more > sw.size)
+    sw.size = sw.size ? 2 * sw.size : 65536;
+  sw.buf = realloc(sw.buf, sw.size);
+  if (sw.buf == NULL)
+    {
+      fprintf(stderr, "Could not allocate the state buffer of %zu bytes.\n", sw.size);
+      exit(1);
+    }
+}
+
+static void sw_puts(const char *str)
+{
+  size_t l = strlen(str);
+  sw_reserve(l);
+  memcpy(sw.buf + sw.len, str, l);
+  sw.len += l;
+}
+
+static void sw_printf(const char *fmt, ...)
+{
+  va_list ap;
+  sw_reserve(64);
+  va_start(ap, fmt);
+  int l = vsnprintf(sw.buf + sw.len, sw.size - sw.len, fmt, ap);
+  va_end(ap);
+  if (l >= 0 && (size_t) l >= sw.size - sw.len)
+    {
+      sw_reserve(l + 1);
+      va_start(ap, fmt);
+      vsnprintf(sw.buf + sw.len, sw.size - sw.len, fmt, ap);
+      va_end(ap);
+    }
+  if (l > 0)
+    sw.len += l;
+}
+
+// a real as jansson writes it, always with a '.' or an exponent, and
+// null for nan and inf, which JSON can't represent
+static void sw_real(double v)
+{
+  if (!isfinite(v))
+    {
+      sw_puts("null");
+      return;
+    }
+  size_t start = sw.len;
+  sw_printf("%.17g", v);
+  if (strcspn(sw.buf + start, ".eE") == sw.len - start)
+    sw_puts(".0");
+}
+
+// format and write a staged snapshot, on the writer thread
+static void sw_write_task(char *data, size_t len)
+{
+  const sw_header *h = (const sw_header *) data;
+  sw_bot *bots = (sw_bot *) (data + sizeof(sw_header));
+
+  sw.len = 0;
+  if (!sw.ndjson && sw.n_written > 0)
+    sw_puts(",\n");
+  sw_puts("{\"bot_states\":[");
+  for (int i = 0; i < h->n; i++)
+    {
+      sw_bot *b = &bots[i];
+      sw_printf("%s{\"ID\":%d,\"direction\":", i ? "," : "", b->ID);
+      sw_real(b->direction);
+      if (h->empty_states)
+	sw_puts(",\"state\":{}");
+      else if (b->state != NULL)
+	{
+	  sw_puts(",\"state\":");
+	  sw_puts(b->state);
+	  free(b->state);
+	}
+      sw_puts(",\"x_position\":");
+      sw_real(b->x);
+      sw_puts(",\"y_position\":");
+      sw_real(b->y);
+      sw_puts("}");
+    }
+  sw_printf("],\"ticks\":%d}", h->ticks);
+  if (sw.ndjson)
+    sw_puts("\n");
+
+  fwrite(sw.buf, 1, sw.len, sw.f);
+  fflush(sw.f);
+  sw.n_written++;
+}
+
+int state_writer_open(const char *filename, int ndjson)
+{
+  sw.f = fopen(filename, "w");
+  if (sw.f == NULL)
+    return 0;
+  sw.ndjson = ndjson;
+  sw.n_written = 0;
+  if (!ndjson)
+    fputs("[\n", sw.f);
+  return 1;
+}
+
+/* Continue a state file from a checkpoint, where it held n_written states
+ * in offset bytes. What was written after the checkpoint is cut off.
+ * Returns 0 if the file is missing or shorter.
+ */
+int state_writer_resume(const char *filename, int ndjson, uint64_t offset, int n_written)
+{
+  sw.f = fopen(filename, "r+");
+  if (sw.f == NULL)
+    return 0;
+  if (fseeko(sw.f, 0, SEEK_END) != 0 || ftello(sw.f) < (off_t) offset ||
+      ftruncate(fileno(sw.f), offset) != 0 || fseeko(sw.f, offset, SEEK_SET) != 0)
+    {
+      fclose(sw.f);
+      sw.f = NULL;
+      return 0;
+    }
+  sw.ndjson = ndjson;
+  sw.n_written = n_written;
+  return 1;
+}
+
+// The size of the states written so far, and their number, for a checkpoint.
+uint64_t state_writer_tell(int *n_written)
+{
+  writer_drain();
+  *n_written = sw.n_written;
+  return sw.f ? ftello(sw.f) : 0;
+}
+
+void state_writer_write(kilobot **bot_array, int array_size, int ticks)
+{
+  if (sw.f == NULL)
+    return;
+
+  size_t len = sizeof(sw_header) + array_size * sizeof(sw_bot);
+  char *data = writer_acquire(len);
+  sw_header *h = (sw_header *) data;
+  sw_bot *bots = (sw_bot *) (data + sizeof(sw_header));
+  h->ticks = ticks;
+  h->n = array_size;
+  h->empty_states = callback_json_state == NULL;
+
+  for (int i = 0; i < array_size; i++)
+    {
+      kilobot *bot = bot_array[i];
+      sw_bot *b = &bots[i];
+      b->ID = bot->ID;
+      b->x = BOT_X(bot);
+      b->y = BOT_Y(bot);
+      b->direction = BOT_DIR(bot);
+
+      b->state = NULL;
+      if (callback_json_state)
+	{
+	  // switch to the current bot
+	  prepare_bot(bot);
+	  json_t *j_state = callback_json_state();
+	  if (j_state != NULL)
+	    {
+	      b->state = json_dumps(j_state, JSON_COMPACT | JSON_SORT_KEYS | JSON_ENCODE_ANY);
+	      json_decref(j_state);
+	    }
+	}
+    }
+
+  writer_submit(sw_write_task, len);
+}
+
+void state_writer_close(void)
+{
+  if (sw.f == NULL)
+    return;
+  writer_drain();
+  if (!sw.ndjson)
+    fputs(sw.n_written > 0 ? "\n]\n" : "]\n", sw.f);
+  if (ferror(sw.f))
+    fprintf(stderr, "Error writing the state file.\n");
+  fclose(sw.f);
+  sw.f = NULL;
+}
+
+
+
 double extract_double(json_t* js, const char *param_name)
 {
   json_t *param = json_object_get(js, param_name);
@@ -130,9 +357,9 @@ kilobot* bot_from_json(json_t* bot_rep, int n_bots)
 
   kilobot *bot = new_kilobot(ID, n_bots);
 
-  bot->x = extract_double(bot_rep, "x_position");
-  bot->y = extract_double(bot_rep, "y_position");
-  bot->direction = extract_double(bot_rep, "direction");
+  BOT_X(bot) = extract_double(bot_rep, "x_position");
+  BOT_Y(bot) = extract_double(bot_rep, "y_position");
+  BOT_DIR(bot) = extract_double(bot_rep, "direction");
 
   return bot;
 }
@@ -163,14 +390,35 @@ kilobot** bot_loader(const char *filename, int *n_bots)
 
   *n_bots = json_array_size(j_state_array);
   json_t* bot_state;
-  kilobot **bots = (kilobot **) malloc(sizeof(kilobot *) * *n_bots);
+
+  // allbots is indexed by ID, so the IDs must be 0 ... n_bots-1, each once
+  char *seen = calloc(*n_bots + 1, 1);
+  if (seen == NULL) {
+    fprintf(stderr, "Could not allocate the IDs of %d bots.\n", *n_bots);
+    return NULL;
+  }
+  for (int i=0; i<*n_bots; i++) {
+    int ID = extract_int(json_array_get(j_state_array, i), "ID");
+    if (ID < 0 || ID >= *n_bots || seen[ID]) {
+      fprintf(stderr, "error: bot %d in %s has ID %d, the IDs must be 0 to %d, each once\n",
+	      i, filename, ID, *n_bots - 1);
+      free(seen);
+      return NULL;
+    }
+    seen[ID] = 1;
+  }
+  free(seen);
+
+  // make room for all bots first, so they don't move while loading
+  bots_reserve(*n_bots);
 
   for (int i=0; i<*n_bots; i++) {
     bot_state = json_array_get(j_state_array, i);
-    bots[i] = bot_from_json(bot_state, *n_bots);
+    bot_from_json(bot_state, *n_bots);
   }
 
-  return bots;
+  // the bots are in the arena, allbots[i] is the bot with ID i
+  return allbots;
 }
 
 /* int main(int argc, char *argv[]) */
@@ -182,9 +430,9 @@ kilobot** bot_loader(const char *filename, int *n_bots)
 /*   //init_all_bots(n_bots); */
 
 /*   /\* for (int i=0; i < n_bots; i++) { *\/ */
-/*   /\*   allbots[i]->x = rand()%w - w/2; *\/ */
-/*   /\*   allbots[i]->y = rand()%h - h/2; *\/ */
-/*   /\*   allbots[i]->direction = 2 * 3.141 * (float) rand() / (float) RAND_MAX; *\/ */
+/*   /\*   kinematics.x[i] = rand()%w - w/2; *\/ */
+/*   /\*   kinematics.y[i] = rand()%h - h/2; *\/ */
+/*   /\*   kinematics.direction[i] = 2 * 3.141 * (float) rand() / (float) RAND_MAX; *\/ */
 /*   /\* } *\/ */
 
 /*   allbots = bot_loader("astates.json", &n_bots); */
@@ -1,9 +1,17 @@
 #ifndef STATE_IO_H
 #define STATE_IO_H
 
+#include <stdint.h>
 #include <jansson.h>
 kilobot** bot_loader(const char *filename, int *n_bots);
 void save_bot_state_to_file(kilobot **bot_array, int array_size, const char *filename);
 json_t *json_rep_all_bots(kilobot **bot_array, int array_size, int ticks);
 
+// write the states during the run, as a JSON array or as NDJSON lines
+int state_writer_open(const char *filename, int ndjson);
+int state_writer_resume(const char *filename, int ndjson, uint64_t offset, int n_written);
+uint64_t state_writer_tell(int *n_written);
+void state_writer_write(kilobot **bot_array, int array_size, int ticks);
+void state_writer_close(void);
+
 #endif
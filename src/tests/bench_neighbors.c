@@ -0,0 +1,125 @@
+/* Benchmark of the neighbor search backends for growing swarm spread.
+ *
+ * A square lattice of robots is joined by four strays at distance spread
+ * from it, one in each direction. Every step all robots are jittered a bit
+ * and update_interactions_grid() is called with each backend in turn.
+ *
+ * The dense backends (grid, cells) are sized from the bounding box, so their
+ * cost grows with the spread. The hash backend should stay flat.
+ *
+ * usage: bench_neighbors [n_bots] [steps] [threads]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include "skilobot.h"
+#undef main // to prevent main here from being re-defined
+
+#include "params.h"
+#include "neighbors.h"
+#include "cell_list.h"
+#include "spatial_hash.h"
+#include "thread_pool.h"
+
+int UserdataSize = 1;
+__thread void *mydata;
+simulation_params params = {
+  .commsRadius = 70
+};
+simulation_params* simparams = &params;
+
+int get_int_param(const char *param_name, int default_val) { return default_val; };
+int bot_main(void) { return 0; };
+
+extern cell_list cells;
+extern spatial_hash cell_hash;
+
+// skip the dense backends above this many cells
+#define MAX_DENSE_CELLS 20000000.0
+
+static double now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+static void place_bots(int n_lattice, double spread)
+{
+  int side = ceil(sqrt(n_lattice));
+  double spacing = 40;
+  for (int i = 0; i < n_lattice; i++)
+    {
+      kinematics.x[i] = spacing * (i % side);
+      kinematics.y[i] = spacing * (i / side);
+    }
+
+  double c = spacing * side / 2;
+  double strays[4][2] = {{c + spread, c}, {c - spread, c}, {c, c + spread}, {c, c - spread}};
+  for (int i = 0; i < 4; i++)
+    {
+      BOT_X(allbots[n_lattice + i]) = strays[i][0];
+      BOT_Y(allbots[n_lattice + i]) = strays[i][1];
+    }
+}
+
+static double run(int index, int n_bots, int steps)
+{
+  params.neighborIndex = index;
+  srand(1);
+
+  double t0 = now();
+  for (int s = 0; s < steps; s++)
+    {
+      for (int i = 0; i < n_bots; i++)
+	{
+	  kinematics.x[i] += 2.0 * rand() / RAND_MAX - 1;
+	  kinematics.y[i] += 2.0 * rand() / RAND_MAX - 1;
+	}
+      update_interactions_grid(n_bots);
+    }
+  return 1e3 * (now() - t0) / steps;
+}
+
+int main(int argc, char *argv[])
+{
+  int n_lattice = argc > 1 ? atoi(argv[1]) : 10000;
+  int steps = argc > 2 ? atoi(argv[2]) : 50;
+  pool_init(argc > 3 ? atoi(argv[3]) : 1);
+  int n_bots = n_lattice + 4;
+
+  create_bots(n_bots);
+  init_all_bots(n_bots);
+
+  double spreads[] = {1e3, 1e4, 1e5, 1e6, 1e7};
+
+  printf("%d robots, %d steps, %d threads, ms per step\n", n_bots, steps, pool_threads());
+  printf("%10s %10s %10s %10s %12s %12s\n", "spread", "grid", "cells", "hash", "dense cells", "hash cells");
+  for (int k = 0; k < sizeof(spreads) / sizeof(spreads[0]); k++)
+    {
+      double spread = spreads[k];
+      double extent = 2 * spread + 40 * ceil(sqrt(n_lattice));
+      double dense_cells = pow(extent / (params.commsRadius + .1), 2);
+      printf("%10.0e", spread);
+
+      int indices[] = {NEIGHBOR_INDEX_GRID, NEIGHBOR_INDEX_CELLS, NEIGHBOR_INDEX_HASH};
+      for (int b = 0; b < 3; b++)
+	{
+	  if (indices[b] != NEIGHBOR_INDEX_HASH && dense_cells > MAX_DENSE_CELLS)
+	    {
+	      printf(" %10s", "-");
+	      continue;
+	    }
+	  place_bots(n_lattice, spread);
+	  printf(" %10.3f", run(indices[b], n_bots, steps));
+	  fflush(stdout);
+	}
+      printf(" %12.0f %12zu\n", dense_cells, cell_hash.n_cells);
+    }
+
+  return 0;
+}
@@ -1,16 +1,31 @@
 #include <stdlib.h>
+#include <string.h>
 #include <check.h>
 
 #include <stdio.h>
+#include <math.h>
+#include <time.h>
 #include "skilobot.h"
 #undef main // to prevent main here from being re-defined
 
 #include "params.h"
+#include "neighbors.h"
+#include "thread_pool.h"
+#include "kinematics.h"
+#include "rng.h"
+#include "tx_wheel.h"
+#include "obstacles.h"
+#include "light_raster.h"
+#include "trajectory.h"
+#include "stateio.h"
+#include "async_writer.h"
+#include "checkpoint.h"
 
 
 
 // Include some definitions of "private" functions we want to test.
 void update_bot_history(kilobot *bot);
+void update_bot_history_ring(kilobot *bot);
 void manage_bot_history_memory(kilobot *bot);
 void move_bot_forward(kilobot *bot, float timestep);
 void turn_bot_right(kilobot *bot, float timestep);
@@ -20,16 +35,20 @@ double bot_dist(kilobot *bot1, kilobot *bot2);
 coord2D normalise(coord2D c);
 coord2D separation_unit_vector(kilobot *bot1, kilobot *bot2);
 void separate_clashing_bots(kilobot *bot1, kilobot *bot2);
-void reset_n_in_range_indices(int n_bots);
-void update_n_in_range_indices(kilobot *bot1, kilobot *bot2);
+void process_messaging(int n_bots);
+void set_callback_lighting(int16_t (*fp)(double, double));
+void set_callback_obstacles(int16_t (*fp)(double, double, double *, double *));
+void set_callback_obstacles_batch(void (*fp)(int, const double *, const double *, double *, double *));
+void set_callback_lighting_batch(void (*fp)(int, const double *, const double *, int16_t *));
+void set_callback_json_state(json_t*(*fp)(void));
 
 // Needed to compile any program with a library.
 //#include "kilolib.h"
 typedef struct { int num_bot_steps; } USERDATA;
 int UserdataSize = sizeof(USERDATA);
-void *mydata;
+__thread void *mydata;
 //char* botinfo_simple(void) { return NULL; }; 
-extern uint16_t kilo_uid;
+extern __thread uint16_t kilo_uid;
 
 // simulator parameter structure.
 // to avoid dragging in the whole parameter parsing in this test, populate with default values here as needed.
@@ -57,6 +76,49 @@ void setup(void) {
 void dummy_loop(void) {
     ((USERDATA* )mydata)->num_bot_steps++;
 }
+void id_loop(void) {
+    ((USERDATA* )mydata)->num_bot_steps = kilo_uid + 1;
+}
+
+// Bot state for the state writer test.
+json_t *json_state_steps(void) {
+    json_t *state = json_object();
+    json_object_set_new(state, "steps", json_integer(((USERDATA *) mydata)->num_bot_steps));
+    return state;
+}
+
+// Light fields for the light raster test.
+int16_t linear_light(double x, double y) { return 2 * x + 3 * y + 100; }
+int16_t flat_light(double x, double y) { return 500; }
+
+// A wall at x = 100 for the batch callback test, per point and in batches.
+int n_batch_calls = 0;
+int16_t wall_point(double x, double y, double *push_x, double *push_y) {
+    *push_x = 100 - x;
+    *push_y = 1;
+    return x > 100;
+}
+void wall_batch(int n, const double *x, const double *y, double *push_x, double *push_y) {
+    n_batch_calls++;
+    for (int i = 0; i < n; i++) {
+        push_x[i] = x[i] > 100 ? 100 - x[i] : 0;
+        push_y[i] = x[i] > 100 ? 1 : 0;
+    }
+}
+void linear_light_batch(int n, const double *x, const double *y, int16_t *light) {
+    n_batch_calls++;
+    for (int i = 0; i < n; i++)
+        light[i] = linear_light(x[i], y[i]);
+}
+
+// A slow writer task for the writer test, recording the order of the buffers.
+int written[16], n_written = 0;
+void slow_task(char *data, size_t len) {
+    clock_t t = clock();
+    while (clock() - t < CLOCKS_PER_SEC / 500)
+        ;
+    written[n_written++] = *(int *) data;
+}
 
 
 // Helper function to do a double comparison.
@@ -85,6 +147,39 @@ START_TEST(test_create_bots)
 }
 END_TEST
 
+START_TEST(test_bot_arena)
+{
+    // Setup: bots with some user data, created on several threads.
+    int n = 100;
+    pool_init(3);
+    create_bots(n);
+    size_t stride;
+    char *data = bots_userdata(&stride);
+    ck_assert_int_eq(stride % 64, 0);
+    ck_assert(stride >= sizeof(USERDATA));
+    for (int i = 0; i < n; i++) {
+        ck_assert_int_eq(allbots[i]->ID, i);
+        ck_assert(allbots[i] == allbots[0] + i);
+        ck_assert(allbots[i]->data == data + i * stride);
+        ((USERDATA *) allbots[i]->data)->num_bot_steps = i;
+    }
+
+    // Growing the arena moves the bots, with their user data.
+    kinematics.x[n-1] = 12.5;
+    bots_reserve(100 * n);
+    new_kilobot(100 * n - 1, n);
+    data = bots_userdata(&stride);
+    for (int i = 0; i < n; i++) {
+        ck_assert_int_eq(allbots[i]->ID, i);
+        ck_assert(allbots[i]->data == data + i * stride);
+        ck_assert_int_eq(((USERDATA *) allbots[i]->data)->num_bot_steps, i);
+    }
+    ck_assert_int_eq(allbots[100 * n - 1]->ID, 100 * n - 1);
+    ck_assert(BOT_X(allbots[n-1]) == 12.5);
+    pool_init(1);
+}
+END_TEST
+
 START_TEST(test_init_all_bots)
 {
     int n = 3;
@@ -128,26 +223,98 @@ START_TEST(test_run_all_bots)
 }
 END_TEST
 
+START_TEST(test_run_all_bots_parallel)
+{
+    int n = 50;
+    create_bots(n);
+    init_all_bots(n);
+    for (int i=0; i<n; i++) {
+      prepare_bot(allbots[i]);
+      current_bot->user_loop = &id_loop;
+      setup();
+    }
+
+    // each thread must see the data and ID of the bot it runs
+    params.parallelUserLoop = 1;
+    pool_init(3);
+    run_all_bots(n);
+    for (int i=0; i<n; i++)
+      ck_assert_int_eq(((USERDATA* )allbots[i]->data)->num_bot_steps, i + 1);
+    pool_init(1);
+    params.parallelUserLoop = 0;
+}
+END_TEST
+
 START_TEST(test_update_bot_history)
 {
+    params.storeHistory = 1;
+    params.histLength = 10;
     kilobot* k;
     k = new_kilobot(0, 1);
+    double x, y;
 
-    ck_assert_int_eq(k->x, 0);
-    ck_assert_int_eq(k->y, 0);
+    ck_assert_int_eq(BOT_X(k), 0);
+    ck_assert_int_eq(BOT_Y(k), 0);
 
     update_bot_history(k);
 
-    ck_assert_int_eq(k->x_history[0], 0);
-    ck_assert_int_eq(k->y_history[0], 0);
+    ck_assert(bot_history_point(k, 0, &x, &y));
+    ck_assert(x == 0 && y == 0);
+
+
+    BOT_X(k) = 1;
+    BOT_Y(k) = 2;
+    update_bot_history(k);
 
+    ck_assert(bot_history_point(k, 0, &x, &y));
+    ck_assert(x == 1 && y == 2);
+    ck_assert(bot_history_point(k, 1, &x, &y));
+    ck_assert(x == 0 && y == 0);
+    ck_assert(!bot_history_point(k, 2, &x, &y));
 
-    k->x = 1;
-    k->y = 2;
+    // Far away, the anchor moves and only the points in range are kept.
+    BOT_X(k) = 2500.03;
     update_bot_history(k);
+    ck_assert(bot_history_point(k, 0, &x, &y));
+    ck_assert(fabs(x - 2500.03) <= 0.5 / HIST_SCALE && y == 2);
+    ck_assert(!bot_history_point(k, 1, &x, &y));
+
+    // The ring keeps the newest histLength points.
+    for (int i = 0; i < 25; i++) {
+        BOT_X(k) = 2500 + i;
+        update_bot_history(k);
+    }
+    ck_assert_int_eq(k->l_hist, 10);
+    ck_assert(bot_history_point(k, 9, &x, &y));
+    ck_assert(x == 2515);
+    params.storeHistory = 0;
+}
+END_TEST
 
-    ck_assert_int_eq(k->x_history[1], 1);
-    ck_assert_int_eq(k->y_history[1], 2);
+START_TEST(test_history_memory)
+{
+    // Setup: room for 10 points per bot, for a history of 95 steps.
+    int n = 1000;
+    params.storeHistory = 1;
+    params.histLength = 95;
+    params.historyMemoryMB = 10.0 * n * sizeof(hist_point) / 1048576;
+    create_bots(n);
+    kilobot *k = allbots[7];
+    ck_assert_int_eq(k->n_hist, 10);
+
+    // Every 10th step is stored, covering the last 95 steps.
+    double x, y;
+    for (int i = 0; i < 200; i++) {
+        BOT_X(k) = i;
+        update_bot_history_ring(k);
+    }
+    ck_assert_int_eq(k->l_hist, 10);
+    for (int age = 0; age < 10; age++) {
+        ck_assert(bot_history_point(k, age, &x, &y));
+        ck_assert(x == 190 - 10 * age);
+    }
+    params.storeHistory = 0;
+    params.historyMemoryMB = 0;
 }
 END_TEST
 
@@ -179,11 +346,11 @@ START_TEST(test_move_bot_forward)
     // Move forwards along the north axis.
     k->right_motor_power = 2;
     k->left_motor_power = 2;
-    k->direction = 0.0;
+    BOT_DIR(k) = 0.0;
     move_bot_forward(k, 3.0);
 
-    check_double_equality(k->x, 0.0);
-    check_double_equality(k->y, 6.0);
+    check_double_equality(BOT_X(k), 0.0);
+    check_double_equality(BOT_Y(k), 6.0);
 }
 END_TEST
 
@@ -193,15 +360,15 @@ START_TEST(test_turn_bot_right)
     k = new_kilobot(0, 1);
 
     // Turn from North to East.
-    k->direction = 0.0;
+    BOT_DIR(k) = 0.0;
     k->left_motor_power = 30;
     turn_bot_right(k, 3.1415927/2);
 
-    check_double_equality( k->direction, 3.1415927/2 );
+    check_double_equality( BOT_DIR(k), 3.1415927/2 );
 
     // this test assumes leg is placed at 90 degrees, no longer true
-    // check_double_equality(k->x, 17.0);
-    // check_double_equality(k->y, 17.0);
+    // check_double_equality(BOT_X(k), 17.0);
+    // check_double_equality(BOT_Y(k), 17.0);
 }
 END_TEST
 
@@ -211,15 +378,88 @@ START_TEST(test_turn_bot_left)
     k = new_kilobot(0, 1);
 
     // Turn from North to West.
-    k->direction = 0.0;
+    BOT_DIR(k) = 0.0;
     k->right_motor_power = 30;
     turn_bot_left(k, 3.1415927/2);
 
-    check_double_equality( k->direction, -3.1415927/2 );
+    check_double_equality( BOT_DIR(k), -3.1415927/2 );
 
     // this test assumes leg is placed at 90 degrees, no longer true
-    // check_double_equality(k->x, -17.0);
-    // check_double_equality(k->y, 17.0);
+    // check_double_equality(BOT_X(k), -17.0);
+    // check_double_equality(BOT_Y(k), 17.0);
+}
+END_TEST
+
+START_TEST(test_update_locations_simd)
+{
+    // Setup: bots moving forward, turning either way, and stopped.
+    int n = 39;
+    float dt = 0.0416666;
+    create_bots(n);
+    srand(3);
+    for (int i = 0; i < n; i++) {
+        kinematics.x[i] = 1000.0 * rand() / RAND_MAX - 500;
+        kinematics.y[i] = 1000.0 * rand() / RAND_MAX - 500;
+        kinematics.direction[i] = 2000.0 * rand() / RAND_MAX - 1000;
+        kinematics.speed[i] = 7;
+        kinematics.turn_rate_l[i] = (i % 4 == 0 || i % 4 == 2) ? 0.2 : 0;
+        kinematics.turn_rate_r[i] = (i % 4 == 0 || i % 4 == 1) ? 0.2 : 0;
+    }
+    double *x = malloc(n * sizeof(double));
+    double *y = malloc(n * sizeof(double));
+    double *d = malloc(n * sizeof(double));
+    for (int i = 0; i < n; i++) {
+        x[i] = kinematics.x[i];
+        y[i] = kinematics.y[i];
+        d[i] = kinematics.direction[i];
+        update_bot_location(allbots[i], dt);
+    }
+    for (int i = 0; i < n; i++) {
+        double sx = kinematics.x[i], sy = kinematics.y[i], sd = kinematics.direction[i];
+        kinematics.x[i] = x[i];
+        kinematics.y[i] = y[i];
+        kinematics.direction[i] = d[i];
+        x[i] = sx;
+        y[i] = sy;
+        d[i] = sd;
+    }
+
+    // The vectorized step must match the scalar one within the documented tolerance.
+    int done = update_locations_simd(n, dt, allbots[0]->radius, allbots[0]->leg_angle);
+    ck_assert_int_eq(done % kinematics_simd_width(), 0);
+    for (int i = done; i < n; i++)
+        update_bot_location(allbots[i], dt);
+    for (int i = 0; i < n; i++) {
+        ck_assert(kinematics.direction[i] == d[i]);
+        ck_assert(fabs(kinematics.x[i] - x[i]) < 1e-9);
+        ck_assert(fabs(kinematics.y[i] - y[i]) < 1e-9);
+    }
+}
+END_TEST
+
+START_TEST(test_rng)
+{
+    // a draw only depends on its counter
+    rng_seed(5);
+    uint32_t a = rng_u32(RNG_HARD, 3, 100, 0);
+    ck_assert(rng_u32(RNG_HARD, 3, 100, 1) != a);
+    ck_assert(rng_u32(RNG_MESSAGE, 3, 100, 0) != a);
+    ck_assert(rng_u32(RNG_HARD, 3, 100, 0) == a);
+    rng_seed(6);
+    ck_assert(rng_u32(RNG_HARD, 3, 100, 0) != a);
+
+    double sum = 0, sum2 = 0;
+    int n = 10000;
+    for (int i = 0; i < n; i++) {
+        double u = rng_uniform(RNG_DISTRIBUTE, i, 0, 0);
+        ck_assert(u >= 0 && u < 1);
+        double g = rng_gauss(RNG_DISTANCE, i, 0, 0, 2.0, 3.0);
+        sum += g;
+        sum2 += g * g;
+    }
+    double mean = sum / n;
+    ck_assert(fabs(mean - 2.0) < 0.1);
+    ck_assert(fabs(sqrt(sum2 / n - mean * mean) - 3.0) < 0.1);
 }
 END_TEST
 
@@ -228,11 +468,11 @@ START_TEST(test_bot_dist)
     kilobot* k1;
     kilobot* k2;
     k1 = new_kilobot(0, 1);
-    k2 = new_kilobot(0, 1);
-    k1->x = 0.0;
-    k1->y = 0.0;
-    k2->x = 3.0;
-    k2->y = 4.0;
+    k2 = new_kilobot(1, 2);
+    BOT_X(k1) = 0.0;
+    BOT_Y(k1) = 0.0;
+    BOT_X(k2) = 3.0;
+    BOT_Y(k2) = 4.0;
     double distance = bot_dist(k1, k2);
     check_double_equality(distance, 5.0);
 //    double abs_diff = abs(distance - 5.0);
@@ -265,11 +505,11 @@ START_TEST(test_separation_unit_vector)
     coord2D c;
 
     k1 = new_kilobot(0, 1);
-    k2 = new_kilobot(0, 1);
-    k1->x = 0.0;
-    k1->y = 4.0;
-    k2->x = 7.6;
-    k2->y = 4.0;
+    k2 = new_kilobot(1, 2);
+    BOT_X(k1) = 0.0;
+    BOT_Y(k1) = 4.0;
+    BOT_X(k2) = 7.6;
+    BOT_Y(k2) = 4.0;
 
     c = separation_unit_vector(k1, k2);
 
@@ -285,59 +525,70 @@ START_TEST(test_separate_clashing_bots)
     kilobot* k2;
 
     k1 = new_kilobot(0, 1);
-    k2 = new_kilobot(0, 1);
-    k1->x = 4.0;
-    k1->y = 4.0;
-    k2->x = 4.0;
-    k2->y = 10.0;
+    k2 = new_kilobot(1, 2);
+    BOT_X(k1) = 4.0;
+    BOT_Y(k1) = 4.0;
+    BOT_X(k2) = 4.0;
+    BOT_Y(k2) = 10.0;
 
     separate_clashing_bots(k1, k2);
 
-    check_double_equality(k1->x, 4.0);
-    check_double_equality(k1->y, 3.0);
-    check_double_equality(k2->x, 4.0);
-    check_double_equality(k2->y, 11.0);
+    check_double_equality(BOT_X(k1), 4.0);
+    check_double_equality(BOT_Y(k1), 3.0);
+    check_double_equality(BOT_X(k2), 4.0);
+    check_double_equality(BOT_Y(k2), 11.0);
 
 }
 END_TEST
 
-START_TEST(test_reset_n_in_range_indices)
+START_TEST(test_neighbors_reset)
 {
     int n = 3;
-    create_bots(n);
-    init_all_bots(n);
-    for (int i=0; i<n; i++) {
-        allbots[i]->n_in_range = i;
-        ck_assert_int_eq(allbots[i]->n_in_range, i);
-    }
+    neighbors_reset(n);
+    neighbors_add_pair(0, 1, 4.0);
+    neighbors_build();
+    ck_assert_int_eq(n_neighbors(0), 1);
 
-    reset_n_in_range_indices(n);
+    neighbors_reset(n);
     for (int i=0; i<n; i++) {
-        ck_assert_int_eq(allbots[i]->n_in_range, 0);
+        ck_assert_int_eq(n_neighbors(i), 0);
     }
 }
 END_TEST
 
-START_TEST(test_update_n_in_range_indices)
+START_TEST(test_neighbors_build)
 {
     // Setup.
-    int n = 2;
-    create_bots(n);
-    init_all_bots(n);
-    reset_n_in_range_indices(n);
+    int n = 4;
+    neighbors_reset(n);
 
-    // Code we want to test.
-    update_n_in_range_indices(allbots[0], allbots[1]);
-
-    // Both bots have each other in range.
-    ck_assert_int_eq(allbots[0]->in_range[0], 1);
-    ck_assert_int_eq(allbots[1]->in_range[0], 0);
-
-    // The n_in_range index is ready to add the next bot.
-    for (int i=0; i<n; i++) {
-        ck_assert_int_eq(allbots[i]->n_in_range, 1);
-    }
+    // Pairs in arbitrary order and orientation.
+    neighbors_add_pair(3, 1, 9.0);
+    neighbors_add_pair(0, 3, 16.0);
+    neighbors_add_pair(1, 0, 25.0);
 
+    // Code we want to test.
+    neighbors_build();
+
+    // Every bot has its neighbors sorted by index, with their distances.
+    ck_assert_int_eq(n_neighbors(0), 2);
+    ck_assert_int_eq(n_neighbors(1), 2);
+    ck_assert_int_eq(n_neighbors(2), 0);
+    ck_assert_int_eq(n_neighbors(3), 2);
+
+    int *row = &neighbors.index[neighbors.offset[0]];
+    double *d = &neighbors.dist[neighbors.offset[0]];
+    ck_assert_int_eq(row[0], 1);
+    ck_assert_int_eq(row[1], 3);
+    check_double_equality(d[0], 5.0);
+    check_double_equality(d[1], 4.0);
+
+    row = &neighbors.index[neighbors.offset[3]];
+    d = &neighbors.dist[neighbors.offset[3]];
+    ck_assert_int_eq(row[0], 0);
+    ck_assert_int_eq(row[1], 1);
+    check_double_equality(d[0], 4.0);
+    check_double_equality(d[1], 3.0);
 }
 END_TEST
 
@@ -347,61 +598,917 @@ START_TEST(test_update_interactions)
     int n = 2;
     create_bots(n);
     init_all_bots(n);
-    reset_n_in_range_indices(n);
     for (int i=0; i<n; i++) {
         allbots[i]->cr = 50;
         allbots[i]->radius = 20;
     }
-    allbots[0]->x = 0.0;
-    allbots[0]->y = 0.0;
+    kinematics.x[0] = 0.0;
+    kinematics.y[0] = 0.0;
 
     // Not within communication distance.
-    allbots[1]->x = 0.0;
-    allbots[1]->y = 50.0;
+    kinematics.x[1] = 0.0;
+    kinematics.y[1] = 50.0;
     update_interactions(n);
     for (int i=0; i<n; i++) {
-        ck_assert_int_eq(allbots[i]->n_in_range, 0);
+        ck_assert_int_eq(n_neighbors(i), 0);
     }
-    check_double_equality(allbots[0]->x, 0.0);
-    check_double_equality(allbots[0]->y, 0.0);
-    check_double_equality(allbots[1]->x, 0.0);
-    check_double_equality(allbots[1]->y, 50.0);
+    check_double_equality(kinematics.x[0], 0.0);
+    check_double_equality(kinematics.y[0], 0.0);
+    check_double_equality(kinematics.x[1], 0.0);
+    check_double_equality(kinematics.y[1], 50.0);
 
     // Just within communication distance.
-    allbots[1]->x = 0.0;
-    allbots[1]->y = 49.9;
+    kinematics.x[1] = 0.0;
+    kinematics.y[1] = 49.9;
     update_interactions(n);
     for (int i=0; i<n; i++) {
-        ck_assert_int_eq(allbots[i]->n_in_range, 1);
+        ck_assert_int_eq(n_neighbors(i), 1);
     }
-    check_double_equality(allbots[0]->x, 0.0);
-    check_double_equality(allbots[0]->y, 0.0);
-    check_double_equality(allbots[1]->x, 0.0);
-    check_double_equality(allbots[1]->y, 49.9);
+    check_double_equality(kinematics.x[0], 0.0);
+    check_double_equality(kinematics.y[0], 0.0);
+    check_double_equality(kinematics.x[1], 0.0);
+    check_double_equality(kinematics.y[1], 49.9);
 
     // Touching but not collided.
-    allbots[1]->x = 0.0;
-    allbots[1]->y = 40.0;
+    kinematics.x[1] = 0.0;
+    kinematics.y[1] = 40.0;
     update_interactions(n);
     for (int i=0; i<n; i++) {
-        ck_assert_int_eq(allbots[i]->n_in_range, 1);
+        ck_assert_int_eq(n_neighbors(i), 1);
     }
-    check_double_equality(allbots[0]->x, 0.0);
-    check_double_equality(allbots[0]->y, 0.0);
-    check_double_equality(allbots[1]->x, 0.0);
-    check_double_equality(allbots[1]->y, 40.0);
+    check_double_equality(kinematics.x[0], 0.0);
+    check_double_equality(kinematics.y[0], 0.0);
+    check_double_equality(kinematics.x[1], 0.0);
+    check_double_equality(kinematics.y[1], 40.0);
 
     // Collided.
-    allbots[1]->x = 0.0;
-    allbots[1]->y = 39.9;
+    kinematics.x[1] = 0.0;
+    kinematics.y[1] = 39.9;
     update_interactions(n);
     for (int i=0; i<n; i++) {
-        ck_assert_int_eq(allbots[i]->n_in_range, 1);
+        ck_assert_int_eq(n_neighbors(i), 1);
     }
-    check_double_equality(allbots[0]->x, 0.0);
-    check_double_equality(allbots[0]->y, -1.0);
-    check_double_equality(allbots[1]->x, 0.0);
-    check_double_equality(allbots[1]->y, 40.9);
+    check_double_equality(kinematics.x[0], 0.0);
+    check_double_equality(kinematics.y[0], -1.0);
+    check_double_equality(kinematics.x[1], 0.0);
+    check_double_equality(kinematics.y[1], 40.9);
+}
+END_TEST
+
+
+START_TEST(test_update_interactions_grid)
+{
+    // Setup.
+    int n = 3;
+    create_bots(n);
+    init_all_bots(n);
+    kinematics.x[0] = 0.0;
+    kinematics.y[0] = 0.0;
+    kinematics.x[1] = 60.0;
+    kinematics.y[1] = 0.0;
+    kinematics.x[2] = 500.0;
+    kinematics.y[2] = 500.0;
+
+    update_interactions_grid(n);
+    ck_assert_int_eq(n_neighbors(0), 1);
+    ck_assert_int_eq(n_neighbors(1), 1);
+    ck_assert_int_eq(n_neighbors(2), 0);
+
+    // Move bots across cells, and beyond the grid on the low side.
+    kinematics.x[1] = -400.0;
+    kinematics.y[1] = -400.0;
+    kinematics.x[2] = -350.0;
+    kinematics.y[2] = -400.0;
+
+    update_interactions_grid(n);
+    ck_assert_int_eq(n_neighbors(0), 0);
+    ck_assert_int_eq(n_neighbors(1), 1);
+    ck_assert_int_eq(n_neighbors(2), 1);
+    ck_assert_int_eq(neighbors.index[neighbors.offset[1]], 2);
+}
+END_TEST
+
+START_TEST(test_update_interactions_hash)
+{
+    // Setup.
+    int n = 4;
+    params.neighborIndex = NEIGHBOR_INDEX_HASH;
+    create_bots(n);
+    init_all_bots(n);
+    kinematics.x[0] = 0.0;
+    kinematics.y[0] = 0.0;
+    kinematics.x[1] = -60.0;
+    kinematics.y[1] = 10.0;
+    // a pair far away, across a cell boundary
+    kinematics.x[2] = 1e9;
+    kinematics.y[2] = -1e9;
+    kinematics.x[3] = 1e9 + 50.0;
+    kinematics.y[3] = -1e9 + 30.0;
+
+    update_interactions_grid(n);
+    ck_assert_int_eq(n_neighbors(0), 1);
+    ck_assert_int_eq(n_neighbors(1), 1);
+    ck_assert_int_eq(n_neighbors(2), 1);
+    ck_assert_int_eq(n_neighbors(3), 1);
+    ck_assert_int_eq(neighbors.index[neighbors.offset[2]], 3);
+    params.neighborIndex = NEIGHBOR_INDEX_GRID;
+}
+END_TEST
+
+START_TEST(test_update_interactions_threads)
+{
+    // Setup: a random pile of bots, with many collisions.
+    int n = 500;
+    create_bots(n);
+    init_all_bots(n);
+    params.neighborIndex = NEIGHBOR_INDEX_CELLS;
+    srand(7);
+    for (int i = 0; i < n; i++) {
+        kinematics.x[i] = 600.0 * rand() / RAND_MAX;
+        kinematics.y[i] = 600.0 * rand() / RAND_MAX;
+    }
+
+    // Serial reference.
+    double *x = malloc(n * sizeof(double));
+    double *y = malloc(n * sizeof(double));
+    memcpy(x, kinematics.x, n * sizeof(double));
+    memcpy(y, kinematics.y, n * sizeof(double));
+    update_interactions_grid(n);
+    int n_entries = neighbors.offset[n];
+    int *index = malloc(n_entries * sizeof(int));
+    double *dist = malloc(n_entries * sizeof(double));
+    memcpy(index, neighbors.index, n_entries * sizeof(int));
+    memcpy(dist, neighbors.dist, n_entries * sizeof(double));
+    double *rx = malloc(n * sizeof(double));
+    double *ry = malloc(n * sizeof(double));
+    memcpy(rx, kinematics.x, n * sizeof(double));
+    memcpy(ry, kinematics.y, n * sizeof(double));
+    memcpy(kinematics.x, x, n * sizeof(double));
+    memcpy(kinematics.y, y, n * sizeof(double));
+
+    // The same step with three threads must give identical results.
+    pool_init(3);
+    update_interactions_grid(n);
+    ck_assert_int_eq(neighbors.offset[n], n_entries);
+    for (int k = 0; k < n_entries; k++) {
+        ck_assert_int_eq(neighbors.index[k], index[k]);
+        ck_assert(neighbors.dist[k] == dist[k]);
+    }
+    for (int i = 0; i < n; i++) {
+        ck_assert(kinematics.x[i] == rx[i]);
+        ck_assert(kinematics.y[i] == ry[i]);
+    }
+    pool_init(1);
+    params.neighborIndex = NEIGHBOR_INDEX_GRID;
+}
+END_TEST
+
+START_TEST(test_tx_wheel)
+{
+    // Setup: bots with different periods, some longer than the wheel.
+    int n = 40;
+    create_bots(n);
+    int ref[40];
+    for (int i = 0; i < n; i++) {
+        allbots[i]->tx_period = i % 3 == 0 ? 0 : i + 1;
+        allbots[i]->tx_ticks = (7 * i) % 23;
+        ref[i] = allbots[i]->tx_ticks;
+    }
+    tx_wheel_reset();
+
+    // The wheel must return the same bots as polling all of them,
+    // also when a step spans many ticks, or none.
+    int now = 0;
+    int steps[] = {0, 1, 1, 0, 3, 40, 1, 2, 100, 1};
+    for (int s = 0; s < 200; s++) {
+        now += steps[s % 10];
+        int *due;
+        int n_due = tx_wheel_due(n, now, &due);
+        int k = 0;
+        for (int i = 0; i < n; i++)
+            if (now >= ref[i]) {
+                int period = allbots[i]->tx_period > 0 ? allbots[i]->tx_period : tx_period_ticks;
+                ref[i] += period;
+                ck_assert(k < n_due);
+                ck_assert_int_eq(due[k], i);
+                allbots[i]->tx_ticks += period;
+                tx_wheel_schedule(i, now);
+                k++;
+            }
+        ck_assert_int_eq(n_due, k);
+    }
+}
+END_TEST
+
+START_TEST(test_collision_grid)
+{
+    // Setup: a random pile of bots, with many collisions.
+    int n = 300;
+    create_bots(n);
+    init_all_bots(n);
+    params.useGrid = 1;
+    srand(11);
+    double *x = malloc(n * sizeof(double));
+    double *y = malloc(n * sizeof(double));
+    for (int i = 0; i < n; i++) {
+        x[i] = kinematics.x[i] = 400.0 * rand() / RAND_MAX;
+        y[i] = kinematics.y[i] = 400.0 * rand() / RAND_MAX;
+    }
+    update_interactions_grid(n);
+    int n_entries = neighbors.offset[n];
+    int *index = malloc(n_entries * sizeof(int));
+    memcpy(index, neighbors.index, n_entries * sizeof(int));
+    double *rx = malloc(n * sizeof(double));
+    double *ry = malloc(n * sizeof(double));
+    memcpy(rx, kinematics.x, n * sizeof(double));
+    memcpy(ry, kinematics.y, n * sizeof(double));
+
+    // The collisions found with their own grid leave the communication
+    // neighbors as they were, and move the bots exactly as the lists do.
+    memcpy(kinematics.x, x, n * sizeof(double));
+    memcpy(kinematics.y, y, n * sizeof(double));
+    params.collisionGrid = 1;
+    update_interactions_grid(n);
+    ck_assert_int_eq(neighbors.offset[n], n_entries);
+    for (int k = 0; k < n_entries; k++)
+        ck_assert_int_eq(neighbors.index[k], index[k]);
+    ck_assert(contacts.offset[n] > 0);
+    for (int i = 0; i < n; i++) {
+        ck_assert(kinematics.x[i] == rx[i]);
+        ck_assert(kinematics.y[i] == ry[i]);
+    }
+
+    params.collisionGrid = 0;
+    params.useGrid = 0;
+    free(x);
+    free(y);
+    free(rx);
+    free(ry);
+    free(index);
+}
+END_TEST
+
+START_TEST(test_collision_solver_jacobi)
+{
+    // Setup: two bots overlapping by 10 mm.
+    int n = 2;
+    create_bots(n);
+    init_all_bots(n);
+    params.useGrid = 1;
+    params.collisionSolver = COLLISION_SOLVER_JACOBI;
+    params.collisionIterations = 4;
+    double d = 2 * allbots[0]->radius;
+    kinematics.x[0] = 0;
+    kinematics.x[1] = d - 10;
+    kinematics.y[0] = kinematics.y[1] = 0;
+
+    // Both move half the overlap, in one iteration.
+    update_interactions_grid(n);
+    ck_assert(fabs(kinematics.x[0] + 5) < 1e-9);
+    ck_assert(fabs(kinematics.x[1] - (d - 5)) < 1e-9);
+
+    // A random pile gives the same positions with three threads.
+    n = 300;
+    create_bots(n);
+    init_all_bots(n);
+    srand(5);
+    double *x = malloc(n * sizeof(double));
+    double *y = malloc(n * sizeof(double));
+    for (int i = 0; i < n; i++) {
+        x[i] = kinematics.x[i] = 300.0 * rand() / RAND_MAX;
+        y[i] = kinematics.y[i] = 300.0 * rand() / RAND_MAX;
+    }
+    update_interactions_grid(n);
+    double *rx = malloc(n * sizeof(double));
+    double *ry = malloc(n * sizeof(double));
+    memcpy(rx, kinematics.x, n * sizeof(double));
+    memcpy(ry, kinematics.y, n * sizeof(double));
+    memcpy(kinematics.x, x, n * sizeof(double));
+    memcpy(kinematics.y, y, n * sizeof(double));
+    pool_init(3);
+    update_interactions_grid(n);
+    for (int i = 0; i < n; i++) {
+        ck_assert(kinematics.x[i] == rx[i]);
+        ck_assert(kinematics.y[i] == ry[i]);
+    }
+    pool_init(1);
+    params.collisionSolver = COLLISION_SOLVER_PUSH;
+    params.useGrid = 0;
+    free(x);
+    free(y);
+    free(rx);
+    free(ry);
+}
+END_TEST
+
+START_TEST(test_obstacles)
+{
+    // Setup: a maze of 400 short walls, a circle and the arena bounds.
+    int n = 4;
+    create_bots(n);
+    init_all_bots(n);
+    double r = allbots[0]->radius;
+    obstacles_clear();
+    for (int k = 0; k < 20; k++)
+        for (int l = 0; l < 20; l++)
+            obstacles_add_segment(100.0 * k, 100.0 * l, 100.0 * k + 50, 100.0 * l);
+    obstacles_add_circle(2500, 500, 40);
+    obstacles_add_segment(-500, -500, -500, 3000);
+
+    // touching a wall from above, on a circle, outside the bounds, far from everything
+    kinematics.x[0] = 725;   kinematics.y[0] = 905;
+    kinematics.x[1] = 2500;  kinematics.y[1] = 530;
+    kinematics.x[2] = -510;  kinematics.y[2] = 0;
+    kinematics.x[3] = 1275;  kinematics.y[3] = 1050;
+    resolve_obstacles(n);
+
+    ck_assert(fabs(kinematics.x[0] - 725) < 1e-9);
+    ck_assert(fabs(kinematics.y[0] - (900 + r)) < 1e-9);
+    ck_assert(fabs(kinematics.y[1] - (500 + 40 + r)) < 1e-9);
+    ck_assert(fabs(kinematics.x[2] - (-500 - r)) < 1e-9);
+    ck_assert(kinematics.x[3] == 1275 && kinematics.y[3] == 1050);
+    obstacles_clear();
+}
+END_TEST
+
+START_TEST(test_light_raster)
+{
+    // Setup: a linear light field, which the bilinear interpolation reproduces.
+    params.lightRaster = 10;
+    params.lightRasterArea[0] = 0;   params.lightRasterArea[1] = 0;
+    params.lightRasterArea[2] = 100; params.lightRasterArea[3] = 100;
+    set_callback_lighting(linear_light);
+    double l;
+    ck_assert(!light_raster_lookup(12.5, 37.5, &l));
+    light_raster_update();
+
+    ck_assert(light_raster_lookup(12.5, 37.5, &l));
+    ck_assert(fabs(l - 237.5) < 1e-9);
+    ck_assert(light_raster_lookup(50, 60, &l));
+    ck_assert(fabs(l - light_field(50, 60)) < 1e-9);
+    ck_assert(light_raster_lookup(0, 0, &l));
+    ck_assert(fabs(l - 100) < 1e-9);
+    ck_assert(!light_raster_lookup(-1, 50, &l));
+    ck_assert(!light_raster_lookup(50, 150, &l));
+
+    // A new callback only shows after the next update.
+    set_callback_lighting(flat_light);
+    light_raster_lookup(12.5, 37.5, &l);
+    ck_assert(fabs(l - 237.5) < 1e-9);
+    light_raster_update();
+    light_raster_lookup(12.5, 37.5, &l);
+    ck_assert(fabs(l - 500) < 1e-9);
+    set_callback_lighting(NULL);
+    params.lightRaster = 0;
+}
+END_TEST
+
+START_TEST(test_batch_callbacks)
+{
+    // Setup: bots on both sides of the wall.
+    int n = 10;
+    create_bots(n);
+    init_all_bots(n);
+    double x[10], y[10];
+    for (int i = 0; i < n; i++) {
+        x[i] = kinematics.x[i] = 25.0 * i;
+        y[i] = kinematics.y[i] = 10.0 * i;
+    }
+
+    // The per-point callback through the shim.
+    set_callback_obstacles(wall_point);
+    apply_user_obstacles(n);
+    for (int i = 0; i < n; i++) {
+        ck_assert(kinematics.x[i] == (x[i] > 100 ? 100 : x[i]));
+        ck_assert(kinematics.y[i] == (x[i] > 100 ? y[i] + 1 : y[i]));
+        kinematics.x[i] = x[i];
+        kinematics.y[i] = y[i];
+    }
+
+    // The batch callback is called once, and wins over the per-point one.
+    set_callback_obstacles_batch(wall_batch);
+    apply_user_obstacles(n);
+    ck_assert_int_eq(n_batch_calls, 1);
+    for (int i = 0; i < n; i++) {
+        ck_assert(kinematics.x[i] == (x[i] > 100 ? 100 : x[i]));
+        ck_assert(kinematics.y[i] == (x[i] > 100 ? y[i] + 1 : y[i]));
+    }
+    set_callback_obstacles_batch(NULL);
+    set_callback_obstacles(NULL);
+
+    // Light levels at all bots from one call.
+    double l;
+    set_callback_lighting_batch(linear_light_batch);
+    ck_assert(!light_bot_lookup(0, &l));
+    light_bots_prepare(n);
+    light_bots_prepare(n);
+    ck_assert_int_eq(n_batch_calls, 2);
+    for (int i = 0; i < n; i++) {
+        ck_assert(light_bot_lookup(i, &l));
+        ck_assert(l == linear_light(kinematics.x[i], kinematics.y[i]));
+    }
+    ck_assert(!light_bot_lookup(n, &l));
+    ck_assert(light_field(10, 20) == linear_light(10, 20));
+    set_callback_lighting_batch(NULL);
+    ck_assert(!light_bot_lookup(0, &l));
+}
+END_TEST
+
+START_TEST(test_trajectory)
+{
+    // Setup: record the positions and user data of bots 4 and 1.
+    int n = 5;
+    create_bots(n);
+    for (int i = 0; i < n; i++) {
+        kinematics.x[i] = i;
+        ((USERDATA *) allbots[i]->data)->num_bot_steps = 10 * i;
+    }
+    int ids[2] = {4, 1};
+    params.stateFields = STATE_POSITION | STATE_USERDATA;
+    params.stateBots = ids;
+    params.n_stateBots = 2;
+    const char *file = "test_trajectory.bin";
+    ck_assert(trajectory_open(file, n));
+    for (int k = 0; k < 3; k++) {
+        kinematics.y[4] = k;
+        trajectory_write_frame(100 * k);
+    }
+    trajectory_close();
+    params.stateBots = NULL;
+    params.n_stateBots = 0;
+
+    FILE *f = fopen(file, "rb");
+    trajectory_header h;
+    ck_assert_int_eq(fread(&h, sizeof(h), 1, f), 1);
+    ck_assert(memcmp(h.magic, TRAJECTORY_MAGIC, 8) == 0);
+    ck_assert_int_eq(h.n_bots, 2);
+    ck_assert_int_eq(h.userdata_size, sizeof(USERDATA));
+    ck_assert_int_eq(h.frame_size, 8 + 2 * 2 * sizeof(double) + 8);
+
+    // Seek to the last frame through the index.
+    trajectory_trailer t;
+    fseek(f, -(long) sizeof(t), SEEK_END);
+    ck_assert_int_eq(fread(&t, sizeof(t), 1, f), 1);
+    ck_assert(memcmp(t.magic, TRAJECTORY_INDEX_MAGIC, 8) == 0);
+    ck_assert_int_eq(t.n_frames, 3);
+    uint64_t offset;
+    fseek(f, t.index_offset + 2 * sizeof(uint64_t), SEEK_SET);
+    ck_assert_int_eq(fread(&offset, sizeof(offset), 1, f), 1);
+    char frame[64];
+    fseek(f, offset, SEEK_SET);
+    ck_assert_int_eq(fread(frame, h.frame_size, 1, f), 1);
+    fclose(f);
+    remove(file);
+
+    uint32_t stamp[2];
+    double xy[4];
+    USERDATA data[2];
+    memcpy(stamp, frame, 8);
+    memcpy(xy, frame + 8, sizeof(xy));
+    memcpy(data, frame + 8 + sizeof(xy), sizeof(data));
+    ck_assert_int_eq(stamp[0], 200);
+    ck_assert_int_eq(stamp[1], 2);
+    ck_assert(xy[0] == 4 && xy[1] == 1 && xy[2] == 2 && xy[3] == 0);
+    ck_assert_int_eq(data[0].num_bot_steps, 40);
+    ck_assert_int_eq(data[1].num_bot_steps, 10);
+}
+END_TEST
+
+START_TEST(test_bot_loader)
+{
+    // The bots may be in any order, allbots is indexed by their IDs.
+    const char *file = "test_bots.json";
+    FILE *f = fopen(file, "w");
+    fprintf(f, "{\"bot_states\": [{\"ID\": 1, \"x_position\": 10.0, \"y_position\": 20.0, \"direction\": 0.5},"
+               " {\"ID\": 0, \"x_position\": 30.0, \"y_position\": 40.0, \"direction\": 1.5}]}");
+    fclose(f);
+    int n = 0;
+    ck_assert(bot_loader(file, &n) == allbots);
+    ck_assert_int_eq(n, 2);
+    ck_assert_int_eq(allbots[0]->ID, 0);
+    ck_assert(kinematics.x[0] == 30 && kinematics.y[1] == 20);
+
+    // A bot file whose IDs leave a gap is refused.
+    f = fopen(file, "w");
+    fprintf(f, "{\"bot_states\": [{\"ID\": 0, \"x_position\": 0.0, \"y_position\": 0.0, \"direction\": 0.0},"
+               " {\"ID\": 2, \"x_position\": 0.0, \"y_position\": 0.0, \"direction\": 0.0}]}");
+    fclose(f);
+    ck_assert(bot_loader(file, &n) == NULL);
+    remove(file);
+}
+END_TEST
+
+START_TEST(test_state_writer)
+{
+    // Setup: bots with a json_state callback.
+    int n = 3;
+    create_bots(n);
+    for (int i = 0; i < n; i++) {
+        kinematics.x[i] = 0.25 * i;
+        kinematics.y[i] = 3;
+        ((USERDATA *) allbots[i]->data)->num_bot_steps = 10 * i;
+    }
+    set_callback_json_state(json_state_steps);
+
+    // Two snapshots as a JSON array, and as NDJSON lines.
+    const char *file = "test_states.json";
+    for (int ndjson = 0; ndjson < 2; ndjson++) {
+        ck_assert(state_writer_open(file, ndjson));
+        state_writer_write(allbots, n, 31);
+        kinematics.x[2] = -1e-20;
+        state_writer_write(allbots, n, 62);
+        state_writer_close();
+
+        json_error_t error;
+        json_t *snapshots[2];
+        FILE *f = fopen(file, "r");
+        char line[4096];
+        if (ndjson) {
+            for (int k = 0; k < 2; k++) {
+                ck_assert(fgets(line, sizeof(line), f) != NULL);
+                snapshots[k] = json_loads(line, 0, &error);
+            }
+            ck_assert(fgets(line, sizeof(line), f) == NULL);
+        } else {
+            json_t *root = json_load_file(file, 0, &error);
+            ck_assert(json_is_array(root));
+            ck_assert_int_eq(json_array_size(root), 2);
+            snapshots[0] = json_incref(json_array_get(root, 0));
+            snapshots[1] = json_incref(json_array_get(root, 1));
+            json_decref(root);
+        }
+        fclose(f);
+        remove(file);
+
+        ck_assert_int_eq(json_integer_value(json_object_get(snapshots[1], "ticks")), 62);
+        json_t *bots = json_object_get(snapshots[1], "bot_states");
+        ck_assert_int_eq(json_array_size(bots), n);
+        json_t *bot = json_array_get(bots, 2);
+        ck_assert_int_eq(json_integer_value(json_object_get(bot, "ID")), 2);
+        ck_assert(json_real_value(json_object_get(bot, "x_position")) == -1e-20);
+        ck_assert(json_real_value(json_object_get(bot, "y_position")) == 3);
+        json_t *state = json_object_get(bot, "state");
+        ck_assert_int_eq(json_integer_value(json_object_get(state, "steps")), 20);
+        json_decref(snapshots[0]);
+        json_decref(snapshots[1]);
+        kinematics.x[2] = 0.5;
+    }
+    set_callback_json_state(NULL);
+
+    // Without the callback the states are empty, and a nan is written as null.
+    kinematics.x[1] = NAN;
+    ck_assert(state_writer_open(file, 1));
+    state_writer_write(allbots, n, 93);
+    state_writer_close();
+    FILE *f = fopen(file, "r");
+    char line[4096];
+    ck_assert(fgets(line, sizeof(line), f) != NULL);
+    fclose(f);
+    remove(file);
+    ck_assert(strstr(line, "\"state\":{},\"x_position\":null,\"y_position\":3.0}") != NULL);
+}
+END_TEST
+
+START_TEST(test_async_writer)
+{
+    // Buffers submitted faster than they are written are written in order,
+    // with the simulation waiting when both buffers are queued.
+    writer_init(2);
+    for (int k = 0; k < 8; k++) {
+        int *data = (int *) writer_acquire(sizeof(int));
+        *data = k;
+        writer_submit(slow_task, sizeof(int));
+    }
+    writer_drain();
+    ck_assert_int_eq(n_written, 8);
+    for (int k = 0; k < 8; k++)
+        ck_assert_int_eq(written[k], k);
+    writer_stats stats;
+    writer_get_stats(&stats);
+    ck_assert_int_eq(stats.submitted, 8);
+    ck_assert_int_eq(stats.max_queued, 2);
+    ck_assert(stats.stalls > 0 && stats.stall_time > 0);
+
+    // The states are copied when they are taken, not when they are written.
+    int n = 2;
+    create_bots(n);
+    const char *file = "test_states_async.json";
+    ck_assert(state_writer_open(file, 1));
+    for (int k = 0; k < 4; k++) {
+        kinematics.x[1] = k;
+        state_writer_write(allbots, n, k);
+    }
+    state_writer_close();
+    writer_finish();
+
+    FILE *f = fopen(file, "r");
+    char line[4096];
+    json_error_t error;
+    for (int k = 0; k < 4; k++) {
+        ck_assert(fgets(line, sizeof(line), f) != NULL);
+        json_t *snapshot = json_loads(line, 0, &error);
+        ck_assert_int_eq(json_integer_value(json_object_get(snapshot, "ticks")), k);
+        json_t *bot = json_array_get(json_object_get(snapshot, "bot_states"), 1);
+        ck_assert(json_real_value(json_object_get(bot, "x_position")) == k);
+        json_decref(snapshot);
+    }
+    fclose(f);
+    remove(file);
+}
+END_TEST
+
+START_TEST(test_checkpoint)
+{
+    // Setup: bots with some state, and the global clock and seed.
+    int n = 3;
+    create_bots(n);
+    for (int i = 0; i < n; i++) {
+        kinematics.x[i] = 10.5 * i;
+        kinematics.turn_rate_r[i] = 0.25;
+        allbots[i]->tx_ticks = 40 + i;
+        allbots[i]->rand_count = 7;
+        allbots[i]->g_led = 2;
+        allbots[i]->user_loop = dummy_loop;
+        ((USERDATA *) allbots[i]->data)->num_bot_steps = 100 + i;
+    }
+    kilo_ticks = 1234;
+    rng_seed(99);
+    const char *file = "test_checkpoint.bin";
+    checkpoint_run run = {51.5, 1236, 3}, loaded;
+    ck_assert(checkpoint_save(file, n, &run));
+    ck_assert_int_eq(checkpoint_bots(file), n);
+
+    // A new set of bots, restored from the checkpoint after their main().
+    create_bots(n);
+    for (int i = 0; i < n; i++)
+        allbots[i]->user_loop = id_loop;
+    kilo_ticks = 0;
+    rng_seed(1);
+    ck_assert(checkpoint_load(file, n, &loaded));
+    remove(file);
+
+    ck_assert(loaded.time == 51.5);
+    ck_assert_int_eq(loaded.n_step, 1236);
+    ck_assert_int_eq(loaded.video_frame, 3);
+    ck_assert_int_eq(kilo_ticks, 1234);
+    ck_assert_int_eq(rng_get_seed(), 99);
+    for (int i = 0; i < n; i++) {
+        ck_assert(kinematics.x[i] == 10.5 * i);
+        ck_assert(kinematics.turn_rate_r[i] == 0.25);
+        ck_assert_int_eq(allbots[i]->tx_ticks, 40 + i);
+        ck_assert_int_eq(allbots[i]->rand_count, 7);
+        ck_assert_int_eq(allbots[i]->g_led, 2);
+        ck_assert_int_eq(((USERDATA *) allbots[i]->data)->num_bot_steps, 100 + i);
+        // the functions are the ones of this run
+        ck_assert(allbots[i]->user_loop == id_loop);
+    }
+
+    // Not a checkpoint, or of another number of bots.
+    ck_assert_int_eq(checkpoint_bots("no_such_file.bin"), 0);
+    ck_assert(checkpoint_save(file, n, &run));
+    ck_assert(!checkpoint_load(file, n + 1, &loaded));
+    remove(file);
+    rng_seed(0);
+    kilo_ticks = 0;
+}
+END_TEST
+
+START_TEST(test_state_resume)
+{
+    // Setup: two states written before a checkpoint, one after.
+    int n = 2;
+    create_bots(n);
+    const char *file = "test_states_resume.json";
+    ck_assert(state_writer_open(file, 0));
+    state_writer_write(allbots, n, 1);
+    state_writer_write(allbots, n, 2);
+    int n_written;
+    uint64_t offset = state_writer_tell(&n_written);
+    ck_assert_int_eq(n_written, 2);
+    state_writer_write(allbots, n, 3);
+    state_writer_close();
+
+    // The resumed run replaces the state after the checkpoint.
+    ck_assert(state_writer_resume(file, 0, offset, n_written));
+    state_writer_write(allbots, n, 4);
+    state_writer_close();
+    json_error_t error;
+    json_t *root = json_load_file(file, 0, &error);
+    ck_assert_int_eq(json_array_size(root), 3);
+    ck_assert_int_eq(json_integer_value(json_object_get(json_array_get(root, 2), "ticks")), 4);
+    json_decref(root);
+    remove(file);
+    ck_assert(!state_writer_resume(file, 0, offset, n_written));
+
+    // The same with a trajectory, whose index is rebuilt.
+    params.stateFields = STATE_POSITION;
+    file = "test_trajectory_resume.bin";
+    ck_assert(trajectory_open(file, n));
+    trajectory_write_frame(1);
+    trajectory_write_frame(2);
+    int n_frames;
+    offset = trajectory_tell(&n_frames);
+    trajectory_write_frame(3);
+    trajectory_close();
+    ck_assert(trajectory_resume(file, n, n_frames));
+    trajectory_write_frame(4);
+    trajectory_close();
+
+    FILE *f = fopen(file, "rb");
+    trajectory_trailer t;
+    fseek(f, -(long) sizeof(t), SEEK_END);
+    ck_assert_int_eq(fread(&t, sizeof(t), 1, f), 1);
+    ck_assert_int_eq(t.n_frames, 3);
+    uint64_t last;
+    fseek(f, t.index_offset + 2 * sizeof(uint64_t), SEEK_SET);
+    ck_assert_int_eq(fread(&last, sizeof(last), 1, f), 1);
+    ck_assert_int_eq(last, offset);
+    uint32_t stamp[2];
+    fseek(f, last, SEEK_SET);
+    ck_assert_int_eq(fread(stamp, sizeof(stamp), 1, f), 1);
+    ck_assert_int_eq(stamp[0], 4);
+    ck_assert_int_eq(stamp[1], 2);
+    fclose(f);
+    remove(file);
+}
+END_TEST
+
+START_TEST(test_comm_neighbors_lazy)
+{
+    // Setup: a jittered lattice of bots, without collisions.
+    int n = 150;
+    create_bots(n);
+    init_all_bots(n);
+    params.useGrid = 1;
+    for (int i = 0; i < n; i++) {
+        kinematics.x[i] = 50.0 * (i % 15) + (7 * i) % 10;
+        kinematics.y[i] = 50.0 * (i / 15) + (3 * i) % 10;
+    }
+    update_interactions_grid(n);
+    int n_entries = neighbors.offset[n];
+    int *offset = malloc((n+1) * sizeof(int));
+    int *index = malloc(n_entries * sizeof(int));
+    double *dist = malloc(n_entries * sizeof(double));
+    memcpy(offset, neighbors.offset, (n+1) * sizeof(int));
+    memcpy(index, neighbors.index, n_entries * sizeof(int));
+    memcpy(dist, neighbors.dist, n_entries * sizeof(double));
+
+    // Lazily, the store only holds bots in collision range,
+    // and the listed bots get the same rows as before.
+    params.lazyCommNeighbors = 1;
+    update_interactions_grid(n);
+    ck_assert_int_eq(neighbors.offset[n], 0);
+    int list[50];
+    for (int k = 0; k < 50; k++)
+        list[k] = 3 * k + 1;
+    pool_init(3);
+    neighbor_store *c = comm_neighbors(n, list, 50);
+    for (int i = 0; i < n; i++) {
+        int row = c->offset[i+1] - c->offset[i];
+        if (i % 3 != 1) {
+            ck_assert_int_eq(row, 0);
+            continue;
+        }
+        ck_assert_int_eq(row, offset[i+1] - offset[i]);
+        for (int k = 0; k < row; k++) {
+            ck_assert_int_eq(c->index[c->offset[i] + k], index[offset[i] + k]);
+            ck_assert(c->dist[c->offset[i] + k] == dist[offset[i] + k]);
+        }
+    }
+    pool_init(1);
+    params.lazyCommNeighbors = 0;
+    params.useGrid = 0;
+    free(offset);
+    free(index);
+    free(dist);
+}
+END_TEST
+
+// Messaging callbacks that log what happens, for test_batched_delivery.
+message_t test_msg[30];
+int test_log[20], n_test_log;
+message_t *test_tx(void) {
+    test_msg[kilo_uid].data[0] = kilo_uid;
+    return &test_msg[kilo_uid];
+}
+void test_rx(message_t *m, distance_measurement_t *d) {
+    test_log[n_test_log++] = 100 * kilo_uid + m->data[0];
+}
+void test_tx_success(void) {
+    test_log[n_test_log++] = 1000 + kilo_uid;
+}
+
+START_TEST(test_batched_delivery)
+{
+    // Setup: three bots in a row, 1 hears 0 and 2.
+    int n = 3;
+    create_bots(n);
+    params.msg_success_rate = 1;
+    params.batchedDelivery = 1;
+    for (int i = 0; i < n; i++) {
+        kinematics.x[i] = 50.0 * i;
+        allbots[i]->tx_ticks = 0;
+        allbots[i]->kilo_message_tx = test_tx;
+        allbots[i]->kilo_message_rx = test_rx;
+        allbots[i]->kilo_message_tx_success = test_tx_success;
+    }
+    update_interactions_grid(n);
+    tx_wheel_reset();
+
+    // Each receiver gets its messages in a row, ordered by sender,
+    // and the senders are told afterwards.
+    process_messaging(n);
+    int expected[] = {1, 100, 102, 201, 1000, 1001, 1002};
+    ck_assert_int_eq(n_test_log, 7);
+    for (int k = 0; k < 7; k++)
+        ck_assert_int_eq(test_log[k], expected[k]);
+    params.batchedDelivery = 0;
+}
+END_TEST
+
+// Per bot record of the messages received, in order, for test_batched_delivery_parallel.
+long test_rx_seq[30];
+int test_tx_done[30];
+void test_rx_seq_cb(message_t *m, distance_measurement_t *d) {
+    test_rx_seq[kilo_uid] = 100 * test_rx_seq[kilo_uid] + m->data[0] + 1;
+}
+void test_tx_done_cb(void) {
+    test_tx_done[kilo_uid]++;
+}
+
+START_TEST(test_batched_delivery_parallel)
+{
+    // Setup: a row of bots, each hears its two neighbors.
+    int n = 30;
+    create_bots(n);
+    params.msg_success_rate = 1;
+    params.batchedDelivery = 1;
+    params.parallelUserLoop = 1;
+    for (int i = 0; i < n; i++) {
+        kinematics.x[i] = 50.0 * i;
+        allbots[i]->tx_ticks = 0;
+        allbots[i]->kilo_message_tx = test_tx;
+        allbots[i]->kilo_message_rx = test_rx_seq_cb;
+        allbots[i]->kilo_message_tx_success = test_tx_done_cb;
+        test_rx_seq[i] = 0;
+        test_tx_done[i] = 0;
+    }
+    update_interactions_grid(n);
+    tx_wheel_reset();
+
+    // With receivers split between three threads, every bot still gets
+    // its messages in sender order, and each sender is told once.
+    pool_init(3);
+    process_messaging(n);
+    for (int i = 0; i < n; i++) {
+        long expected = 0;
+        if (i > 0)
+            expected = i;
+        if (i < n-1)
+            expected = 100 * expected + i + 2;
+        ck_assert_int_eq(test_rx_seq[i], expected);
+        ck_assert_int_eq(test_tx_done[i], 1);
+    }
+    pool_init(1);
+    params.parallelUserLoop = 0;
+    params.batchedDelivery = 0;
+}
+END_TEST
+
+START_TEST(test_update_interactions_skin)
+{
+    // Setup.
+    int n = 3;
+    params.neighborSkin = 20;
+    create_bots(n);
+    init_all_bots(n);
+    kinematics.x[0] = 0.0;
+    kinematics.y[0] = 0.0;
+    kinematics.x[1] = 200.0;
+    kinematics.y[1] = 0.0;
+    kinematics.x[2] = 80.0;
+    kinematics.y[2] = 0.0;
+
+    // 0 and 2 are candidates, but out of range.
+    update_interactions_grid(n);
+    ck_assert_int_eq(n_neighbors(0), 0);
+    ck_assert_int_eq(n_neighbors(2), 0);
+
+    // Moves smaller than skin/2 reuse the candidates.
+    kinematics.x[0] = 8.0;
+    kinematics.x[2] = 74.0;
+    update_interactions_grid(n);
+    ck_assert_int_eq(n_neighbors(0), 1);
+    ck_assert_int_eq(n_neighbors(1), 0);
+    ck_assert_int_eq(n_neighbors(2), 1);
+    ck_assert(fabs(neighbors.dist[neighbors.offset[0]] - 66.0) < 1e-9);
+
+    // A larger move triggers a new search.
+    kinematics.x[1] = 100.0;
+    update_interactions_grid(n);
+    ck_assert_int_eq(n_neighbors(1), 1);
+    ck_assert_int_eq(n_neighbors(2), 2);
+    params.neighborSkin = 0;
 }
 END_TEST
 
@@ -416,21 +1523,45 @@ Suite *add_suite(void)
 
     tcase_add_test(tc_core, test_new_kilobot);
     tcase_add_test(tc_core, test_create_bots);
+    tcase_add_test(tc_core, test_bot_arena);
     tcase_add_test(tc_core, test_init_all_bots);
     tcase_add_test(tc_core, test_me);
     tcase_add_test(tc_core, test_run_all_bots);
+    tcase_add_test(tc_core, test_run_all_bots_parallel);
     tcase_add_test(tc_core, test_update_bot_history);
+    tcase_add_test(tc_core, test_history_memory);
     tcase_add_test(tc_core, test_manage_bot_history_memory);
     tcase_add_test(tc_core, test_move_bot_forward);
     tcase_add_test(tc_core, test_turn_bot_right);
     tcase_add_test(tc_core, test_turn_bot_left);
+    tcase_add_test(tc_core, test_update_locations_simd);
+    tcase_add_test(tc_core, test_rng);
     tcase_add_test(tc_core, test_bot_dist);
     tcase_add_test(tc_core, test_normalise);
     tcase_add_test(tc_core, test_separation_unit_vector);
     tcase_add_test(tc_core, test_separate_clashing_bots);
-    tcase_add_test(tc_core, test_reset_n_in_range_indices);
-    tcase_add_test(tc_core, test_update_n_in_range_indices);
+    tcase_add_test(tc_core, test_neighbors_reset);
+    tcase_add_test(tc_core, test_neighbors_build);
     tcase_add_test(tc_core, test_update_interactions);
+    tcase_add_test(tc_core, test_update_interactions_grid);
+    tcase_add_test(tc_core, test_update_interactions_hash);
+    tcase_add_test(tc_core, test_update_interactions_threads);
+    tcase_add_test(tc_core, test_update_interactions_skin);
+    tcase_add_test(tc_core, test_tx_wheel);
+    tcase_add_test(tc_core, test_collision_grid);
+    tcase_add_test(tc_core, test_collision_solver_jacobi);
+    tcase_add_test(tc_core, test_obstacles);
+    tcase_add_test(tc_core, test_light_raster);
+    tcase_add_test(tc_core, test_batch_callbacks);
+    tcase_add_test(tc_core, test_trajectory);
+    tcase_add_test(tc_core, test_bot_loader);
+    tcase_add_test(tc_core, test_state_writer);
+    tcase_add_test(tc_core, test_async_writer);
+    tcase_add_test(tc_core, test_checkpoint);
+    tcase_add_test(tc_core, test_state_resume);
+    tcase_add_test(tc_core, test_comm_neighbors_lazy);
+    tcase_add_test(tc_core, test_batched_delivery);
+    tcase_add_test(tc_core, test_batched_delivery_parallel);
     suite_add_tcase(s, tc_core);
 
     return s;
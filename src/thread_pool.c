@@ -0,0 +1,128 @@
+/* Worker threads for the simulator, see thread_pool.h.
+ *
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<pthread.h>
+
+#define NDEBUG // define to turn assertions off
+#include<assert.h>
+#include"thread_pool.h"
+
+static int pool_size = 1;
+static pthread_t *workers = NULL;
+static int *worker_id = NULL;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+// the current job, a new one is started by increasing generation
+static pool_task job_task;
+static void *job_arg;
+static unsigned long generation = 0;
+static unsigned long start_generation = 0; // generation when the workers were started
+static int running = 0;
+static int quit = 0;
+
+static void *worker(void *p)
+{
+  int t = *(int *) p;
+  unsigned long seen = start_generation;
+
+  pthread_mutex_lock(&pool_lock);
+  while (1)
+    {
+      while (generation == seen && !quit)
+	pthread_cond_wait(&pool_start, &pool_lock);
+      if (quit)
+	break;
+      seen = generation;
+      pool_task task = job_task;
+      void *arg = job_arg;
+      int n = pool_size;
+      pthread_mutex_unlock(&pool_lock);
+
+      task(arg, t, n);
+
+      pthread_mutex_lock(&pool_lock);
+      if (--running == 0)
+	pthread_cond_signal(&pool_done);
+    }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+static void pool_stop(void)
+{
+  pthread_mutex_lock(&pool_lock);
+  quit = 1;
+  pthread_cond_broadcast(&pool_start);
+  pthread_mutex_unlock(&pool_lock);
+
+  for (int t = 1; t < pool_size; t++)
+    pthread_join(workers[t], NULL);
+
+  quit = 0;
+  pool_size = 1;
+}
+
+/* Start n_threads-1 workers, replacing any earlier pool.
+ * Does nothing if the pool already has this size.
+ */
+void pool_init(int n_threads)
+{
+  if (n_threads < 1)
+    n_threads = 1;
+  if (n_threads == pool_size)
+    return;
+
+  pool_stop();
+
+  workers   = realloc(workers,   n_threads * sizeof(pthread_t));
+  worker_id = realloc(worker_id, n_threads * sizeof(int));
+  assert(workers != NULL && worker_id != NULL);
+
+  pool_size = n_threads;
+  start_generation = generation;
+  for (int t = 1; t < n_threads; t++)
+    {
+      worker_id[t] = t;
+      if (pthread_create(&workers[t], NULL, worker, &worker_id[t]) != 0)
+	{
+	  fprintf(stderr, "Could not start thread %d, running with %d threads.\n", t, t);
+	  pool_size = t;
+	  break;
+	}
+    }
+}
+
+void pool_run(pool_task task, void *arg)
+{
+  if (pool_size == 1)
+    {
+      task(arg, 0, 1);
+      return;
+    }
+
+  pthread_mutex_lock(&pool_lock);
+  job_task = task;
+  job_arg = arg;
+  running = pool_size - 1;
+  generation++;
+  pthread_cond_broadcast(&pool_start);
+  pthread_mutex_unlock(&pool_lock);
+
+  task(arg, 0, pool_size);
+
+  pthread_mutex_lock(&pool_lock);
+  while (running > 0)
+    pthread_cond_wait(&pool_done, &pool_lock);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+int pool_threads(void)
+{
+  return pool_size;
+}
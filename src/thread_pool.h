@@ -0,0 +1,24 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/* A fixed pool of worker threads for the data parallel parts of a step.
+ *
+ * pool_run(task, arg) calls task(arg, t, n) once for every thread t = 0 ... n-1,
+ * where thread 0 is the caller, and returns when all calls have finished.
+ * Tasks split their work with pool_range(), so that the partition only
+ * depends on the number of threads.
+ */
+typedef void (*pool_task)(void *arg, int thread, int n_threads);
+
+void pool_init(int n_threads);
+void pool_run(pool_task task, void *arg);
+int pool_threads(void);
+
+/* The part [*lo, *hi) of 0 ... n-1 handled by thread t of n_threads. */
+static inline void pool_range(int n, int t, int n_threads, int *lo, int *hi)
+{
+  *lo = (long) n * t / n_threads;
+  *hi = (long) n * (t+1) / n_threads;
+}
+
+#endif
@@ -0,0 +1,240 @@
+/* Binary trajectory files, see trajectory.h.
+ *
+ * The frames are filled on the simulation thread, in a staging buffer of
+ * the writer (async_writer.h), which writes them to the file. The index
+ * only depends on the frame size, so it is kept here.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fseeko and ftruncate
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+
+#include"skilobot.h"
+#include"params.h"
+#include"trajectory.h"
+#include"async_writer.h"
+
+extern int UserdataSize;
+
+static struct {
+  FILE *f;
+  trajectory_header header;
+  uint32_t *ids;        // the recorded bots
+  uint64_t offset;      // file offset of the next frame
+  uint64_t *index;
+  int n_frames, allocated_frames;
+} traj;
+
+static uint32_t pad8(uint32_t n)
+{
+  return (n + 7) / 8 * 8;
+}
+
+/* Fill in the header and the IDs of the recorded bots, and return the
+ * size of the IDs in the file.
+ */
+static uint32_t plan_frames(int n_bots)
+{
+  // the recorded bots, without IDs that don't exist
+  int n = simparams->stateBots ? simparams->n_stateBots : n_bots;
+  traj.ids = malloc((n + 2) * sizeof(uint32_t));
+  int k = 0;
+  for (int i = 0; i < n; i++)
+    {
+      int ID = simparams->stateBots ? simparams->stateBots[i] : i;
+      if (ID < n_bots)
+	traj.ids[k++] = ID;
+      else
+	fprintf(stderr, "Bot %d in stateBots does not exist.\n Ignoring it.\n", ID);
+    }
+  n = k;
+
+  trajectory_header *h = &traj.header;
+  memcpy(h->magic, TRAJECTORY_MAGIC, 8);
+  h->version = 1;
+  h->fields = simparams->stateFields;
+  h->n_bots = n;
+  h->userdata_size = (h->fields & STATE_USERDATA) ? UserdataSize : 0;
+  h->frame_size = 2 * sizeof(uint32_t);
+  if (h->fields & STATE_POSITION)
+    h->frame_size += 2 * n * sizeof(double);
+  if (h->fields & STATE_DIRECTION)
+    h->frame_size += n * sizeof(double);
+  if (h->fields & STATE_LED)
+    h->frame_size += pad8(3 * n);
+  if (h->fields & STATE_USERDATA)
+    h->frame_size += pad8(n * h->userdata_size);
+  h->reserved = 0;
+  h->timestep = simparams->timeStep;
+
+  // the IDs, padded with zeros
+  traj.ids[n] = traj.ids[n + 1] = 0;
+  return pad8(n * sizeof(uint32_t));
+}
+
+int trajectory_open(const char *filename, int n_bots)
+{
+  traj.f = fopen(filename, "wb");
+  if (traj.f == NULL)
+    return 0;
+
+  uint32_t ids_size = plan_frames(n_bots);
+  fwrite(&traj.header, sizeof(trajectory_header), 1, traj.f);
+  fwrite(traj.ids, 1, ids_size, traj.f);
+  traj.offset = sizeof(trajectory_header) + ids_size;
+  traj.n_frames = 0;
+  return 1;
+}
+
+static void grow_index(void)
+{
+  traj.allocated_frames = traj.allocated_frames ? 2 * traj.allocated_frames : 1024;
+  traj.index = realloc(traj.index, traj.allocated_frames * sizeof(uint64_t));
+  if (traj.index == NULL)
+    {
+      fprintf(stderr, "Could not allocate the trajectory index.\n");
+      exit(1);
+    }
+}
+
+/* Continue a trajectory from a checkpoint, where it held n_frames frames.
+ * The header must be the one this run would write. The frames after
+ * n_frames, and the index, are cut off; the index is rebuilt from the
+ * frame size. Returns 0 if the file is missing, shorter or different.
+ */
+int trajectory_resume(const char *filename, int n_bots, int n_frames)
+{
+  traj.f = fopen(filename, "r+b");
+  if (traj.f == NULL)
+    return 0;
+
+  uint32_t ids_size = plan_frames(n_bots);
+  const trajectory_header *h = &traj.header;
+  trajectory_header stored;
+  uint32_t *ids = malloc(ids_size);
+  uint64_t first = sizeof(trajectory_header) + ids_size;
+  traj.offset = first + (uint64_t) n_frames * h->frame_size;
+  int ok = ids != NULL && fread(&stored, sizeof(stored), 1, traj.f) == 1 &&
+    memcmp(&stored, h, sizeof(stored)) == 0 &&
+    fread(ids, 1, ids_size, traj.f) == ids_size && memcmp(ids, traj.ids, ids_size) == 0 &&
+    fseeko(traj.f, 0, SEEK_END) == 0 && ftello(traj.f) >= (off_t) traj.offset &&
+    ftruncate(fileno(traj.f), traj.offset) == 0 && fseeko(traj.f, traj.offset, SEEK_SET) == 0;
+  free(ids);
+  if (!ok)
+    {
+      fclose(traj.f);
+      traj.f = NULL;
+      return 0;
+    }
+
+  traj.n_frames = 0;
+  for (int k = 0; k < n_frames; k++)
+    {
+      if (traj.n_frames == traj.allocated_frames)
+	grow_index();
+      traj.index[traj.n_frames++] = first + (uint64_t) k * h->frame_size;
+    }
+  return 1;
+}
+
+// The size of the frames written so far, and their number, for a checkpoint.
+uint64_t trajectory_tell(int *n_frames)
+{
+  // the frames are in the file when the checkpoint is
+  writer_drain();
+  if (traj.f != NULL)
+    fflush(traj.f);
+  *n_frames = traj.n_frames;
+  return traj.offset;
+}
+
+// on the writer thread
+static void traj_write_task(char *frame, size_t len)
+{
+  fwrite(frame, 1, len, traj.f);
+}
+
+void trajectory_write_frame(uint32_t ticks)
+{
+  if (traj.f == NULL)
+    return;
+
+  const trajectory_header *h = &traj.header;
+  int n = h->n_bots;
+  char *p = writer_acquire(h->frame_size);
+  uint32_t stamp[2] = {ticks, traj.n_frames};
+  memcpy(p, stamp, sizeof(stamp));
+  p += sizeof(stamp);
+
+  if (h->fields & STATE_POSITION)
+    {
+      double *x = (double *) p, *y = x + n;
+      for (int i = 0; i < n; i++)
+	{
+	  x[i] = kinematics.x[traj.ids[i]];
+	  y[i] = kinematics.y[traj.ids[i]];
+	}
+      p += 2 * n * sizeof(double);
+    }
+  if (h->fields & STATE_DIRECTION)
+    {
+      double *dir = (double *) p;
+      for (int i = 0; i < n; i++)
+	dir[i] = kinematics.direction[traj.ids[i]];
+      p += n * sizeof(double);
+    }
+  if (h->fields & STATE_LED)
+    {
+      uint8_t *led = (uint8_t *) p;
+      for (int i = 0; i < n; i++)
+	{
+	  kilobot *bot = allbots[traj.ids[i]];
+	  led[i] = bot->r_led;
+	  led[n + i] = bot->g_led;
+	  led[2 * n + i] = bot->b_led;
+	}
+      memset(led + 3 * n, 0, pad8(3 * n) - 3 * n);
+      p += pad8(3 * n);
+    }
+  if (h->fields & STATE_USERDATA)
+    {
+      size_t stride;
+      char *data = bots_userdata(&stride);
+      for (int i = 0; i < n; i++)
+	memcpy(p + i * h->userdata_size, data + traj.ids[i] * stride, h->userdata_size);
+      memset(p + n * h->userdata_size, 0, pad8(n * h->userdata_size) - n * h->userdata_size);
+    }
+
+  if (traj.n_frames == traj.allocated_frames)
+    grow_index();
+  traj.index[traj.n_frames++] = traj.offset;
+  writer_submit(traj_write_task, h->frame_size);
+  traj.offset += h->frame_size;
+}
+
+void trajectory_close(void)
+{
+  if (traj.f == NULL)
+    return;
+  writer_drain();
+
+  trajectory_trailer t;
+  t.n_frames = traj.n_frames;
+  t.index_offset = traj.offset;
+  memcpy(t.magic, TRAJECTORY_INDEX_MAGIC, 8);
+  fwrite(traj.index, sizeof(uint64_t), traj.n_frames, traj.f);
+  fwrite(&t, sizeof(t), 1, traj.f);
+  if (ferror(traj.f))
+    fprintf(stderr, "Error writing the trajectory file.\n");
+  fclose(traj.f);
+
+  traj.f = NULL;
+  free(traj.ids);
+  free(traj.index);
+  traj.ids = NULL;
+  traj.index = NULL;
+  traj.n_frames = traj.allocated_frames = 0;
+}
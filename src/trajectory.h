@@ -0,0 +1,65 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include<stdint.h>
+
+/* Binary trajectory files, for stateFormat "binary". The frames are
+ * written to disk during the run, instead of being collected as JSON.
+ *
+ * Layout, in the byte order of the machine that wrote the file:
+ *   header   a trajectory_header, then the IDs of the recorded bots as
+ *            uint32, padded to a multiple of 8 bytes
+ *   frames   frame_size bytes each, starting right after the header:
+ *              uint32 ticks, uint32 frame number
+ *              with STATE_POSITION:  double x[n], then double y[n]
+ *              with STATE_DIRECTION: double direction[n]
+ *              with STATE_LED:       uint8 r[n], g[n], b[n]
+ *              with STATE_USERDATA:  userdata_size bytes for each bot
+ *            where n is the number of recorded bots, in the order of
+ *            their IDs in the header. The LED and user data blocks are
+ *            padded to a multiple of 8 bytes.
+ *   index    uint64 file offset of each frame
+ *   trailer  a trajectory_trailer
+ *
+ * The index and the trailer are written when the run ends. The frames
+ * have a fixed size, so a file cut short is still readable up to the
+ * last whole frame.
+ */
+#define TRAJECTORY_MAGIC       "KBTRAJ01"
+#define TRAJECTORY_INDEX_MAGIC "KBINDEX1"
+
+typedef struct {
+  char magic[8];          // TRAJECTORY_MAGIC
+  uint32_t version;       // 1
+  uint32_t fields;        // STATE_* flags of the fields in the frames
+  uint32_t n_bots;        // number of recorded bots
+  uint32_t userdata_size; // bytes of user data per bot, 0 without STATE_USERDATA
+  uint32_t frame_size;    // bytes per frame
+  uint32_t reserved;
+  double timestep;        // simulation time step in s
+} trajectory_header;
+
+typedef struct {
+  uint64_t n_frames;
+  uint64_t index_offset;  // file offset of the index
+  char magic[8];          // TRAJECTORY_INDEX_MAGIC
+} trajectory_trailer;
+
+// Start a trajectory file with the stateFields of the stateBots, or of all
+// n_bots bots. Returns 0 if the file can't be opened.
+int trajectory_open(const char *filename, int n_bots);
+
+// Continue a trajectory of n_frames frames from a checkpoint, cutting off
+// what came after. Returns 0 if the file doesn't match this run.
+int trajectory_resume(const char *filename, int n_bots, int n_frames);
+
+// The file size up to the last frame, and the number of frames.
+uint64_t trajectory_tell(int *n_frames);
+
+// Append a frame with the current state of the recorded bots.
+void trajectory_write_frame(uint32_t ticks);
+
+// Write the index and close the file.
+void trajectory_close(void);
+
+#endif
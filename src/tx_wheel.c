@@ -0,0 +1,129 @@
+/* Timing wheel for scheduling the bots' transmissions, see tx_wheel.h.
+ *
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+
+#define NDEBUG // define to turn assertions off
+#include<assert.h>
+#include"skilobot.h"
+#include"tx_wheel.h"
+
+static struct {
+  int n_slots;        // a power of two
+  int *head;          // first bot of each slot, -1 if empty
+  int *next;          // next bot in the same slot, by bot ID
+  int n_bots, allocated_bots;
+  int tick;           // the slots of all ticks up to this one have been emptied
+  int valid;
+  int *due, n_due;    // bots returned by tx_wheel_due()
+  int *late, n_late;  // bots still due after transmitting, for the next step
+} wheel;
+
+void tx_wheel_reset(void)
+{
+  wheel.valid = 0;
+}
+
+static void insert(int bot)
+{
+  int s = (unsigned) allbots[bot]->tx_ticks & (wheel.n_slots - 1);
+  wheel.next[bot] = wheel.head[s];
+  wheel.head[s] = bot;
+}
+
+/* Move the bots of slot s that are due at tick now to the due list. */
+static void drain(int s, int now)
+{
+  int *p = &wheel.head[s];
+  while (*p >= 0)
+    {
+      int bot = *p;
+      if (allbots[bot]->tx_ticks <= now)
+	{
+	  *p = wheel.next[bot];
+	  wheel.due[wheel.n_due++] = bot;
+	}
+      else
+	p = &wheel.next[bot];
+    }
+}
+
+static void rebuild(int n_bots, int now)
+{
+  // a wheel longer than the transmission period, so that a slot mostly
+  // holds the bots of a single tick
+  int n_slots = 16;
+  while (n_slots <= tx_period_ticks)
+    n_slots *= 2;
+
+  if (wheel.n_slots != n_slots)
+    {
+      wheel.n_slots = n_slots;
+      wheel.head = realloc(wheel.head, n_slots * sizeof(int));
+      assert(wheel.head != NULL);
+    }
+  if (wheel.allocated_bots < n_bots)
+    {
+      wheel.allocated_bots = n_bots;
+      wheel.next = realloc(wheel.next, n_bots * sizeof(int));
+      wheel.due  = realloc(wheel.due,  n_bots * sizeof(int));
+      wheel.late = realloc(wheel.late, n_bots * sizeof(int));
+      assert(wheel.next != NULL && wheel.due != NULL && wheel.late != NULL);
+    }
+
+  for (int s = 0; s < n_slots; s++)
+    wheel.head[s] = -1;
+  wheel.n_due = 0;
+  wheel.n_late = 0;
+  for (int i = 0; i < n_bots; i++)
+    if (allbots[i]->tx_ticks <= now)
+      wheel.due[wheel.n_due++] = i;
+    else
+      insert(i);
+
+  wheel.n_bots = n_bots;
+  wheel.tick = now;
+  wheel.valid = 1;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+int tx_wheel_due(int n_bots, int now, int **due)
+{
+  if (!wheel.valid || wheel.n_bots != n_bots || now < wheel.tick)
+    rebuild(n_bots, now);
+  else
+    {
+      wheel.n_due = wheel.n_late;
+      for (int k = 0; k < wheel.n_late; k++)
+	wheel.due[k] = wheel.late[k];
+      wheel.n_late = 0;
+
+      if (now - wheel.tick >= wheel.n_slots)
+	for (int s = 0; s < wheel.n_slots; s++)
+	  drain(s, now);
+      else
+	for (int t = wheel.tick + 1; t <= now; t++)
+	  drain((unsigned) t & (wheel.n_slots - 1), now);
+      wheel.tick = now;
+
+      // bots transmit in the order of their IDs, as when polling all bots
+      qsort(wheel.due, wheel.n_due, sizeof(int), compare_int);
+    }
+
+  *due = wheel.due;
+  return wheel.n_due;
+}
+
+void tx_wheel_schedule(int bot, int now)
+{
+  if (allbots[bot]->tx_ticks <= now)
+    wheel.late[wheel.n_late++] = bot;
+  else
+    insert(bot);
+}
@@ -0,0 +1,21 @@
+#ifndef TX_WHEEL_H
+#define TX_WHEEL_H
+
+/* Timing wheel of the bots' next transmission times (kilobot.tx_ticks).
+ *
+ * Bots are kept in the slot tx_ticks modulo the wheel size, so a step only
+ * visits the slots of the ticks that have passed since the previous step,
+ * instead of every bot.
+ */
+
+// Call when tx_ticks or the number of bots were changed outside process_messaging().
+void tx_wheel_reset(void);
+
+// Remove the bots due at tick now from the wheel, returns their number.
+// *due is set to their IDs, in increasing order.
+int tx_wheel_due(int n_bots, int now, int **due);
+
+// Put a bot back, after tx_ticks was advanced.
+void tx_wheel_schedule(int bot, int now);
+
+#endif